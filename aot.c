@@ -0,0 +1,157 @@
+#include "aot.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler/compiler.h"
+#include "compiler/elf.h"
+
+char* aot_helper_symbols[] = {
+    [RELOC_JIT_PTR] = "ojit_aot_jit",
+    [RELOC_COMPILED_CALLBACK] = "jit_compiled_callback",
+    [RELOC_NEW_OBJECT_CALLBACK] = "jit_new_object_callback",
+    [RELOC_ERROR_HANDLER] = "ojit_jit_error",
+    [RELOC_HASH_TABLE_GET] = "ojit_get_attr_ptr",
+};
+
+struct AOTState {
+    struct ElfObject* elf;
+    uint16_t text;
+    uint16_t data;
+    uint16_t rodata;
+    uint32_t rodata_symbol;
+
+    struct HashTable function_symbols;  // String -> symbol
+    struct HashTable string_symbols;    // String -> symbol
+    uint32_t helper_symbols[RELOC_STRING];
+    bool has_helper_symbol[RELOC_STRING];
+};
+
+
+uint32_t aot_add_function_symbol(struct AOTState* state, String name, uint16_t section, uint64_t value, uint64_t size) {
+    char symbol_name[sizeof(OJIT_AOT_SYMBOL_PREFIX) + name->length];
+    memcpy(symbol_name, OJIT_AOT_SYMBOL_PREFIX, sizeof(OJIT_AOT_SYMBOL_PREFIX) - 1);
+    memcpy(symbol_name + sizeof(OJIT_AOT_SYMBOL_PREFIX) - 1, name->start_ptr, name->length);
+    uint32_t symbol = elf_add_symbol(state->elf, symbol_name, sizeof(OJIT_AOT_SYMBOL_PREFIX) - 1 + name->length,
+                                     ELF_STB_GLOBAL, section == ELF_SHN_UNDEF ? ELF_STT_NOTYPE : ELF_STT_FUNC,
+                                     section, value, size);
+    hash_table_insert(&state->function_symbols, STRING_KEY(name), symbol);
+    return symbol;
+}
+
+
+// Functions from other files are left undefined, for the linker to find
+uint32_t aot_function_symbol(struct AOTState* state, String name) {
+    uint64_t symbol;
+    if (hash_table_get(&state->function_symbols, STRING_KEY(name), &symbol)) return symbol;
+    return aot_add_function_symbol(state, name, ELF_SHN_UNDEF, 0, 0);
+}
+
+
+// Each string becomes a String record in .data. The symbols are weak and named after the contents,
+// so every object linked into a program ends up using the same record, and strings stay comparable by pointer.
+uint32_t aot_string_symbol(struct AOTState* state, String str) {
+    uint64_t symbol;
+    if (hash_table_get(&state->string_symbols, STRING_KEY(str), &symbol)) return symbol;
+
+    uint64_t bytes_offset = elf_section_append(state->elf, state->rodata, str->start_ptr, str->length);
+    struct s_StringRecord record = {.start_ptr = NULL, .length = str->length, .hash = str->hash};
+    uint64_t record_offset = elf_section_append(state->elf, state->data, &record, sizeof(record));
+    elf_add_reloc(state->elf, state->data, record_offset + offsetof(struct s_StringRecord, start_ptr),
+                  state->rodata_symbol, ELF_R_X86_64_64, bytes_offset);
+
+    char symbol_name[64];
+    int name_len = sprintf(symbol_name, "ojit_str_%016llx_%u", (unsigned long long) hash_bytes_64(str->start_ptr, str->length), str->length);
+    symbol = elf_add_symbol(state->elf, symbol_name, name_len, ELF_STB_WEAK, ELF_STT_OBJECT,
+                            state->data, record_offset, sizeof(record));
+    hash_table_insert(&state->string_symbols, STRING_KEY(str), symbol);
+    return symbol;
+}
+
+
+uint32_t aot_reloc_symbol(struct AOTState* state, struct Relocation* reloc) {
+    switch (reloc->kind) {
+        case RELOC_STRING: return aot_string_symbol(state, reloc->target);
+        case RELOC_FUNCTION: return aot_function_symbol(state, reloc->target);
+        default: {
+            if (!state->has_helper_symbol[reloc->kind]) {
+                char* name = aot_helper_symbols[reloc->kind];
+                state->helper_symbols[reloc->kind] = elf_add_symbol(state->elf, name, strlen(name), ELF_STB_GLOBAL, ELF_STT_NOTYPE,
+                                                                    ELF_SHN_UNDEF, 0, 0);
+                state->has_helper_symbol[reloc->kind] = true;
+            }
+            return state->helper_symbols[reloc->kind];
+        }
+    }
+}
+
+
+bool aot_write_object(struct FunctionIR** funcs, uint64_t num_funcs, char* path, bool dump_ir) {
+    MemCtx* aot_mem = create_tagged_mem_ctx(MEM_TAG_COMPILER);
+    struct AOTState state;
+    state.elf = elf_create();
+    state.text = elf_add_section(state.elf, ".text", ELF_SHT_PROGBITS, ELF_SHF_ALLOC | ELF_SHF_EXECINSTR, 16);
+    state.data = elf_add_section(state.elf, ".data", ELF_SHT_PROGBITS, ELF_SHF_ALLOC | ELF_SHF_WRITE, 8);
+    state.rodata = elf_add_section(state.elf, ".rodata", ELF_SHT_PROGBITS, ELF_SHF_ALLOC, 1);
+    // the code doesn't need an executable stack
+    elf_add_section(state.elf, ".note.GNU-stack", ELF_SHT_PROGBITS, 0, 1);
+    state.rodata_symbol = elf_add_symbol(state.elf, NULL, 0, ELF_STB_LOCAL, ELF_STT_SECTION, state.rodata, 0, 0);
+    init_hash_table(&state.function_symbols, aot_mem);
+    init_hash_table(&state.string_symbols, aot_mem);
+    for (int i = 0; i < RELOC_STRING; i++) {
+        state.has_helper_symbol[i] = false;
+    }
+
+    struct GetFunctionCallback callback = {
+        .compiled_callback = NULL,
+        .ir_callback = NULL,
+        .new_object_callback = NULL,
+        .jit_ptr = NULL,
+        .aot = true,
+        .dump_ir = dump_ir,
+        .source_markers = false,
+    };
+
+    // every function gets its symbol before any relocation is written, so calls within the file stay local
+    MemCtx** compiler_mems = malloc(num_funcs * sizeof(MemCtx*));
+    struct CompiledFunction* compiled_funcs = malloc(num_funcs * sizeof(struct CompiledFunction));
+    uint64_t* text_offsets = malloc(num_funcs * sizeof(uint64_t));
+    for (uint64_t i = 0; i < num_funcs; i++) {
+        compiler_mems[i] = create_tagged_mem_ctx(MEM_TAG_COMPILER);
+        compiled_funcs[i] = ojit_compile_function(funcs[i], compiler_mems[i], callback, NULL);
+        struct CompiledFunction* compiled = &compiled_funcs[i];
+        // the linker fills these in, so don't leak this process's addresses into the file
+        for (uint32_t r = 0; r < compiled->num_relocs; r++) {
+            memset(compiled->mem + compiled->relocs[r].offset, 0, 4);
+        }
+        text_offsets[i] = elf_section_append(state.elf, state.text, compiled->mem, compiled->size);
+        aot_add_function_symbol(&state, funcs[i]->name, state.text, text_offsets[i], compiled->size);
+    }
+
+    for (uint64_t i = 0; i < num_funcs; i++) {
+        struct CompiledFunction* compiled = &compiled_funcs[i];
+        for (uint32_t r = 0; r < compiled->num_relocs; r++) {
+            struct Relocation* reloc = &compiled->relocs[r];
+            // the displacement ends the instruction, and RIP points past it
+            elf_add_reloc(state.elf, state.text, text_offsets[i] + reloc->offset, aot_reloc_symbol(&state, reloc),
+                          ELF_R_X86_64_GOTPCREL, -4);
+        }
+        destroy_mem_ctx(compiler_mems[i]);
+    }
+    free(compiler_mems);
+    free(compiled_funcs);
+    free(text_offsets);
+
+    uint64_t image_size;
+    uint8_t* image = elf_finish(state.elf, &image_size);
+    elf_destroy(state.elf);
+    destroy_mem_ctx(aot_mem);
+
+    FILE* file = fopen(path, "wb");
+    bool ok = file != NULL && fwrite(image, 1, image_size, file) == image_size;
+    if (file != NULL && fclose(file) != 0) ok = false;
+    free(image);
+    return ok;
+}
@@ -0,0 +1,19 @@
+#ifndef OJIT_AOT_H
+#define OJIT_AOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "asm_ir.h"
+
+// Prefix of the symbol every function is exported under, so "main" doesn't clash with the C entry point
+#define OJIT_AOT_SYMBOL_PREFIX "ojit_fn_"
+
+// Compiles funcs into an ELF64 x86-64 object file, one global symbol per function.
+// The code still uses the Windows x64 calling convention (declare the symbols with OJIT_JIT_ABI),
+// and references the runtime through the symbols ojit_aot_jit, jit_new_object_callback, ojit_jit_error
+// and ojit_get_attr_ptr. Calls between functions go straight to the other function's symbol.
+// Every address is loaded from the GOT, so .text has no dynamic relocations and the object can go into a PIE.
+bool aot_write_object(struct FunctionIR** funcs, uint64_t num_funcs, char* path, bool dump_ir);
+
+#endif //OJIT_AOT_H
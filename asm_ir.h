@@ -1,22 +1,36 @@
 #ifndef OJIT_ASM_IR_H
 #define OJIT_ASM_IR_H
 
+#include <stdatomic.h>
+
 #include "ojit_def.h"
 #include "ojit_mem.h"
 
 #include "ojit_string.h"
 #include "hash_table.h"
 
-#define FOREACH_INSTR(iter_var, iter_over) LAListIter iter_##iter_var; \
-                                           lalist_init_iter(&iter_##iter_var, (iter_over), 0, sizeof(Instruction)); \
-                                           Instruction* iter_var; \
-                                           while (((iter_var) = lalist_iter_next(&iter_##iter_var)) != NULL)
+// Instructions live in their function's value table, and refer to each other by their number in it
+#define IR_VALUE(func, ref) ((Instruction*) stable_vec_get(&(func)->values, (ref)))
+#define IR_REF(instr) ((instr)->base.value)
+#define BLOCK_INSTR(block, index) IR_VALUE((block)->func, VEC_GET(&(block)->instrs, IRRef, (index)))
+
+#define FOREACH_INSTR(iter_var, block) uint32_t iter_##iter_var = 0; \
+                                      Instruction* iter_var; \
+                                      while (iter_##iter_var < (block)->instrs.len && \
+                                             ((iter_var) = BLOCK_INSTR((block), iter_##iter_var++)) != NULL)
+
+// The fields every pass looks at are kept in dense arrays by IRRef next to the value table (see FunctionIR.value_ids),
+// so scanning them doesn't pull in the instructions themselves
+#define IR_ID(func, ref) VEC_GET(&(func)->value_ids, uint8_t, (ref))
+#define IR_VALUE_TYPE(func, ref) VEC_GET(&(func)->value_types, uint8_t, (ref))
+#define IR_REFS(func, ref) VEC_GET(&(func)->value_refs, uint16_t, (ref))
 
-#define INC_INSTR(instr) ((instr)->base.refs++)
-#define DEC_INSTR(instr) ((instr)->base.refs--)
-#define INSTR_REF(instr) ((instr)->base.refs)
+#define INC_INSTR(func, instr) (IR_REFS((func), IR_REF(instr))++)
+#define DEC_INSTR(func, instr) (IR_REFS((func), IR_REF(instr))--)
+#define INSTR_REF(func, instr) IR_REFS((func), IR_REF(instr))
 
-#define INSTR_TYPE(val) ((val)->base.id)
+#define INSTR_TYPE(func, val) IR_ID((func), IR_REF(val))
+#define VALUE_TYPE(func, val) IR_VALUE_TYPE((func), IR_REF(val))
 
 // region Registers
 // Idea: add Spilled-reg to mark values which were spilled onto the stack
@@ -55,6 +69,9 @@ typedef struct {
 #define WRAP_NONE() ((VLoc) {.reg = NO_REG, .is_reg = true})
 #define WRAP_REG(reg_) ((VLoc) {.reg = (reg_), .is_reg = true})
 #define WRAP_VAR(offset_) ((VLoc) {.reg = SPILLED_REG, .offset = (offset_), .is_reg = false})
+// Spill slots sit below the saved RBP, slot n at [rbp - (n + 1) * 8], addressed with an 8 bit displacement
+#define VAR_DISP(offset_) ((uint8_t) (-8 * ((int32_t) (offset_) + 1)))
+#define OJIT_MAX_SPILL_SLOTS (16)
 #define IS_ASSIGNED(loc_) ((loc_).reg != NO_REG)
 
 bool loc_equal(VLoc loc_1, VLoc loc_2);
@@ -70,12 +87,18 @@ typedef enum ValueType {
 struct GetFunctionCallback {
     void* compiled_callback;
     void* ir_callback;
+    void* new_object_callback;
     void* jit_ptr;
+    bool aot;  // globals are linked directly instead of being looked up through compiled_callback
+    bool profile;  // count block entries and CBranch edges in the function's profile_counters
+    bool dump_ir;  // print the IR before compiling it
+    bool source_markers;  // record which block and IR instruction each piece of code was emitted for
 };
 
 // region Instruction
 typedef union u_InstructionIR Instruction;
 typedef Instruction* IRValue;
+typedef uint32_t IRRef;  // index into FunctionIR.values
 
 enum InstructionID {
     ID_INSTR_NONE = 0,
@@ -92,17 +115,15 @@ enum InstructionID {
     ID_NEW_OBJECT_IR,
 };
 
+// Kept small since every instruction pays for it. The opcode, type and use count are in the function's side tables,
+// and registers are tracked by the compiler (see AssemblerState.locs).
 struct InstructionBase  {
-    VLoc loc;
-    enum InstructionID id;
-    uint16_t refs;
-    uint16_t index;
-    enum ValueType type;
+    IRRef value;  // this instruction's number in the function
+    uint32_t index;  // position in its block
 };
 
 struct ParameterIR {
     struct InstructionBase base;
-    VLoc entry_loc;
     String var_name;
 };
 
@@ -113,14 +134,14 @@ struct IntIR {
 
 struct AddIR {
     struct InstructionBase base;
-    Instruction* a;
-    Instruction* b;
+    IRRef a;
+    IRRef b;
 };
 
 struct SubIR {
     struct InstructionBase base;
-    Instruction* a;
-    Instruction* b;
+    IRRef a;
+    IRRef b;
 };
 
 enum Comparison {
@@ -139,14 +160,14 @@ extern enum Comparison inverted_cmp[16];
 struct CompareIR {
     struct InstructionBase base;
     enum Comparison cmp;
-    Instruction* a;
-    Instruction* b;
+    IRRef a;
+    IRRef b;
 };
 
 struct CallIR {
     struct InstructionBase base;
-    Instruction* callee;
-    LAList* arguments;
+    IRRef callee;
+    Vec* arguments;  // IRRefs
 };
 
 struct GlobalIR {
@@ -156,19 +177,19 @@ struct GlobalIR {
 
 struct GetAttrIR {
     struct InstructionBase base;
-    Instruction* obj;
+    IRRef obj;
     String attr;
 };
 
 struct GetLocIR {
     struct InstructionBase base;
-    Instruction* loc;
+    IRRef loc;
 };
 
 struct SetLocIR {
     struct InstructionBase base;
-    Instruction* loc;
-    Instruction* value;
+    IRRef loc;
+    IRRef value;
 };
 
 struct NewObjectIR {
@@ -205,7 +226,7 @@ struct TerminatorBase {
 
 struct ReturnIR {
     struct TerminatorBase base;
-    Instruction* value;
+    IRRef value;
 };
 
 struct BranchIR {
@@ -215,7 +236,7 @@ struct BranchIR {
 
 struct CBranchIR {
     struct TerminatorBase base;
-    IRValue cond;
+    IRRef cond;
     struct BlockIR* true_target;
     struct BlockIR* false_target;
 };
@@ -230,9 +251,8 @@ union TerminatorIR {
 
 // region Block
 struct BlockIR {
-    LAList* first_instrs;
-    LAList* last_instrs;
-    uint16_t num_instrs;
+    Vec instrs;  // IRRefs, in order
+    struct FunctionIR* func;
     uint16_t num_params;
     uint32_t block_index;
 
@@ -243,21 +263,65 @@ struct BlockIR {
 
     void* data;
 
+    // filled in by jit_read_profile
+    uint64_t exec_count;
+    uint64_t true_count;  // how often the CBranch ending this block went to its true target
+
     struct BlockIR* prev_block;
     struct BlockIR* next_block;
 };
 // endregion
 
 // region Function
+// One compiled version of a function. Versions are never freed, since an older one may still be running further up some stack.
+struct CompiledCode {
+    void* code;
+    size_t size;
+    struct StackMap* stack_maps;
+    uint32_t num_stack_maps;
+    struct SourceMarker* source_markers;  // NULL unless the JIT keeps them, see jit_enable_source_markers
+    uint32_t num_source_markers;
+    struct CompiledCode* previous;  // the version this one replaced
+};
+
+enum CompileStatus {
+    COMPILE_NONE = 0,
+    COMPILE_QUEUED,
+    COMPILE_RUNNING,
+};
+
 struct FunctionIR {
     String name;
-    LAList* last_blocks;
-
+    MemCtx* ir_mem;  // everything below down to last_block lives in it, NULL once the IR has been released
+    Vec blocks;  // struct BlockIR*, by block_index
+    StableVec values;  // Instructions, by IRRef
+    Vec value_ids;  // uint8_t enum InstructionID, by IRRef
+    Vec value_types;  // uint8_t enum ValueType, by IRRef
+    Vec value_refs;  // uint16_t use counts, by IRRef
+
+    // layout order
     struct BlockIR* first_block;
     struct BlockIR* last_block;
-    uint32_t num_blocks;
 
-    void* compiled;
+    // identifies the function's source text (from "def" to the closing brace) across runs
+    uint64_t source_hash;
+    uint32_t source_length;
+    uint32_t source_line;  // line of "def", starting at 1
+    String source_file;
+
+    // the latest compiled version, set once everything in it has been filled in
+    _Atomic(struct CompiledCode*) compiled_code;
+    // the latest version's code, set right after compiled_code so it can be called without going through it
+    _Atomic(void*) compiled;
+
+    bool optimized;
+    // two counters per block (see GetFunctionCallback.profile), never freed since instrumented code may still be running
+    uint64_t* profile_counters;
+    bool has_profile;  // the blocks' counts are filled in, and the function is laid out by them when it is compiled
+
+    // guarded by the JIT's compile queue lock
+    enum CompileStatus compile_status;
+    struct FunctionIR* next_queued;
 };
 // endregion Function
 
@@ -10,23 +10,26 @@ enum Comparison inverted_cmp[16] = {
         [ IF_GREATER_EQUAL - 0x80 ] = IF_LESS,
 };
 
-void init_block(struct BlockIR* block, MemCtx* ctx) {
-    block->first_instrs = block->last_instrs = lalist_grow(ctx, NULL, NULL);
-    block->num_instrs = 0;
+void init_block(struct BlockIR* block, struct FunctionIR* func, MemCtx* ctx) {
+    init_vec(&block->instrs, ctx, sizeof(IRRef), 8);
+    block->func = func;
     block->num_params = 0;
 
     block->terminator.ir_base.id = ID_TERM_NONE;
 
     block->data = NULL;
+    block->exec_count = 0;
+    block->true_count = 0;
 
     block->has_vars = false;
     init_hash_table(&block->variables, ctx);
 }
 
 struct BlockIR* function_add_block(struct FunctionIR* func, MemCtx* ctx) {
-    struct BlockIR* block = lalist_grow_add(&func->last_blocks, sizeof(struct BlockIR));
-    func->num_blocks++;
-    init_block(block, ctx);
+    struct BlockIR* block = ojit_alloc(ctx, sizeof(struct BlockIR));
+    block->block_index = func->blocks.len;
+    *(struct BlockIR**) vec_push(&func->blocks) = block;
+    init_block(block, func, ctx);
     return block;
 }
 
@@ -39,11 +42,14 @@ IRBuilder* create_builder(struct FunctionIR* function_ir, MemCtx* ctx) {
 }
 
 Instruction* builder_add_instr(IRBuilder* builder) {
-    Instruction* instr = lalist_grow_add(&builder->current_block->last_instrs, sizeof(Instruction));
-    instr->base.loc = ((VLoc) {.reg = NO_REG, .offset = 0, .is_reg = true});
-    instr->base.refs = 0;
-    instr->base.index = builder->current_block->num_instrs++;
-    instr->base.type = TYPE_UNKNOWN;
+    struct FunctionIR* func = builder->function;
+    Instruction* instr = stable_vec_push(&func->values);
+    instr->base.value = func->values.len - 1;
+    *(uint8_t*) vec_push(&func->value_ids) = ID_INSTR_NONE;
+    *(uint8_t*) vec_push(&func->value_types) = TYPE_UNKNOWN;
+    *(uint16_t*) vec_push(&func->value_refs) = 0;
+    *(IRRef*) vec_push(&builder->current_block->instrs) = instr->base.value;
+    instr->base.index = builder->current_block->instrs.len - 1;
     return instr;
 }
 
@@ -71,8 +77,8 @@ void builder_temp_swap_block(IRBuilder* builder, struct BlockIR* block_ir) {
 
 void builder_enter_block(IRBuilder* builder, struct BlockIR* block_ir) {
     builder->current_block = block_ir;
-    FOREACH_INSTR(curr_instr, block_ir->first_instrs) {
-        if (INSTR_TYPE(curr_instr) == ID_BLOCK_PARAMETER_IR) {
+    FOREACH_INSTR(curr_instr, block_ir) {
+        if (INSTR_TYPE(builder->function, curr_instr) == ID_BLOCK_PARAMETER_IR) {
             struct ParameterIR* param = &curr_instr->ir_parameter;
             builder_add_variable(builder, param->var_name, (IRValue) param);
         } else {
@@ -84,8 +90,7 @@ void builder_enter_block(IRBuilder* builder, struct BlockIR* block_ir) {
 IRValue builder_add_parameter(IRBuilder* builder, String var_name) {
     struct ParameterIR* instr = &builder_add_instr(builder)->ir_parameter;
     instr->var_name = var_name;
-    instr->entry_loc = WRAP_REG(NO_REG);
-    INSTR_TYPE(instr) = ID_BLOCK_PARAMETER_IR;
+    INSTR_TYPE(builder->function, instr) = ID_BLOCK_PARAMETER_IR;
     builder->current_block->num_params++;
     return (IRValue) instr;
 }
@@ -117,109 +122,108 @@ IRValue builder_get_variable(IRBuilder* builder, String var_name) {
 IRValue builder_Int(IRBuilder* builder, int32_t constant) {
     struct IntIR* instr = &builder_add_instr(builder)->ir_int;
     instr->constant = constant;
-    INSTR_TYPE(instr) = ID_INT_IR;
+    INSTR_TYPE(builder->function, instr) = ID_INT_IR;
     return (Instruction*) instr;
 }
 
 IRValue builder_Add(IRBuilder* builder, IRValue a, IRValue b) {
     struct AddIR* instr = &builder_add_instr(builder)->ir_add;
-    instr->a = a;
-    instr->b = b;
-    INC_INSTR(a);
-    INC_INSTR(b);
-    INSTR_TYPE(instr) = ID_ADD_IR;
+    instr->a = IR_REF(a);
+    instr->b = IR_REF(b);
+    INC_INSTR(builder->function, a);
+    INC_INSTR(builder->function, b);
+    INSTR_TYPE(builder->function, instr) = ID_ADD_IR;
     return (Instruction*) instr;
 }
 
 IRValue builder_Sub(IRBuilder* builder, IRValue a, IRValue b) {
     struct SubIR* instr = &builder_add_instr(builder)->ir_sub;
-    instr->a = a;
-    instr->b = b;
-    INC_INSTR(a);
-    INC_INSTR(b);
-    INSTR_TYPE(instr) = ID_SUB_IR;
+    instr->a = IR_REF(a);
+    instr->b = IR_REF(b);
+    INC_INSTR(builder->function, a);
+    INC_INSTR(builder->function, b);
+    INSTR_TYPE(builder->function, instr) = ID_SUB_IR;
     return (Instruction*) instr;
 }
 
 IRValue builder_Cmp(IRBuilder* builder, enum Comparison cmp, IRValue a, IRValue b) {
     struct CompareIR* instr = &builder_add_instr(builder)->ir_cmp;
     instr->cmp = cmp;
-    instr->a = a;
-    instr->b = b;
-    INC_INSTR(a);
-    INC_INSTR(b);
-    INSTR_TYPE(instr) = ID_CMP_IR;
+    instr->a = IR_REF(a);
+    instr->b = IR_REF(b);
+    INC_INSTR(builder->function, a);
+    INC_INSTR(builder->function, b);
+    INSTR_TYPE(builder->function, instr) = ID_CMP_IR;
     return (Instruction*) instr;
 }
 
 IRValue builder_Call(IRBuilder* builder, IRValue callee) {
     struct CallIR* instr = &builder_add_instr(builder)->ir_call;
-    instr->callee = callee;
-    instr->arguments = lalist_grow(builder->ir_mem, NULL, NULL);
-    INSTR_TYPE(instr) = ID_CALL_IR;
+    instr->callee = IR_REF(callee);
+    instr->arguments = new_vec(builder->ir_mem, sizeof(IRRef), 4);
+    INSTR_TYPE(builder->function, instr) = ID_CALL_IR;
     return (Instruction*) instr;
 }
 
-void builder_Call_argument(IRValue call_instr, IRValue argument) {
+void builder_Call_argument(IRBuilder* builder, IRValue call_instr, IRValue argument) {
     struct CallIR* instr = &call_instr->ir_call;
-    Instruction** ptr = lalist_grow_add(&instr->arguments, sizeof(IRValue));
-    *ptr = argument;
-    INC_INSTR(argument);
+    *(IRRef*) vec_push(instr->arguments) = IR_REF(argument);
+    INC_INSTR(builder->function, argument);
 }
 
 IRValue builder_Global(IRBuilder* builder, String name) {
     struct GlobalIR* instr = &builder_add_instr(builder)->ir_global;
     instr->name = name;
-    INSTR_TYPE(instr) = ID_GLOBAL_IR;
+    INSTR_TYPE(builder->function, instr) = ID_GLOBAL_IR;
     return (Instruction*) instr;
 }
 
 IRValue builder_GetAttrIR(IRBuilder* builder, Instruction* obj, String attr) {
     struct GetAttrIR* instr = &builder_add_instr(builder)->ir_get_attr;
-    instr->obj = obj;
+    instr->obj = IR_REF(obj);
     instr->attr = attr;
-    INSTR_TYPE(instr) = ID_GET_ATTR_IR;
-    INC_INSTR(obj);
+    INSTR_TYPE(builder->function, instr) = ID_GET_ATTR_IR;
+    INC_INSTR(builder->function, obj);
     return (Instruction*) instr;
 }
 
 IRValue builder_GetLocIR(IRBuilder* builder, Instruction* loc) {
     struct GetLocIR* instr = &builder_add_instr(builder)->ir_get_loc;
-    instr->loc = loc;
-    INSTR_TYPE(instr) = ID_GET_LOC_IR;
-    INC_INSTR(loc);
+    instr->loc = IR_REF(loc);
+    INSTR_TYPE(builder->function, instr) = ID_GET_LOC_IR;
+    INC_INSTR(builder->function, loc);
     return (Instruction*) instr;
 }
 
 IRValue builder_SetLocIR(IRBuilder* builder, Instruction* loc, Instruction* value) {
     struct SetLocIR* instr = &builder_add_instr(builder)->ir_set_loc;
-    instr->loc = loc;
-    instr->value = value;
-    INSTR_TYPE(instr) = ID_SET_LOC_IR;
-    instr->base.refs = 1;
-    INC_INSTR(loc);
-    INC_INSTR(value);
+    instr->loc = IR_REF(loc);
+    instr->value = IR_REF(value);
+    INSTR_TYPE(builder->function, instr) = ID_SET_LOC_IR;
+    INSTR_REF(builder->function, instr) = 1;
+    INC_INSTR(builder->function, loc);
+    INC_INSTR(builder->function, value);
     return (Instruction*) instr;
 }
 
 IRValue builder_NewObjectIR(IRBuilder* builder) {
     struct NewObjectIR* instr = &builder_add_instr(builder)->ir_new_object;
-    INSTR_TYPE(instr) = ID_NEW_OBJECT_IR;
+    INSTR_TYPE(builder->function, instr) = ID_NEW_OBJECT_IR;
     return (IRValue) instr;
 }
 // endregion
 
 void builder_Return(IRBuilder* builder, IRValue value) {
     struct ReturnIR* term = &builder->current_block->terminator.ir_return;
-    term->value = value;
+    term->value = IR_REF(value);
     term->base.id = ID_RETURN_IR;
-    INC_INSTR(value);
+    INC_INSTR(builder->function, value);
 }
 
 void merge_blocks(IRBuilder* builder, struct BlockIR* to, struct BlockIR* from) {
     if (to->has_vars) {
-        FOREACH_INSTR(curr_instr, to->first_instrs) {
-            if (INSTR_TYPE(curr_instr) == ID_BLOCK_PARAMETER_IR) {
+        FOREACH_INSTR(curr_instr, to) {
+            if (INSTR_TYPE(builder->function, curr_instr) == ID_BLOCK_PARAMETER_IR) {
                 struct ParameterIR* param = &curr_instr->ir_parameter;
                 if (param->var_name == NULL) continue;
                 IRValue arg;
@@ -227,7 +231,7 @@ void merge_blocks(IRBuilder* builder, struct BlockIR* to, struct BlockIR* from)
                     param->var_name = NULL;
                     to->num_params--;
                 } else {
-                    INC_INSTR(arg);
+                    INC_INSTR(builder->function, arg);
                 }
             } else {
                 break;
@@ -240,7 +244,7 @@ void merge_blocks(IRBuilder* builder, struct BlockIR* to, struct BlockIR* from)
         while (curr_entry) {
             builder_add_parameter(builder, curr_entry->key.cmp_obj);
             IRValue arg = (void*) curr_entry->value;
-            INC_INSTR(arg);
+            INC_INSTR(builder->function, arg);
             curr_entry = curr_entry->prev;
         }
         builder_temp_swap_block(builder, original_block);
@@ -259,8 +263,8 @@ void builder_Branch(IRBuilder* builder, struct BlockIR* target) {
 
 void builder_CBranch(IRBuilder* builder, IRValue cond, struct BlockIR* true_target, struct BlockIR* false_target) {
     struct CBranchIR* term = &builder->current_block->terminator.ir_cbranch;
-    term->cond = cond;
-    INC_INSTR(cond);
+    term->cond = IR_REF(cond);
+    INC_INSTR(builder->function, cond);
     term->true_target = true_target;
     term->false_target = false_target;
     term->base.id = ID_CBRANCH_IR;
@@ -272,10 +276,38 @@ void builder_CBranch(IRBuilder* builder, IRValue cond, struct BlockIR* true_targ
 struct FunctionIR* create_function(String name, MemCtx* ctx) {
     struct FunctionIR* function = ojit_alloc(ctx, sizeof(struct FunctionIR));
     function->name = name;
+    function->source_hash = 0;
+    function->source_length = 0;
+    function->source_line = 0;
+    function->source_file = NULL;
+    function->compiled_code = NULL;
     function->compiled = NULL;
-    function->last_blocks = lalist_grow(ctx, NULL, NULL);
-    function->first_block = function->last_block = function_add_block(function, ctx);
+    function->optimized = false;
+    function->profile_counters = NULL;
+    function->has_profile = false;
+    function->compile_status = COMPILE_NONE;
+    function->next_queued = NULL;
+
+    MemCtx* ir_mem = function->ir_mem = create_tagged_mem_ctx(MEM_TAG_IR);
+    init_vec(&function->blocks, ir_mem, sizeof(struct BlockIR*), 8);
+    init_stable_vec(&function->values, ir_mem, sizeof(Instruction));
+    init_vec(&function->value_ids, ir_mem, sizeof(uint8_t), 16);
+    init_vec(&function->value_types, ir_mem, sizeof(uint8_t), 16);
+    init_vec(&function->value_refs, ir_mem, sizeof(uint16_t), 16);
+    function->first_block = function->last_block = function_add_block(function, ir_mem);
     function->first_block->prev_block = NULL;
     function->last_block->next_block = NULL;
     return function;
+}
+
+void release_function_ir(struct FunctionIR* func) {
+    if (func->ir_mem == NULL) return;
+    destroy_mem_ctx(func->ir_mem);
+    func->ir_mem = NULL;
+    func->blocks = (Vec) {0};
+    func->values = (StableVec) {0};
+    func->value_ids = (Vec) {0};
+    func->value_types = (Vec) {0};
+    func->value_refs = (Vec) {0};
+    func->first_block = func->last_block = NULL;
 }
\ No newline at end of file
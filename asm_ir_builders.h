@@ -34,13 +34,16 @@ IRValue builder_GetLocIR(IRBuilder* builder, Instruction* loc);
 IRValue builder_SetLocIR(IRBuilder* builder, Instruction* loc, Instruction* value);
 IRValue builder_NewObjectIR(IRBuilder* builder);
 IRValue builder_Call(IRBuilder* builder, IRValue callee);
-void builder_Call_argument(IRValue call_instr, IRValue argument);
+void builder_Call_argument(IRBuilder* builder, IRValue call_instr, IRValue argument);
 
 void builder_Return(IRBuilder* builder, IRValue value);
 void builder_Branch(IRBuilder* builder, struct BlockIR* target);
 void builder_CBranch(IRBuilder* builder, IRValue cond, struct BlockIR* true_target, struct BlockIR* false_target);
 // endregion
 
+// The function record goes into ctx, its IR gets a context of its own so it can be released separately
 struct FunctionIR* create_function(String name, MemCtx* ctx);
+// Frees the blocks and values, leaving an empty function behind. The record itself stays valid.
+void release_function_ir(struct FunctionIR* func);
 
 #endif //OJIT_ASM_IR_BUILDERS_H
@@ -0,0 +1,206 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../parser.h"
+#include "../asm_ir_builders.h"
+#include "../compiler/compiler.h"
+#include "bench_util.h"
+
+// Measures how fast generated sources go through the lexer, parser, optimizer and code generator,
+// at growing sizes, so throughput which drops as the input grows shows up.
+
+#define COMPILE_SAMPLES (7)
+
+// region Source Generator
+struct SourceBuffer {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+void source_printf(struct SourceBuffer* buf, char* format, ...) {
+    va_list args;
+    while (true) {
+        va_start(args, format);
+        int written = vsnprintf(buf->data + buf->len, buf->cap - buf->len, format, args);
+        va_end(args);
+        if (buf->len + written < buf->cap) {
+            buf->len += written;
+            return;
+        }
+        buf->cap = buf->cap ? buf->cap * 2 : 4096;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+}
+
+// Lots of small functions calling each other
+void generate_small_functions(struct SourceBuffer* buf, uint32_t num_funcs) {
+    for (uint32_t i = 0; i < num_funcs; i++) {
+        source_printf(buf, "def f%u(a, b) {\n", i);
+        source_printf(buf, "    let c = a + b;\n");
+        source_printf(buf, "    if (c > %u) {\n        c = f%u(c - 1, b);\n    } else {\n        c = c + 1;\n    }\n", i, (i + 1) % num_funcs);
+        source_printf(buf, "    return c;\n}\n\n");
+    }
+}
+
+void generate_nested_statement(struct SourceBuffer* buf, uint32_t depth, uint32_t indent) {
+    if (depth == 0) {
+        source_printf(buf, "%*sx = x + 1;\n", indent, "");
+    } else if (depth % 2 == 0) {
+        source_printf(buf, "%*swhile (n > x) {\n", indent, "");
+        generate_nested_statement(buf, depth - 1, indent + 4);
+        source_printf(buf, "%*sn = n - 1;\n%*s}\n", indent + 4, "", indent, "");
+    } else {
+        source_printf(buf, "%*sif (x < %u) {\n", indent, "", depth);
+        generate_nested_statement(buf, depth - 1, indent + 4);
+        source_printf(buf, "%*s} else {\n%*sx = x - 1;\n%*s}\n", indent, "", indent + 4, "", indent, "");
+    }
+}
+
+// Loops and branches nested depth levels deep
+void generate_nested_functions(struct SourceBuffer* buf, uint32_t num_funcs, uint32_t depth) {
+    for (uint32_t i = 0; i < num_funcs; i++) {
+        source_printf(buf, "def nested%u(n) {\n    let x = 0;\n", i);
+        generate_nested_statement(buf, depth, 4);
+        source_printf(buf, "    return x;\n}\n\n");
+    }
+}
+
+// A single block of num_lines statements per function
+void generate_straight_functions(struct SourceBuffer* buf, uint32_t num_funcs, uint32_t num_lines) {
+    for (uint32_t i = 0; i < num_funcs; i++) {
+        source_printf(buf, "def straight%u(a) {\n    let v0 = a;\n    let v1 = a + 1;\n", i);
+        for (uint32_t line = 2; line < num_lines; line++) {
+            source_printf(buf, "    let v%u = v%u + v%u - %u;\n", line, line - 1, line - 2, line);
+        }
+        source_printf(buf, "    return v%u;\n}\n\n", num_lines - 1);
+    }
+}
+// endregion
+
+struct CompileWorkload {
+    char* name;
+    uint32_t num_funcs;
+    uint32_t shape;  // depth or number of lines
+    void (*generate)(struct SourceBuffer* buf, uint32_t num_funcs, uint32_t shape);
+};
+
+void generate_small(struct SourceBuffer* buf, uint32_t num_funcs, uint32_t shape) {
+    (void) shape;
+    generate_small_functions(buf, num_funcs);
+}
+
+struct CompileWorkload compile_workloads[] = {
+    {"small_functions", 250, 0, generate_small},
+    {"small_functions", 1000, 0, generate_small},
+    {"small_functions", 4000, 0, generate_small},
+    {"nested_depth_8", 100, 8, generate_nested_functions},
+    {"nested_depth_12", 100, 12, generate_nested_functions},
+    {"nested_depth_16", 100, 16, generate_nested_functions},
+    {"straight_10_lines", 1000, 10, generate_straight_functions},
+    {"straight_30_lines", 1000, 30, generate_straight_functions},
+    {"straight_300_lines", 100, 300, generate_straight_functions},
+};
+
+struct CompileSample {
+    double tokens_per_sec;
+    double parse_bytes_per_sec;
+    double optimize_instrs_per_sec;
+    double emit_bytes_per_sec;
+    size_t parsed_reserved;         // arenas holding the parser's tables and every function's IR
+    size_t compiler_peak_reserved;  // most any single function's compile needed at once
+};
+
+struct CompileSample compile_sample(struct SourceBuffer* buf) {
+    MemCtx* string_mem = create_mem_ctx();
+    struct StringTable strings;
+    init_string_table(&strings, string_mem);
+    String source = string_table_add(&strings, buf->data, buf->len);
+
+    MemCtx* lex_mem = create_mem_ctx();
+    uint64_t lex_start = bench_now_ns();
+    uint64_t num_tokens = lex_source(source, &strings, lex_mem);
+    uint64_t lex_ns = bench_now_ns() - lex_start;
+    destroy_mem_ctx(lex_mem);
+
+    MemCtx* ir_mem = create_mem_ctx();
+    MemCtx* parser_mem = create_mem_ctx();
+    struct HashTable functions;
+    init_hash_table(&functions, parser_mem);
+    uint64_t parse_start = bench_now_ns();
+    Parser* parser = create_parser(source, &strings, &functions, ir_mem, parser_mem);
+    parser_parse_source(parser);
+    uint64_t parse_ns = bench_now_ns() - parse_start;
+    struct MemStats mem_stats;
+    mem_ctx_get_stats(ir_mem, &mem_stats);
+    size_t parsed_reserved = mem_stats.reserved;
+    mem_ctx_get_stats(parser_mem, &mem_stats);
+    parsed_reserved += mem_stats.reserved;
+    size_t compiler_peak_reserved = 0;
+
+    struct GetFunctionCallback callback = {0};
+    struct CompileStats stats = {0};
+    uint64_t num_instrs = 0;
+    TableEntry* entry = functions.last_entry;
+    while (entry) {
+        struct FunctionIR* func = (struct FunctionIR*) entry->value;
+        for (struct BlockIR* block = func->first_block; block; block = block->next_block) {
+            num_instrs += block->instrs.len;
+        }
+        mem_ctx_get_stats(func->ir_mem, &mem_stats);
+        parsed_reserved += mem_stats.reserved;
+        MemCtx* compiler_mem = create_mem_ctx();
+        ojit_compile_function(func, compiler_mem, callback, &stats);
+        mem_ctx_get_stats(compiler_mem, &mem_stats);
+        if (mem_stats.peak_reserved > compiler_peak_reserved) compiler_peak_reserved = mem_stats.peak_reserved;
+        destroy_mem_ctx(compiler_mem);
+        release_function_ir(func);
+        entry = entry->prev;
+    }
+    destroy_mem_ctx(parser_mem);
+    destroy_mem_ctx(ir_mem);
+    destroy_mem_ctx(string_mem);
+
+    uint64_t emit_ns = stats.phase_ns[PHASE_EMIT] + stats.phase_ns[PHASE_STITCH];
+    return (struct CompileSample) {
+        .tokens_per_sec = num_tokens * 1e9 / lex_ns,
+        .parse_bytes_per_sec = buf->len * 1e9 / parse_ns,
+        .optimize_instrs_per_sec = num_instrs * 1e9 / stats.phase_ns[PHASE_OPTIMIZE],
+        .emit_bytes_per_sec = stats.code_bytes * 1e9 / emit_ns,
+        .parsed_reserved = parsed_reserved,
+        .compiler_peak_reserved = compiler_peak_reserved,
+    };
+}
+
+
+int main() {
+    printf("%-22s %7s %10s %16s %16s %19s %16s %10s %15s\n", "workload", "funcs", "source KB",
+           "Mtokens/s lexed", "MB/s parsed", "Minstrs/s optimized", "MB/s emitted", "IR KB", "compile peak KB");
+    for (size_t i = 0; i < sizeof(compile_workloads) / sizeof(struct CompileWorkload); i++) {
+        struct CompileWorkload* workload = &compile_workloads[i];
+        struct SourceBuffer buf = {0};
+        workload->generate(&buf, workload->num_funcs, workload->shape);
+
+        double tokens[COMPILE_SAMPLES], parsed[COMPILE_SAMPLES], optimized[COMPILE_SAMPLES], emitted[COMPILE_SAMPLES];
+        // the memory numbers come out the same every time
+        struct CompileSample warmup = compile_sample(&buf);
+        for (int s = 0; s < COMPILE_SAMPLES; s++) {
+            struct CompileSample sample = compile_sample(&buf);
+            tokens[s] = sample.tokens_per_sec;
+            parsed[s] = sample.parse_bytes_per_sec;
+            optimized[s] = sample.optimize_instrs_per_sec;
+            emitted[s] = sample.emit_bytes_per_sec;
+        }
+        printf("%-22s %7u %10.1f %16.2f %16.2f %19.2f %16.2f %10.1f %15.1f\n", workload->name, workload->num_funcs, buf.len / 1024.0,
+               bench_summarize(tokens, COMPILE_SAMPLES).median_ns / 1e6,
+               bench_summarize(parsed, COMPILE_SAMPLES).median_ns / 1e6,
+               bench_summarize(optimized, COMPILE_SAMPLES).median_ns / 1e6,
+               bench_summarize(emitted, COMPILE_SAMPLES).median_ns / 1e6,
+               warmup.parsed_reserved / 1024.0, warmup.compiler_peak_reserved / 1024.0);
+        fflush(stdout);
+        free(buf.data);
+    }
+    return 0;
+}
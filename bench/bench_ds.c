@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hash_table.h"
+#include "../ojit_string.h"
+#include "bench_util.h"
+
+// Microbenchmarks for the containers under the parser, compiler and runtime.
+// Every result is per operation, so the numbers stay comparable across sizes and replacement data structures.
+
+#define MAX_TABLE_SIZE (16384)
+#define LOOKUP_STREAM_LEN (4096)
+
+uint32_t table_sizes[] = {16, 256, 4096, MAX_TABLE_SIZE};
+
+uint64_t bench_random_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64, so every run sees the same data
+uint64_t bench_random() {
+    bench_random_state ^= bench_random_state << 13;
+    bench_random_state ^= bench_random_state >> 7;
+    bench_random_state ^= bench_random_state << 17;
+    return bench_random_state;
+}
+
+// region Identifiers
+char* identifier_parts[] = {
+    "value", "count", "index", "node", "result", "temp", "left", "right", "next", "prev",
+    "size", "len", "total", "item", "key", "entry", "block", "func", "arg", "obj",
+};
+#define NUM_IDENTIFIER_PARTS (sizeof(identifier_parts) / sizeof(char*))
+
+char identifier_chars[MAX_TABLE_SIZE * 32];
+char* identifiers[MAX_TABLE_SIZE];
+uint32_t identifier_lengths[MAX_TABLE_SIZE];
+uint32_t identifier_stream[LOOKUP_STREAM_LEN];  // indices into identifiers, most often the first few
+
+// Like real code, the most common names are short ones (i, n, x), followed by words and then snake_case compounds
+void generate_identifiers() {
+    char* curr = identifier_chars;
+    for (uint32_t i = 0; i < MAX_TABLE_SIZE; i++) {
+        int length;
+        if (i < 26) {
+            length = sprintf(curr, "%c", 'a' + i);
+        } else if (i < 26 + NUM_IDENTIFIER_PARTS) {
+            length = sprintf(curr, "%s", identifier_parts[i - 26]);
+        } else {
+            length = sprintf(curr, "%s_%s%u", identifier_parts[bench_random() % NUM_IDENTIFIER_PARTS],
+                             identifier_parts[bench_random() % NUM_IDENTIFIER_PARTS], i);
+        }
+        identifiers[i] = curr;
+        identifier_lengths[i] = length;
+        curr += length;
+    }
+}
+
+// Zipf distributed with s = 1 over the first num_identifiers names
+void generate_identifier_stream(uint32_t num_identifiers) {
+    double harmonic = 0;
+    for (uint32_t rank = 1; rank <= num_identifiers; rank++) harmonic += 1.0 / rank;
+    for (uint32_t i = 0; i < LOOKUP_STREAM_LEN; i++) {
+        double target = (bench_random() >> 11) * (1.0 / 9007199254740992.0) * harmonic;
+        double sum = 0;
+        uint32_t rank = 1;
+        while (rank < num_identifiers && (sum += 1.0 / rank) < target) rank++;
+        identifier_stream[i] = rank - 1;
+    }
+}
+// endregion
+
+struct DSContext {
+    uint32_t size;
+    void** keys;         // distinct non-null pointers
+    void** missing_keys; // never inserted
+    struct HashTable table;
+    struct StringTable strings;
+    LAList* list;
+    Vec vec;
+    StableVec stable_vec;
+    MemCtx* mem;
+};
+
+// region HashTable
+void hash_table_insert_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MemCtx* mem = create_mem_ctx();
+        struct HashTable table;
+        init_hash_table(&table, mem);
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            hash_table_insert(&table, HASH_KEY(ctx->keys[k]), k);
+        }
+        bench_consume(table.len);
+        destroy_mem_ctx(mem);
+    }
+}
+
+void hash_table_get_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            uint64_t value = 0;
+            hash_table_get(&ctx->table, HASH_KEY(ctx->keys[k]), &value);
+            sum += value;
+        }
+    }
+    bench_consume(sum);
+}
+
+void hash_table_miss_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t found = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            found += hash_table_has(&ctx->table, HASH_KEY(ctx->missing_keys[k]));
+        }
+    }
+    bench_consume(found);
+}
+
+// Takes every key out and puts it back in, which goes through tombstones and reused entries
+void hash_table_remove_insert_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            hash_table_remove(&ctx->table, HASH_KEY(ctx->keys[k]));
+            hash_table_insert(&ctx->table, HASH_KEY(ctx->keys[k]), k);
+        }
+    }
+    bench_consume(ctx->table.len);
+}
+// endregion
+
+// region StringTable
+void string_table_intern_new_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MemCtx* mem = create_mem_ctx();
+        struct StringTable strings;
+        init_string_table(&strings, mem);
+        uint64_t sum = 0;
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            sum += string_table_add(&strings, identifiers[k], identifier_lengths[k])->hash;
+        }
+        bench_consume(sum);
+        pthread_rwlock_destroy(&strings.lock);
+        destroy_mem_ctx(mem);
+    }
+}
+
+// the common case while parsing: looking up names which are already interned
+void string_table_intern_existing_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (uint32_t k = 0; k < LOOKUP_STREAM_LEN; k++) {
+            uint32_t index = identifier_stream[k];
+            sum += string_table_add(&ctx->strings, identifiers[index], identifier_lengths[index])->length;
+        }
+    }
+    bench_consume(sum);
+}
+// endregion
+
+// region MemCtx
+#define ALLOCS_PER_ITERATION (1024)
+
+void mem_ctx_create_destroy_bench(void* ctx_ptr, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        destroy_mem_ctx(create_mem_ctx());
+    }
+}
+
+void mem_ctx_small_allocs_bench(void* ctx_ptr, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        MemCtx* mem = create_mem_ctx();
+        for (uint32_t k = 0; k < ALLOCS_PER_ITERATION; k++) {
+            bench_consume((uint64_t) ojit_alloc(mem, 16));
+        }
+        destroy_mem_ctx(mem);
+    }
+}
+
+// sizes like the compiler's: mostly instructions and list nodes, now and then an array
+uint32_t mixed_alloc_sizes[] = {8, 24, 24, 48, 48, 48, 64, 96, 200, 540};
+#define NUM_MIXED_ALLOC_SIZES (sizeof(mixed_alloc_sizes) / sizeof(uint32_t))
+
+void mem_ctx_mixed_allocs_bench(void* ctx_ptr, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        MemCtx* mem = create_mem_ctx();
+        for (uint32_t k = 0; k < ALLOCS_PER_ITERATION; k++) {
+            bench_consume((uint64_t) ojit_alloc(mem, mixed_alloc_sizes[k % NUM_MIXED_ALLOC_SIZES]));
+        }
+        destroy_mem_ctx(mem);
+    }
+}
+
+// the same allocations in one long-lived context, rewound after each round like the compiler's scratch memory
+void mem_ctx_mark_rewind_bench(void* ctx_ptr, uint64_t iterations) {
+    MemCtx* mem = create_mem_ctx();
+    MemMark mark = mem_ctx_mark(mem);
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (uint32_t k = 0; k < ALLOCS_PER_ITERATION; k++) {
+            bench_consume((uint64_t) ojit_alloc(mem, mixed_alloc_sizes[k % NUM_MIXED_ALLOC_SIZES]));
+        }
+        mem_ctx_rewind(mem, mark);
+    }
+    destroy_mem_ctx(mem);
+}
+// endregion
+
+// region LAList
+void lalist_append_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MemCtx* mem = create_mem_ctx();
+        LAList* list = lalist_new(mem);
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            *(uint64_t*) lalist_grow_add(&list, sizeof(uint64_t)) = k;
+        }
+        destroy_mem_ctx(mem);
+    }
+}
+
+void lalist_iterate_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        FOREACH(item, ctx->list, uint64_t) {
+            sum += *item;
+        }
+    }
+    bench_consume(sum);
+}
+
+void lalist_iterate_rev_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        LAList* last = ctx->list;
+        while (last->next) last = last->next;
+        LAListIter iter;
+        lalist_init_iter(&iter, last, last->len, sizeof(uint64_t));
+        uint64_t* item;
+        while ((item = lalist_iter_prev(&iter)) != NULL) {
+            sum += *item;
+        }
+    }
+    bench_consume(sum);
+}
+// endregion
+
+// region Vec
+void vec_push_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MemCtx* mem = create_mem_ctx();
+        Vec* vec = new_vec(mem, sizeof(uint64_t), 4);
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            *(uint64_t*) vec_push(vec) = k;
+        }
+        destroy_mem_ctx(mem);
+    }
+}
+
+void vec_iterate_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        FOREACH_VEC(item, &ctx->vec, uint64_t) {
+            sum += *item;
+        }
+    }
+    bench_consume(sum);
+}
+
+void stable_vec_push_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    for (uint64_t i = 0; i < iterations; i++) {
+        MemCtx* mem = create_mem_ctx();
+        StableVec vec;
+        init_stable_vec(&vec, mem, sizeof(uint64_t));
+        for (uint32_t k = 0; k < ctx->size; k++) {
+            *(uint64_t*) stable_vec_push(&vec) = k;
+        }
+        destroy_mem_ctx(mem);
+    }
+}
+
+void stable_vec_iterate_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        FOREACH_STABLE(item, &ctx->stable_vec, uint64_t) {
+            sum += *item;
+        }
+    }
+    bench_consume(sum);
+}
+
+// backwards by index, like the code generator walks a block's instructions
+void stable_vec_get_rev_bench(void* ctx_ptr, uint64_t iterations) {
+    struct DSContext* ctx = ctx_ptr;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (int32_t k = (int32_t) ctx->stable_vec.len - 1; k >= 0; k--) {
+            sum += *(uint64_t*) stable_vec_get(&ctx->stable_vec, k);
+        }
+    }
+    bench_consume(sum);
+}
+// endregion
+
+struct DSBenchmark {
+    char* name;
+    BenchFunc func;
+    bool sized;  // runs once per table size
+    uint32_t ops_per_iteration;  // 0 for as many as the table size
+};
+
+struct DSBenchmark ds_benchmarks[] = {
+    {"hash_table/insert", hash_table_insert_bench, true, 0},
+    {"hash_table/get", hash_table_get_bench, true, 0},
+    {"hash_table/miss", hash_table_miss_bench, true, 0},
+    {"hash_table/remove_insert", hash_table_remove_insert_bench, true, 0},
+    {"string_table/intern_new", string_table_intern_new_bench, true, 0},
+    {"string_table/intern_existing", string_table_intern_existing_bench, true, LOOKUP_STREAM_LEN},
+    {"mem_ctx/create_destroy", mem_ctx_create_destroy_bench, false, 1},
+    {"mem_ctx/small_allocs", mem_ctx_small_allocs_bench, false, ALLOCS_PER_ITERATION},
+    {"mem_ctx/mixed_allocs", mem_ctx_mixed_allocs_bench, false, ALLOCS_PER_ITERATION},
+    {"mem_ctx/mark_rewind", mem_ctx_mark_rewind_bench, false, ALLOCS_PER_ITERATION},
+    {"lalist/append", lalist_append_bench, true, 0},
+    {"lalist/iterate", lalist_iterate_bench, true, 0},
+    {"lalist/iterate_rev", lalist_iterate_rev_bench, true, 0},
+    {"vec/push", vec_push_bench, true, 0},
+    {"vec/iterate", vec_iterate_bench, true, 0},
+    {"stable_vec/push", stable_vec_push_bench, true, 0},
+    {"stable_vec/iterate", stable_vec_iterate_bench, true, 0},
+    {"stable_vec/get_rev", stable_vec_get_rev_bench, true, 0},
+};
+
+
+void setup_context(struct DSContext* ctx, uint32_t size, void** keys) {
+    ctx->size = size;
+    ctx->keys = keys;
+    ctx->missing_keys = keys + MAX_TABLE_SIZE;
+    ctx->mem = create_mem_ctx();
+
+    init_hash_table(&ctx->table, ctx->mem);
+    for (uint32_t k = 0; k < size; k++) {
+        hash_table_insert(&ctx->table, HASH_KEY(keys[k]), k);
+    }
+
+    init_string_table(&ctx->strings, ctx->mem);
+    for (uint32_t k = 0; k < size; k++) {
+        string_table_add(&ctx->strings, identifiers[k], identifier_lengths[k]);
+    }
+    generate_identifier_stream(size);
+
+    ctx->list = lalist_new(ctx->mem);
+    LAList* last = ctx->list;
+    for (uint32_t k = 0; k < size; k++) {
+        *(uint64_t*) lalist_grow_add(&last, sizeof(uint64_t)) = k;
+    }
+
+    init_vec(&ctx->vec, ctx->mem, sizeof(uint64_t), 4);
+    init_stable_vec(&ctx->stable_vec, ctx->mem, sizeof(uint64_t));
+    for (uint32_t k = 0; k < size; k++) {
+        *(uint64_t*) vec_push(&ctx->vec) = k;
+        *(uint64_t*) stable_vec_push(&ctx->stable_vec) = k;
+    }
+}
+
+void teardown_context(struct DSContext* ctx) {
+    pthread_rwlock_destroy(&ctx->strings.lock);
+    destroy_mem_ctx(ctx->mem);
+}
+
+
+int main(int argc, char** argv) {
+    // an optional filter on the benchmark names
+    char* filter = argc > 1 ? argv[1] : NULL;
+    struct BenchConfig config = BENCH_DEFAULT_CONFIG;
+
+    generate_identifiers();
+    // the missing keys are the second half, so both halves look alike to the hash function
+    uint64_t* key_targets = malloc(2 * MAX_TABLE_SIZE * sizeof(uint64_t));
+    void** keys = malloc(2 * MAX_TABLE_SIZE * sizeof(void*));
+    for (uint32_t k = 0; k < 2 * MAX_TABLE_SIZE; k++) {
+        keys[k] = &key_targets[k];
+    }
+
+    bench_print_header(stdout);
+    for (size_t s = 0; s < sizeof(table_sizes) / sizeof(uint32_t); s++) {
+        struct DSContext ctx;
+        setup_context(&ctx, table_sizes[s], keys);
+        for (size_t i = 0; i < sizeof(ds_benchmarks) / sizeof(struct DSBenchmark); i++) {
+            struct DSBenchmark* benchmark = &ds_benchmarks[i];
+            // the unsized ones only run once
+            if (!benchmark->sized && s != 0) continue;
+            if (filter && strstr(benchmark->name, filter) == NULL) continue;
+
+            char name[64];
+            if (benchmark->sized) {
+                sprintf(name, "%s(%u)", benchmark->name, table_sizes[s]);
+            } else {
+                sprintf(name, "%s", benchmark->name);
+            }
+            uint64_t ops = benchmark->ops_per_iteration ? benchmark->ops_per_iteration : table_sizes[s];
+            struct BenchResult result = bench_run(&config, benchmark->func, &ctx);
+            bench_result_per_op(&result, ops);
+            bench_print_result(stdout, name, &result);
+        }
+        teardown_context(&ctx);
+    }
+
+    free(keys);
+    free(key_targets);
+    return 0;
+}
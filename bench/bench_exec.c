@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../jit_interpreter.h"
+#include "../asm_ir.h"
+#include "../obj.h"
+#include "../ojit_def.h"
+#include "bench_util.h"
+
+// Every script defines bench(n). scripts/<name>.py holds the same code for CPython, see compare.py
+#ifndef OJIT_BENCH_SCRIPTS
+#define OJIT_BENCH_SCRIPTS "bench/scripts"
+#endif
+
+typedef OJITValue (OJIT_JIT_ABI *BenchEntry)(OJITValue);
+
+struct ExecBenchmark {
+    char* name;
+    int32_t arg;
+    int32_t expected;  // what bench(arg) returns, same as the .py version
+};
+
+struct ExecBenchmark exec_benchmarks[] = {
+    {"loop", 1000, 499500},
+    {"calls", 1000, 1000},
+    {"recursion", 20, 6765},
+    {"attributes", 1000, 500500},
+    {"allocation", 1000, 500500},
+};
+
+struct ExecContext {
+    BenchEntry entry;
+    OJITValue arg;
+};
+
+void run_entry(void* ctx_ptr, uint64_t iterations) {
+    struct ExecContext* ctx = ctx_ptr;
+    uint64_t result = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        result += ctx->entry(ctx->arg);
+    }
+    bench_consume(result);
+}
+
+
+// One row per compiled function of the script, with the events sampled in its code per call of bench
+void print_function_counters(JIT* jit, struct ExecContext* ctx, uint64_t iterations) {
+    if (!bench_counters_available()) return;
+    uint64_t num_funcs;
+    JITFunc* funcs = jit_snapshot_functions(jit, &num_funcs);
+    struct BenchCodeRange* ranges = malloc(num_funcs * sizeof(struct BenchCodeRange));
+    uint32_t num_ranges = 0;
+    for (uint64_t i = 0; i < num_funcs; i++) {
+        struct CompiledCode* version = atomic_load(&funcs[i]->compiled_code);
+        if (version == NULL) continue;
+        ranges[num_ranges++] = (struct BenchCodeRange) {
+            .name = funcs[i]->name->start_ptr,
+            .name_len = funcs[i]->name->length,
+            .start = (uint64_t) version->code,
+            .size = version->size,
+        };
+    }
+    if (bench_profile_code(ranges, num_ranges, run_entry, ctx, iterations)) {
+        for (uint32_t i = 0; i < num_ranges; i++) {
+            bench_print_code_range(stdout, &ranges[i]);
+        }
+    }
+    free(ranges);
+    free(funcs);
+}
+
+
+int main(int argc, char** argv) {
+    char* scripts_dir = argc > 1 ? argv[1] : OJIT_BENCH_SCRIPTS;
+    struct BenchConfig config = BENCH_DEFAULT_CONFIG;
+
+    bench_print_header(stdout);
+    for (size_t i = 0; i < sizeof(exec_benchmarks) / sizeof(struct ExecBenchmark); i++) {
+        struct ExecBenchmark* benchmark = &exec_benchmarks[i];
+        char path[strlen(scripts_dir) + strlen(benchmark->name) + 8];
+        sprintf(path, "%s/%s.txt", scripts_dir, benchmark->name);
+
+        // a JIT per script, since they all define bench
+        JIT* jit = ojit_create_jit();
+        if (!jit_add_file(jit, path)) {
+            fprintf(stderr, "Could not read %s\n", path);
+            return 1;
+        }
+        struct ExecContext ctx = {
+            .entry = jit_require_compiled_function(jit, jit_get_function(jit, "bench", 5), NULL),
+            .arg = INT_AS_VAL(benchmark->arg),
+        };
+        OJITValue check = ctx.entry(ctx.arg);
+        if (!VAL_IS_INT(check)) {
+            fprintf(stderr, "%s did not return an int\n", benchmark->name);
+            return 1;
+        }
+        if ((int32_t) VAL_AS_INT(check) != benchmark->expected) {
+            fprintf(stderr, "%s(%d) returned %d, expected %d\n", benchmark->name, benchmark->arg,
+                    (int32_t) VAL_AS_INT(check), benchmark->expected);
+            return 1;
+        }
+
+        struct BenchResult result = bench_run(&config, run_entry, &ctx);
+        char name[64];
+        snprintf(name, sizeof(name), "%s(%d)", benchmark->name, benchmark->arg);
+        bench_print_result(stdout, name, &result);
+        print_function_counters(jit, &ctx, result.iterations_per_sample);
+    }
+    return 0;
+}
@@ -0,0 +1,359 @@
+#include "bench_util.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+volatile uint64_t bench_sink;
+
+char* bench_counter_names[NUM_BENCH_COUNTERS] = {
+    [BENCH_CYCLES] = "cycles",
+    [BENCH_INSTRUCTIONS] = "instructions",
+    [BENCH_BRANCH_MISSES] = "branch misses",
+    [BENCH_L1I_MISSES] = "L1i misses",
+    [BENCH_L1D_MISSES] = "L1d misses",
+    [BENCH_CACHE_MISSES] = "LLC misses",
+};
+
+uint64_t bench_now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+void bench_consume(uint64_t value) {
+    bench_sink = value;
+}
+
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// nearest rank on the sorted samples
+double percentile(double* sorted, uint32_t num, uint32_t percent) {
+    uint32_t index = (uint32_t) (((uint64_t) percent * (num - 1) + 50) / 100);
+    return sorted[index];
+}
+
+
+void clear_counters(struct BenchCounters* counters, double value) {
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        counters->counts[i] = value;
+    }
+}
+
+
+// region Hardware Counters
+#ifdef __linux__
+#define BENCH_RING_PAGES (64)  // has to be a power of two
+
+// roughly a thousand samples per second for each event; primes, so the samples don't lock onto loops
+uint64_t bench_sample_periods[NUM_BENCH_COUNTERS] = {
+    [BENCH_CYCLES] = 1000003,
+    [BENCH_INSTRUCTIONS] = 1000003,
+    [BENCH_BRANCH_MISSES] = 10007,
+    [BENCH_L1I_MISSES] = 10007,
+    [BENCH_L1D_MISSES] = 10007,
+    [BENCH_CACHE_MISSES] = 1009,
+};
+
+int counter_fds[NUM_BENCH_COUNTERS];
+bool counters_opened = false;
+
+void init_counter_attr(struct perf_event_attr* attr, enum BenchCounter counter) {
+    memset(attr, 0, sizeof(struct perf_event_attr));
+    attr->size = sizeof(struct perf_event_attr);
+    attr->disabled = 1;
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    switch (counter) {
+        case BENCH_CYCLES:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case BENCH_INSTRUCTIONS:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case BENCH_BRANCH_MISSES:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case BENCH_L1I_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case BENCH_L1D_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        default:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+    }
+}
+
+int open_counter(struct perf_event_attr* attr) {
+    int fd = syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+    return fd < 0 ? -1 : fd;
+}
+
+// Each counter is opened on its own, so the ones the CPU has keep working when others are missing
+void open_counters() {
+    if (counters_opened) return;
+    counters_opened = true;
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        init_counter_attr(&attr, i);
+        // with more events than hardware counters, the kernel takes turns, and the counts have to be scaled up
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counter_fds[i] = open_counter(&attr);
+    }
+}
+
+bool bench_counters_available() {
+    open_counters();
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        if (counter_fds[i] >= 0) return true;
+    }
+    return false;
+}
+
+void bench_counters_start() {
+    open_counters();
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        if (counter_fds[i] < 0) continue;
+        ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void bench_counters_stop(struct BenchCounters* counters) {
+    open_counters();
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        counters->counts[i] = -1;
+        if (counter_fds[i] < 0) continue;
+        ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t values[3];  // count, time enabled, time running
+        if (read(counter_fds[i], values, sizeof(values)) != sizeof(values) || values[2] == 0) continue;
+        counters->counts[i] = (double) values[0] * ((double) values[1] / (double) values[2]);
+    }
+}
+
+
+struct SampleRing {
+    int fd;
+    struct perf_event_mmap_page* page;
+    uint8_t* data;
+    uint64_t data_size;
+    uint64_t mapped_size;
+};
+
+bool open_sample_ring(struct SampleRing* ring, enum BenchCounter counter) {
+    struct perf_event_attr attr;
+    init_counter_attr(&attr, counter);
+    attr.sample_period = bench_sample_periods[counter];
+    attr.sample_type = PERF_SAMPLE_IP;
+    ring->fd = open_counter(&attr);
+    if (ring->fd < 0) return false;
+
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    ring->data_size = BENCH_RING_PAGES * page_size;
+    ring->mapped_size = ring->data_size + page_size;  // the first page is the header
+    void* mem = mmap(NULL, ring->mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (mem == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+    ring->page = mem;
+    ring->data = (uint8_t*) mem + page_size;
+    return true;
+}
+
+void close_sample_ring(struct SampleRing* ring) {
+    munmap(ring->page, ring->mapped_size);
+    close(ring->fd);
+}
+
+// Attributes the samples written since the last drain. Records are 8 byte aligned, so their fields never wrap around.
+void drain_sample_ring(struct SampleRing* ring, enum BenchCounter counter, struct BenchCodeRange* ranges, uint32_t num_ranges) {
+    uint64_t head = __atomic_load_n(&ring->page->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->page->data_tail;
+    while (tail < head) {
+        struct perf_event_header* header = (struct perf_event_header*) (ring->data + (tail & (ring->data_size - 1)));
+        if (header->type == PERF_RECORD_SAMPLE) {
+            uint64_t ip = *(uint64_t*) (ring->data + ((tail + sizeof(struct perf_event_header)) & (ring->data_size - 1)));
+            for (uint32_t i = 0; i < num_ranges; i++) {
+                if (ip >= ranges[i].start && ip < ranges[i].start + ranges[i].size) {
+                    ranges[i].counters.counts[counter] += (double) bench_sample_periods[counter];
+                    break;
+                }
+            }
+        }
+        tail += header->size;
+    }
+    __atomic_store_n(&ring->page->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+bool bench_profile_code(struct BenchCodeRange* ranges, uint32_t num_ranges, BenchFunc func, void* ctx, uint64_t iterations) {
+    for (uint32_t i = 0; i < num_ranges; i++) {
+        clear_counters(&ranges[i].counters, -1);
+    }
+    if (iterations == 0 || !bench_counters_available()) return false;
+
+    // one event at a time, so none of them has to share a hardware counter
+    for (int counter = 0; counter < NUM_BENCH_COUNTERS; counter++) {
+        struct SampleRing ring;
+        if (!open_sample_ring(&ring, counter)) continue;
+        for (uint32_t i = 0; i < num_ranges; i++) {
+            ranges[i].counters.counts[counter] = 0;
+        }
+        ioctl(ring.fd, PERF_EVENT_IOC_ENABLE, 0);
+        // draining after every iteration keeps the ring from filling up and dropping samples
+        for (uint64_t iteration = 0; iteration < iterations; iteration++) {
+            func(ctx, 1);
+            drain_sample_ring(&ring, counter, ranges, num_ranges);
+        }
+        ioctl(ring.fd, PERF_EVENT_IOC_DISABLE, 0);
+        drain_sample_ring(&ring, counter, ranges, num_ranges);
+        close_sample_ring(&ring);
+        for (uint32_t i = 0; i < num_ranges; i++) {
+            ranges[i].counters.counts[counter] /= (double) iterations;
+        }
+    }
+    return true;
+}
+#else
+bool bench_counters_available() {
+    return false;
+}
+
+void bench_counters_start() {
+}
+
+void bench_counters_stop(struct BenchCounters* counters) {
+    clear_counters(counters, -1);
+}
+
+bool bench_profile_code(struct BenchCodeRange* ranges, uint32_t num_ranges, BenchFunc func, void* ctx, uint64_t iterations) {
+    for (uint32_t i = 0; i < num_ranges; i++) {
+        clear_counters(&ranges[i].counters, -1);
+    }
+    return false;
+}
+#endif
+// endregion
+
+
+uint64_t time_iterations(BenchFunc func, void* ctx, uint64_t iterations) {
+    uint64_t start = bench_now_ns();
+    func(ctx, iterations);
+    return bench_now_ns() - start;
+}
+
+
+struct BenchResult bench_run(struct BenchConfig* config, BenchFunc func, void* ctx) {
+    // one sample has to be long enough for the clock's resolution not to matter
+    uint64_t iterations = 1;
+    while (time_iterations(func, ctx, iterations) < config->min_sample_ns && iterations < (1ULL << 40)) {
+        iterations *= 2;
+    }
+
+    for (uint32_t i = 0; i < config->warmup_samples; i++) {
+        time_iterations(func, ctx, iterations);
+    }
+
+    uint32_t num_samples = config->samples;
+    if (num_samples == 0) num_samples = 1;
+    if (num_samples > BENCH_MAX_SAMPLES) num_samples = BENCH_MAX_SAMPLES;
+    double samples[BENCH_MAX_SAMPLES];
+    struct BenchCounters counters;
+    bench_counters_start();
+    for (uint32_t i = 0; i < num_samples; i++) {
+        samples[i] = (double) time_iterations(func, ctx, iterations) / (double) iterations;
+    }
+    bench_counters_stop(&counters);
+    struct BenchResult result = bench_summarize(samples, num_samples);
+    result.iterations_per_sample = iterations;
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        if (counters.counts[i] >= 0) result.counters.counts[i] = counters.counts[i] / ((double) iterations * num_samples);
+    }
+    return result;
+}
+
+
+struct BenchResult bench_summarize(double* samples, uint32_t num_samples) {
+    qsort(samples, num_samples, sizeof(double), compare_doubles);
+    struct BenchResult result = {
+        .iterations_per_sample = 1,
+        .samples = num_samples,
+        .min_ns = samples[0],
+        .p10_ns = percentile(samples, num_samples, 10),
+        .median_ns = percentile(samples, num_samples, 50),
+        .p90_ns = percentile(samples, num_samples, 90),
+        .max_ns = samples[num_samples - 1],
+    };
+    clear_counters(&result.counters, -1);
+    return result;
+}
+
+
+void bench_result_per_op(struct BenchResult* result, uint64_t ops_per_iteration) {
+    result->min_ns /= ops_per_iteration;
+    result->p10_ns /= ops_per_iteration;
+    result->median_ns /= ops_per_iteration;
+    result->p90_ns /= ops_per_iteration;
+    result->max_ns /= ops_per_iteration;
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        if (result->counters.counts[i] >= 0) result->counters.counts[i] /= ops_per_iteration;
+    }
+}
+
+
+void print_counters(FILE* stream, struct BenchCounters* counters) {
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        if (counters->counts[i] >= 0) {
+            fprintf(stream, " %14.2f", counters->counts[i]);
+        } else {
+            fprintf(stream, " %14s", "n/a");
+        }
+    }
+    fprintf(stream, "\n");
+}
+
+void bench_print_header(FILE* stream) {
+    fprintf(stream, "%-32s %14s %14s %14s %14s %12s", "benchmark", "median ns", "p10 ns", "p90 ns", "min ns", "iterations");
+    for (int i = 0; i < NUM_BENCH_COUNTERS; i++) {
+        fprintf(stream, " %14s", bench_counter_names[i]);
+    }
+    fprintf(stream, "\n");
+    if (!bench_counters_available()) {
+        fprintf(stderr, "Hardware counters are unavailable (no PMU, or kernel.perf_event_paranoid forbids them), "
+                        "only timings are reported\n");
+    }
+}
+
+void bench_print_result(FILE* stream, char* name, struct BenchResult* result) {
+    fprintf(stream, "%-32s %14.2f %14.2f %14.2f %14.2f %12llu", name, result->median_ns, result->p10_ns, result->p90_ns,
+            result->min_ns, (unsigned long long) result->iterations_per_sample);
+    print_counters(stream, &result->counters);
+    fflush(stream);
+}
+
+void bench_print_code_range(FILE* stream, struct BenchCodeRange* range) {
+    fprintf(stream, "  %-30.*s %14s %14s %14s %14s %12s", range->name_len, range->name, "", "", "", "", "");
+    print_counters(stream, &range->counters);
+    fflush(stream);
+}
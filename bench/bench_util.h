@@ -0,0 +1,81 @@
+#ifndef OJIT_BENCH_UTIL_H
+#define OJIT_BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Runs the measured code `iterations` times
+typedef void (*BenchFunc)(void* ctx, uint64_t iterations);
+
+struct BenchConfig {
+    uint32_t warmup_samples;
+    uint32_t samples;
+    uint64_t min_sample_ns;  // iterations per sample are doubled until a sample takes at least this long
+};
+
+#define BENCH_DEFAULT_CONFIG ((struct BenchConfig) {.warmup_samples = 5, .samples = 31, .min_sample_ns = 10000000})
+#define BENCH_MAX_SAMPLES (1024)
+
+enum BenchCounter {
+    BENCH_CYCLES,
+    BENCH_INSTRUCTIONS,
+    BENCH_BRANCH_MISSES,
+    BENCH_L1I_MISSES,
+    BENCH_L1D_MISSES,
+    BENCH_CACHE_MISSES,  // last level
+    NUM_BENCH_COUNTERS,
+};
+
+extern char* bench_counter_names[NUM_BENCH_COUNTERS];
+
+// Hardware event counts (Linux perf_event_open), negative for the ones which can't be counted here
+struct BenchCounters {
+    double counts[NUM_BENCH_COUNTERS];
+};
+
+// all times and counts are per iteration
+struct BenchResult {
+    uint64_t iterations_per_sample;
+    uint32_t samples;
+    double min_ns;
+    double p10_ns;
+    double median_ns;
+    double p90_ns;
+    double max_ns;
+    struct BenchCounters counters;  // mean over every sample
+};
+
+// A piece of machine code which bench_profile_code attributes events to
+struct BenchCodeRange {
+    char* name;
+    uint32_t name_len;
+    uint64_t start;
+    uint64_t size;
+    struct BenchCounters counters;
+};
+
+uint64_t bench_now_ns();
+// Defeats dead code elimination of results nobody looks at
+void bench_consume(uint64_t value);
+
+struct BenchResult bench_run(struct BenchConfig* config, BenchFunc func, void* ctx);
+// For benchmarks which take their own samples; sorts them in place
+struct BenchResult bench_summarize(double* samples, uint32_t num_samples);
+// Turns per-iteration numbers into per-operation ones, for benchmarks which do several operations per iteration
+void bench_result_per_op(struct BenchResult* result, uint64_t ops_per_iteration);
+
+// False if not even one hardware counter could be opened (no PMU, or perf_event_paranoid doesn't allow it)
+bool bench_counters_available();
+void bench_counters_start();
+void bench_counters_stop(struct BenchCounters* counters);
+// Samples every counter while running func, and adds the sampled events to the range whose code they hit.
+// The counts end up per iteration. Returns false without counters.
+bool bench_profile_code(struct BenchCodeRange* ranges, uint32_t num_ranges, BenchFunc func, void* ctx, uint64_t iterations);
+
+void bench_print_header(FILE* stream);
+void bench_print_result(FILE* stream, char* name, struct BenchResult* result);
+// A row with only the counters, lined up with bench_print_result's
+void bench_print_code_range(FILE* stream, struct BenchCodeRange* range);
+
+#endif //OJIT_BENCH_UTIL_H
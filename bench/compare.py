@@ -0,0 +1,71 @@
+"""Runs the execution benchmarks on ojit and on CPython, and prints them side by side.
+
+usage: python compare.py <path to ojit_bench_exec>
+
+CPython gets the same treatment as bench_util.c: iterations are doubled until a sample takes
+at least 10ms, then 5 warmup samples and 31 measured samples, reported as the median and percentiles.
+"""
+import importlib.util
+import os
+import re
+import subprocess
+import sys
+import time
+
+SCRIPTS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "scripts")
+WARMUP_SAMPLES = 5
+SAMPLES = 31
+MIN_SAMPLE_NS = 10_000_000
+
+
+def percentile(sorted_samples, percent):
+    return sorted_samples[(percent * (len(sorted_samples) - 1) + 50) // 100]
+
+
+def time_iterations(func, arg, iterations):
+    start = time.perf_counter_ns()
+    for _ in range(iterations):
+        func(arg)
+    return time.perf_counter_ns() - start
+
+
+def bench_python(name, arg):
+    spec = importlib.util.spec_from_file_location(name, os.path.join(SCRIPTS_DIR, name + ".py"))
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+
+    iterations = 1
+    while time_iterations(module.bench, arg, iterations) < MIN_SAMPLE_NS:
+        iterations *= 2
+    for _ in range(WARMUP_SAMPLES):
+        time_iterations(module.bench, arg, iterations)
+    samples = sorted(time_iterations(module.bench, arg, iterations) / iterations for _ in range(SAMPLES))
+    return percentile(samples, 10), percentile(samples, 50), percentile(samples, 90)
+
+
+def bench_ojit(binary):
+    output = subprocess.run([binary, SCRIPTS_DIR], check=True, capture_output=True, text=True).stdout
+    results = {}
+    for line in output.splitlines()[1:]:
+        fields = line.split()
+        match = re.fullmatch(r"(\w+)\((\d+)\)", fields[0])
+        if match:
+            results[(match.group(1), int(match.group(2)))] = (float(fields[2]), float(fields[1]), float(fields[3]))
+    return results
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        sys.exit(1)
+
+    ojit_results = bench_ojit(sys.argv[1])
+    print(f"{'benchmark':<24} {'ojit median ns':>16} {'ojit p90 ns':>14} {'cpython median ns':>18} {'cpython p90 ns':>16} {'speedup':>9}")
+    for (name, arg), (_, ojit_median, ojit_p90) in ojit_results.items():
+        _, py_median, py_p90 = bench_python(name, arg)
+        print(f"{name + '(' + str(arg) + ')':<24} {ojit_median:>16.2f} {ojit_p90:>14.2f} {py_median:>18.2f} {py_p90:>16.2f} "
+              f"{py_median / ojit_median:>8.2f}x", flush=True)
+
+
+if __name__ == "__main__":
+    main()
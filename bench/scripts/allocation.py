@@ -0,0 +1,12 @@
+class Obj:
+    pass
+
+
+def bench(n):
+    total = 0
+    while n > 0:
+        obj = Obj()
+        obj.value = n
+        total = total + obj.value
+        n = n - 1
+    return total
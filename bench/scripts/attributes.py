@@ -0,0 +1,13 @@
+class Point:
+    pass
+
+
+def bench(n):
+    point = Point()
+    point.x = 0
+    point.y = 0
+    while n > 0:
+        point.x = point.x + 1
+        point.y = point.y + point.x
+        n = n - 1
+    return point.y
@@ -0,0 +1,10 @@
+def add(a, b):
+    return a + b
+
+
+def bench(n):
+    total = 0
+    while n > 0:
+        total = add(total, 1)
+        n = n - 1
+    return total
@@ -0,0 +1,9 @@
+def fib(n):
+    if n < 2:
+        return n
+    else:
+        return fib(n - 1) + fib(n - 2)
+
+
+def bench(n):
+    return fib(n)
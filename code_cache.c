@@ -0,0 +1,264 @@
+#include "code_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Each function is stored in its own file, named after its key:
+//     CodeCacheHeader | StackMap[num_stack_maps] | CodeCacheReloc[num_relocs] | code | string bytes
+#define OJIT_CODE_CACHE_MAGIC (0x434A4F4F)  // "OOJC"
+
+struct CodeCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t source_length;
+    uint32_t code_size;
+    uint32_t num_stack_maps;
+    uint32_t num_relocs;
+    uint32_t strings_size;
+    uint32_t padding;
+};
+
+struct CodeCacheReloc {
+    uint32_t offset;
+    uint32_t kind;
+    uint32_t string_offset;  // only used by RELOC_STRING, into the string bytes at the end of the file
+    uint32_t string_length;
+};
+
+struct CodeCache {
+    char* dir;
+    size_t dir_len;
+    _Atomic(uint32_t) tmp_counter;
+};
+
+
+struct CodeCache* create_code_cache(char* dir) {
+#ifdef WIN32
+    if (!CreateDirectoryA(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) return NULL;
+#else
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return NULL;
+    // anyone else who can write here could plant code for us to run
+    struct stat dir_stat;
+    if (lstat(dir, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) return NULL;
+    if (dir_stat.st_uid != geteuid() || (dir_stat.st_mode & (S_IWGRP | S_IWOTH))) return NULL;
+#endif
+    struct CodeCache* cache = malloc(sizeof(struct CodeCache));
+    cache->dir_len = strlen(dir);
+    cache->dir = malloc(cache->dir_len + 1);
+    memcpy(cache->dir, dir, cache->dir_len + 1);
+    atomic_init(&cache->tmp_counter, 0);
+    return cache;
+}
+
+
+void destroy_code_cache(struct CodeCache* cache) {
+    free(cache->dir);
+    free(cache);
+}
+
+
+uint64_t code_cache_key(struct FunctionIR* func) {
+    uint64_t options = 0;
+#ifdef OJIT_OPTIMIZATIONS
+    options |= 1;
+#endif
+    uint64_t key_parts[] = {OJIT_CODE_CACHE_VERSION, options, func->source_hash, func->source_length};
+    return hash_bytes_64((char*) key_parts, sizeof(key_parts));
+}
+
+
+// path needs room for the directory plus 40 characters
+void cache_entry_path(struct CodeCache* cache, uint64_t key, char* path) {
+    sprintf(path, "%s/%016llx.ojc", cache->dir, (unsigned long long) key);
+}
+
+
+// region Load
+struct CacheMapping {
+    uint8_t* data;
+    size_t size;
+#ifdef WIN32
+    HANDLE mapping;
+#endif
+};
+
+// The mapping is copy-on-write, so relocations can be patched in place without touching the file
+bool map_cache_entry(char* path, struct CacheMapping* mapping) {
+#ifdef WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    mapping->mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping->mapping == NULL) return false;
+    mapping->data = MapViewOfFile(mapping->mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (mapping->data == NULL) {
+        CloseHandle(mapping->mapping);
+        return false;
+    }
+    mapping->size = file_size.QuadPart;
+    return true;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    mapping->data = data;
+    mapping->size = file_stat.st_size;
+    return true;
+#endif
+}
+
+void unmap_cache_entry(struct CacheMapping* mapping) {
+#ifdef WIN32
+    UnmapViewOfFile(mapping->data);
+    CloseHandle(mapping->mapping);
+#else
+    munmap(mapping->data, mapping->size);
+#endif
+}
+
+
+bool code_cache_load(struct CodeCache* cache, struct FunctionIR* func, struct StringTable* strings,
+                     struct CodeHeap* heap, struct GetFunctionCallback callback, struct CompiledCode* version) {
+    uint64_t key = code_cache_key(func);
+    char path[cache->dir_len + 40];
+    cache_entry_path(cache, key, path);
+
+    struct CacheMapping mapping;
+    if (!map_cache_entry(path, &mapping)) return false;
+
+    // anything which doesn't look exactly right is treated as a miss
+    struct CodeCacheHeader* header = (struct CodeCacheHeader*) mapping.data;
+    if (mapping.size < sizeof(struct CodeCacheHeader) ||
+        header->magic != OJIT_CODE_CACHE_MAGIC ||
+        header->version != OJIT_CODE_CACHE_VERSION ||
+        header->key != key ||
+        header->source_length != func->source_length ||
+        mapping.size != sizeof(struct CodeCacheHeader) +
+                        (uint64_t) header->num_stack_maps * sizeof(struct StackMap) +
+                        (uint64_t) header->num_relocs * sizeof(struct CodeCacheReloc) +
+                        header->code_size + header->strings_size) {
+        unmap_cache_entry(&mapping);
+        return false;
+    }
+    struct StackMap* stack_maps = (struct StackMap*) (header + 1);
+    struct CodeCacheReloc* relocs = (struct CodeCacheReloc*) (stack_maps + header->num_stack_maps);
+    uint8_t* code = (uint8_t*) (relocs + header->num_relocs);
+    char* string_bytes = (char*) (code + header->code_size);
+
+    for (uint32_t i = 0; i < header->num_relocs; i++) {
+        struct CodeCacheReloc* reloc = &relocs[i];
+        if (reloc->offset + (uint64_t) 8 > header->code_size || reloc->kind > RELOC_STRING ||
+            reloc->string_offset + (uint64_t) reloc->string_length > header->strings_size) {
+            unmap_cache_entry(&mapping);
+            return false;
+        }
+        void* target = NULL;
+        if (reloc->kind == RELOC_STRING) {
+            target = string_table_add_copy(strings, string_bytes + reloc->string_offset, reloc->string_length);
+        }
+        uint64_t address = (uint64_t) ojit_reloc_address(reloc->kind, target, callback);
+        memcpy(code + reloc->offset, &address, sizeof(address));
+    }
+
+    version->code = code_heap_install(heap, code, header->code_size);
+    version->size = header->code_size;
+    if (header->num_stack_maps) {
+        version->stack_maps = malloc(header->num_stack_maps * sizeof(struct StackMap));
+        memcpy(version->stack_maps, stack_maps, header->num_stack_maps * sizeof(struct StackMap));
+        version->num_stack_maps = header->num_stack_maps;
+    }
+    unmap_cache_entry(&mapping);
+    return true;
+}
+// endregion
+
+// region Store
+void code_cache_store(struct CodeCache* cache, struct FunctionIR* func, struct CompiledFunction* compiled) {
+    uint64_t key = code_cache_key(func);
+    char path[cache->dir_len + 40];
+    cache_entry_path(cache, key, path);
+
+    // other threads (or processes) may be writing the same entry, so write to a private file and move it into place
+    char tmp_path[cache->dir_len + 80];
+#ifdef WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = getpid();
+#endif
+    sprintf(tmp_path, "%s.%lu.%u.tmp", path, pid, atomic_fetch_add(&cache->tmp_counter, 1));
+
+    FILE* file = fopen(tmp_path, "wb");
+    if (file == NULL) return;
+
+    struct CodeCacheHeader header = {
+        .magic = OJIT_CODE_CACHE_MAGIC,
+        .version = OJIT_CODE_CACHE_VERSION,
+        .key = key,
+        .source_length = func->source_length,
+        .code_size = compiled->size,
+        .num_stack_maps = compiled->num_stack_maps,
+        .num_relocs = compiled->num_relocs,
+        .strings_size = 0,
+        .padding = 0,
+    };
+    for (uint32_t i = 0; i < compiled->num_relocs; i++) {
+        if (compiled->relocs[i].kind == RELOC_STRING) {
+            header.strings_size += ((String) compiled->relocs[i].target)->length;
+        }
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (compiled->num_stack_maps) {
+        ok = ok && fwrite(compiled->stack_maps, sizeof(struct StackMap), compiled->num_stack_maps, file) == compiled->num_stack_maps;
+    }
+    uint32_t string_offset = 0;
+    for (uint32_t i = 0; i < compiled->num_relocs && ok; i++) {
+        struct Relocation* reloc = &compiled->relocs[i];
+        struct CodeCacheReloc record = {.offset = reloc->offset, .kind = reloc->kind, .string_offset = 0, .string_length = 0};
+        if (reloc->kind == RELOC_STRING) {
+            record.string_offset = string_offset;
+            record.string_length = ((String) reloc->target)->length;
+            string_offset += record.string_length;
+        }
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+    ok = ok && fwrite(compiled->mem, 1, compiled->size, file) == compiled->size;
+    for (uint32_t i = 0; i < compiled->num_relocs && ok; i++) {
+        if (compiled->relocs[i].kind == RELOC_STRING) {
+            String str = compiled->relocs[i].target;
+            ok = fwrite(str->start_ptr, 1, str->length, file) == str->length;
+        }
+    }
+    ok = fclose(file) == 0 && ok;
+
+#ifdef WIN32
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp_path, path) == 0;
+#endif
+    if (!ok) remove(tmp_path);
+}
+// endregion
@@ -0,0 +1,28 @@
+#ifndef OJIT_CODE_CACHE_H
+#define OJIT_CODE_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "asm_ir.h"
+#include "compiler/compiler.h"
+
+// Bump whenever the generated code or the file layout changes, so old entries stop matching
+#define OJIT_CODE_CACHE_VERSION (4)
+
+struct CodeCache;
+
+struct CodeCache* create_code_cache(char* dir);
+void destroy_code_cache(struct CodeCache* cache);
+
+// Combines the function's source hash with everything else which changes the generated code
+uint64_t code_cache_key(struct FunctionIR* func);
+
+// On a hit, the cached code is patched for this process and installed in the code heap,
+// and version's code, size and stack maps are filled in. Returns false on a miss.
+bool code_cache_load(struct CodeCache* cache, struct FunctionIR* func, struct StringTable* strings,
+                     struct CodeHeap* heap, struct GetFunctionCallback callback, struct CompiledCode* version);
+// Failing to write the cache is not an error, the function simply gets compiled again next time
+void code_cache_store(struct CodeCache* cache, struct FunctionIR* func, struct CompiledFunction* compiled);
+
+#endif //OJIT_CODE_CACHE_H
@@ -0,0 +1,52 @@
+#ifndef OJIT_COMPILE_STATS_H
+#define OJIT_COMPILE_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Registers are assigned while the code is emitted, so that time is part of PHASE_EMIT
+enum CompilePhase {
+    PHASE_PARSE,
+    PHASE_OPTIMIZE,
+    PHASE_EMIT,
+    PHASE_STITCH,
+    PHASE_INSTALL,  // copying into the code heap, or loading from the code cache
+    NUM_COMPILE_PHASES,
+};
+
+struct CompileStats {
+    uint64_t phase_ns[NUM_COMPILE_PHASES];
+    uint64_t phase_arena_bytes[NUM_COMPILE_PHASES];
+
+    uint64_t files;
+    uint64_t functions;
+    uint64_t cache_hits;
+    uint64_t blocks;
+    uint64_t instructions;
+    uint64_t spills;  // values which got a stack slot instead of a register
+    uint64_t moves;   // moves and exchanges emitted by map_registers
+    uint64_t code_bytes;
+};
+
+static inline uint64_t compile_stats_now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static inline void compile_stats_add(struct CompileStats* into, struct CompileStats* from) {
+    for (int i = 0; i < NUM_COMPILE_PHASES; i++) {
+        into->phase_ns[i] += from->phase_ns[i];
+        into->phase_arena_bytes[i] += from->phase_arena_bytes[i];
+    }
+    into->files += from->files;
+    into->functions += from->functions;
+    into->cache_hits += from->cache_hits;
+    into->blocks += from->blocks;
+    into->instructions += from->instructions;
+    into->spills += from->spills;
+    into->moves += from->moves;
+    into->code_bytes += from->code_bytes;
+}
+
+#endif //OJIT_COMPILE_STATS_H
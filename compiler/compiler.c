@@ -1,5 +1,13 @@
+// memfd_create is a GNU extension
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "../ojit_def.h"
 #include "compiler.h"
@@ -26,27 +34,130 @@ int get_var_num(IRValue var, struct HashTable* table) {
 }
 
 
-void dump_function(struct FunctionIR* func) {
-    printf("FUNCTION ");
-    int c_i = 0;
-    while (c_i < func->name->length) {
-        putchar(func->name->start_ptr[c_i]);
-        c_i += 1;
+int get_ref_num(struct FunctionIR* func, IRRef ref, struct HashTable* table) {
+    return get_var_num(IR_VALUE(func, ref), table);
+}
+
+
+// Numbers every value in layout order, so listings of the same function agree on the names
+void number_function_values(struct FunctionIR* func, struct HashTable* var_names) {
+    struct BlockIR* block = func->first_block;
+    while (block) {
+        FOREACH_INSTR(instr, block) {
+            get_var_num(instr, var_names);
+        }
+        block = block->next_block;
+    }
+}
+
+
+void print_string(FILE* stream, String str) {
+    fprintf(stream, "%.*s", str->length, str->start_ptr);
+}
+
+
+void print_instruction(FILE* stream, struct FunctionIR* func, Instruction* instr, struct HashTable* var_names) {
+    int i = get_var_num(instr, var_names);
+    switch (INSTR_TYPE(func, instr)) {
+        case ID_INT_IR: {
+            fprintf(stream, "$%i = INT32 %d", i, instr->ir_int.constant);
+            break;
+        }
+        case ID_BLOCK_PARAMETER_IR: {
+            if (instr->ir_parameter.var_name) {
+                fprintf(stream, "$%i = PARAMETER \"", i);
+                print_string(stream, instr->ir_parameter.var_name);
+                fprintf(stream, "\"");
+            } else {
+                fprintf(stream, "$%i = PARAMETER (DISABLED)", i);
+            }
+            break;
+        }
+        case ID_ADD_IR: {
+            fprintf(stream, "$%i = ADD $%i, $%i", i, get_ref_num(func, instr->ir_add.a, var_names), get_ref_num(func, instr->ir_add.b, var_names));
+            break;
+        }
+        case ID_SUB_IR: {
+            fprintf(stream, "$%i = SUB $%i, $%i", i, get_ref_num(func, instr->ir_sub.a, var_names), get_ref_num(func, instr->ir_sub.b, var_names));
+            break;
+        }
+        case ID_CMP_IR: {
+            fprintf(stream, "$%i = CMP (%i) $%i, $%i", i, instr->ir_cmp.cmp, get_ref_num(func, instr->ir_cmp.a, var_names), get_ref_num(func, instr->ir_cmp.b, var_names));
+            break;
+        }
+        case ID_CALL_IR: {
+            fprintf(stream, "$%i = CALL", i);
+            break;
+        }
+        case ID_GLOBAL_IR: {
+            fprintf(stream, "$%i = GLOBAL", i);
+            break;
+        }
+        case ID_NEW_OBJECT_IR: {
+            fprintf(stream, "$%i = NEW_OBJECT", i);
+            break;
+        }
+        case ID_GET_ATTR_IR: {
+            fprintf(stream, "$%i = GETATTR $%i", i, get_ref_num(func, instr->ir_get_attr.obj, var_names));
+            break;
+        }
+        case ID_GET_LOC_IR: {
+            fprintf(stream, "$%i = GETLOC $%i", i, get_ref_num(func, instr->ir_get_loc.loc, var_names));
+            break;
+        }
+        case ID_SET_LOC_IR: {
+            fprintf(stream, "$%i = SETLOC $%i, $%i", i, get_ref_num(func, instr->ir_set_loc.loc, var_names), get_ref_num(func, instr->ir_set_loc.value, var_names));
+            break;
+        }
+        case ID_INSTR_NONE: {
+            fprintf(stream, "$%i = UNKNOWN", i);
+            break;
+        }
+    }
+}
+
+
+void print_terminator(FILE* stream, struct FunctionIR* func, union TerminatorIR* terminator, struct HashTable* var_names) {
+    switch (terminator->ir_base.id) {
+        case ID_BRANCH_IR: {
+            fprintf(stream, "BRANCH block %u", terminator->ir_branch.target->block_index);
+            break;
+        }
+        case ID_CBRANCH_IR: {
+            fprintf(stream, "CBRANCH $%i (true: block %u, false: block %u)",
+                    get_ref_num(func, terminator->ir_cbranch.cond, var_names),
+                    terminator->ir_cbranch.true_target->block_index,
+                    terminator->ir_cbranch.false_target->block_index);
+            break;
+        }
+        case ID_RETURN_IR: {
+            fprintf(stream, "RETURN $%i", get_ref_num(func, terminator->ir_return.value, var_names));
+            break;
+        }
+        default: {
+            fprintf(stream, "UNKNOWN");
+        }
     }
+}
+
+
+void dump_function(struct FunctionIR* func, MemCtx* scratch_mem) {
+    printf("FUNCTION ");
+    print_string(stdout, func->name);
     printf("\n");
 
     struct HashTable var_names;
-    MemCtx* tmp_mem = create_mem_ctx();
-    init_hash_table(&var_names, tmp_mem);
+    MemMark mark = mem_ctx_mark(scratch_mem);
+    init_hash_table(&var_names, scratch_mem);
+    number_function_values(func, &var_names);
 
     struct BlockIR* block = func->first_block;
     while (block) {
-        printf("    BLOCK @%p\n", block);
+        printf("    BLOCK %u\n", block->block_index);
 
-        FOREACH_INSTR(instr, block->first_instrs) {
-            int i = get_var_num(instr, &var_names);
+        FOREACH_INSTR(instr, block) {
 #ifdef OJIT_READABLE_IR
-            if (instr->base.refs == 0) {
+            if (INSTR_REF(func, instr) == 0) {
                 printf("        (LIKELY DISABLED) ");
             } else {
                 printf("        ");
@@ -54,101 +165,25 @@ void dump_function(struct FunctionIR* func) {
 #else
             printf("        ");
 #endif
-            switch (instr->base.id) {
-                case ID_INT_IR: {
-                    printf("$%i = INT32 %d\n", i, instr->ir_int.constant);
-                    break;
-                }
-                case ID_BLOCK_PARAMETER_IR: {
-                    if (instr->ir_parameter.var_name) {
-                        printf("$%i = PARAMETER \"", i);
-
-                        int c_ = 0;
-                        while (c_ < instr->ir_parameter.var_name->length) {
-                            putchar(instr->ir_parameter.var_name->start_ptr[c_]);
-                            c_ += 1;
-                        }
-                        printf("\"\n");
-                    } else {
-                        printf("$%i = PARAMETER (DISABLED)\n", i);
-                    }
-                    break;
-                }
-                case ID_ADD_IR: {
-                    printf("$%i = ADD $%i, $%i\n", i, get_var_num(instr->ir_add.a, &var_names), get_var_num(instr->ir_add.b, &var_names));
-                    break;
-                }
-                case ID_SUB_IR: {
-                    printf("$%i = SUB $%i, $%i\n", i, get_var_num(instr->ir_sub.a, &var_names), get_var_num(instr->ir_sub.b, &var_names));
-                    break;
-                }
-                case ID_CMP_IR: {
-                    printf("$%i = CMP (%i) $%i, $%i\n", i, instr->ir_cmp.cmp, get_var_num(instr->ir_cmp.a, &var_names), get_var_num(instr->ir_cmp.b, &var_names));
-                    break;
-                }
-                case ID_CALL_IR: {
-                    printf("$%i = CALL\n", i);
-                    break;
-                }
-                case ID_GLOBAL_IR: {
-                    printf("$%i = GLOBAL\n", i);
-                    break;
-                }
-                case ID_NEW_OBJECT_IR: {
-                    printf("$%i = NEW_OBJECT\n", i);
-                    break;
-                }
-                case ID_GET_ATTR_IR: {
-                    printf("$%i = GETATTR $%i\n", i, get_var_num(instr->ir_get_attr.obj, &var_names));
-                    break;
-                }
-                case ID_GET_LOC_IR: {
-                    printf("$%i = GETLOC $%i\n", i, get_var_num(instr->ir_get_loc.loc, &var_names));
-                    break;
-                }
-                case ID_SET_LOC_IR: {
-                    printf("$%i = SETLOC $%i, $%i\n", i, get_var_num(instr->ir_set_loc.loc, &var_names), get_var_num(instr->ir_set_loc.value, &var_names));
-                    break;
-                }
-                case ID_INSTR_NONE: {
-                    printf("$%i = UNKNOWN\n", i);
-                    break;
-                }
-            }
-        }
-        switch (block->terminator.ir_base.id) {
-            case ID_BRANCH_IR: {
-                printf("        BRANCH @%p\n", block->terminator.ir_branch.target);
-                break;
-            }
-            case ID_CBRANCH_IR: {
-                printf("        CBRANCH $%i (true: @%p, false: @%p)\n",
-                       get_var_num(block->terminator.ir_cbranch.cond, &var_names),
-                       block->terminator.ir_cbranch.true_target,
-                       block->terminator.ir_cbranch.false_target);
-                break;
-            }
-            case ID_RETURN_IR: {
-                printf("        RETURN $%i\n", get_var_num(block->terminator.ir_return.value, &var_names));
-                break;
-            }
-            default: {
-                printf("        UNKNOWN\n");
-            }
+            print_instruction(stdout, func, instr, &var_names);
+            printf("\n");
         }
+        printf("        ");
+        print_terminator(stdout, func, &block->terminator, &var_names);
+        printf("\n");
 
         block = block->next_block;
     }
-    destroy_mem_ctx(tmp_mem);
+    mem_ctx_rewind(scratch_mem, mark);
 }
 // endregion
 
 // region Compile
-void assign_function_parameters(struct FunctionIR* func) {
+void assign_function_parameters(struct FunctionIR* func, struct AssemblerState* state) {
     struct BlockIR* first_block = func->first_block;
     int param_num = 0;
-    FOREACH_INSTR(instr, first_block->first_instrs) {
-        if (instr->base.id == ID_BLOCK_PARAMETER_IR) {
+    FOREACH_INSTR(instr, first_block) {
+        if (INSTR_TYPE(func, instr) == ID_BLOCK_PARAMETER_IR) {
             enum Registers reg;
             switch (param_num) {
                 case 0: reg = RCX; break;
@@ -157,7 +192,7 @@ void assign_function_parameters(struct FunctionIR* func) {
                 case 3: reg = R9; break;
                 default: exit(-1);  // TODO
             }
-            instr->ir_parameter.entry_loc = WRAP_REG(reg);
+            ENTRY_LOC(state, instr) = WRAP_REG(reg);
             param_num += 1;
         }
     }
@@ -187,7 +222,7 @@ struct CompiledFunction stitch_segments(Segment* first_segment, MemCtx* ctx) {
                 if (jump_dist == 0) {
                     segment->base.final_size = 0;
                     saved_space += segment->base.max_size;
-                } else if (jump_dist > -256 && jump_dist < 255) {
+                } else if (jump_dist >= -128 && jump_dist <= 127) {
                     segment->base.final_size = 2;
                     saved_space += segment->base.max_size - 2;
                 } else {
@@ -200,7 +235,24 @@ struct CompiledFunction stitch_segments(Segment* first_segment, MemCtx* ctx) {
         segment = segment->base.next_segment;
     }
 
-    uint8_t* mem = ojit_alloc(ctx, offset);
+    uint8_t* mem = ojit_alloc_uninit(ctx, offset);
+    uint32_t num_stack_maps = 0;
+    uint32_t num_relocs = 0;
+    uint32_t num_markers = 0;
+    segment = first_segment;
+    while (segment) {
+        if (segment->base.type == SEGMENT_SAFEPOINT) num_stack_maps++;
+        if (segment->base.type == SEGMENT_RELOC) num_relocs++;
+        if (segment->base.type == SEGMENT_MARKER) num_markers++;
+        segment = segment->base.next_segment;
+    }
+    struct StackMap* stack_maps = num_stack_maps ? ojit_alloc_uninit(ctx, num_stack_maps * sizeof(struct StackMap)) : NULL;
+    struct StackMap* curr_map = stack_maps;
+    struct Relocation* relocs = num_relocs ? ojit_alloc_uninit(ctx, num_relocs * sizeof(struct Relocation)) : NULL;
+    struct Relocation* curr_reloc = relocs;
+    struct SourceMarker* markers = num_markers ? ojit_alloc_uninit(ctx, num_markers * sizeof(struct SourceMarker)) : NULL;
+    struct SourceMarker* curr_marker = markers;
+
     segment = first_segment;
     while (segment) {
         uint8_t* write_ptr = mem + segment->base.offset_from_start;
@@ -208,6 +260,30 @@ struct CompiledFunction stitch_segments(Segment* first_segment, MemCtx* ctx) {
             case SEGMENT_LABEL: {
                 break;
             }
+            case SEGMENT_SAFEPOINT: {
+                // segments are laid out in order, so the maps come out sorted by return address
+                curr_map->return_offset = segment->base.offset_from_start;
+                curr_map->live_regs = segment->safepoint.live_regs;
+                curr_map->pushed_regs = segment->safepoint.pushed_regs;
+                curr_map->live_slots = segment->safepoint.live_slots;
+                curr_map++;
+                break;
+            }
+            case SEGMENT_RELOC: {
+                // the marker sits directly after the immediate
+                curr_reloc->offset = segment->base.offset_from_start - segment->reloc.size;
+                curr_reloc->kind = segment->reloc.kind;
+                curr_reloc->target = segment->reloc.target;
+                curr_reloc++;
+                break;
+            }
+            case SEGMENT_MARKER: {
+                curr_marker->offset = segment->base.offset_from_start;
+                curr_marker->block_index = segment->marker.block_index;
+                curr_marker->instr_index = segment->marker.instr_index;
+                curr_marker++;
+                break;
+            }
             case SEGMENT_CODE: {
                 ojit_memcpy(write_ptr, segment->code.code + (512 - segment->base.max_size), segment->base.max_size);
                 break;
@@ -239,24 +315,78 @@ struct CompiledFunction stitch_segments(Segment* first_segment, MemCtx* ctx) {
         }
         segment = segment->base.next_segment;
     }
-    return (struct CompiledFunction) {.mem = mem, .size = offset - saved_space};
+    return (struct CompiledFunction) {
+        .mem = mem,
+        .size = offset - saved_space,
+        .stack_maps = stack_maps,
+        .num_stack_maps = num_stack_maps,
+        .relocs = relocs,
+        .num_relocs = num_relocs,
+        .markers = markers,
+        .num_markers = num_markers,
+    };
 }
 
 
-void ojit_jit_error(uint64_t val) {
+OJIT_JIT_ABI void ojit_jit_error(uint64_t val) {
     printf("Error: %llu\n", val);
     fflush(stdout);
 //    ojit_exit(-1);
 }
 
+// The 16 byte HashKey would be passed by reference, so the code only hands over the attribute's String
+OJIT_JIT_ABI void* ojit_get_attr_ptr(struct HashTable* table, String attr) {
+    return hash_table_get_ptr(table, STRING_KEY(attr));
+}
+
+
+void* ojit_reloc_address(enum RelocKind kind, void* target, struct GetFunctionCallback callback) {
+    switch (kind) {
+        case RELOC_JIT_PTR: return callback.jit_ptr;
+        case RELOC_COMPILED_CALLBACK: return callback.compiled_callback;
+        case RELOC_NEW_OBJECT_CALLBACK: return callback.new_object_callback;
+        case RELOC_ERROR_HANDLER: return ojit_jit_error;
+        case RELOC_HASH_TABLE_GET: return ojit_get_attr_ptr;
+        case RELOC_STRING: return target;
+        case RELOC_FUNCTION: return NULL;
+    }
+    return NULL;
+}
+
+
+// Everything emitted for the current block up to now (the code is written back to front) belongs to this instruction
+void emit_source_marker(struct AssemblerState* state, int32_t block_index, int32_t instr_index) {
+    if (!state->callback.source_markers) return;
+    struct AssemblyWriter* writer = &state->writer;
+    struct SegmentMarker* marker = &create_segment_marker(writer->label, writer->curr, writer->write_mem)->marker;
+    marker->block_index = block_index;
+    marker->instr_index = instr_index;
+    writer->curr = create_segment_code(writer->label, (Segment*) marker, writer->write_mem);
+}
 
-struct CompiledFunction ojit_compile_function(struct FunctionIR* func, MemCtx* compiler_mem, struct GetFunctionCallback callback) {
+
+struct CompiledFunction ojit_compile_function(struct FunctionIR* func, MemCtx* compiler_mem, struct GetFunctionCallback callback,
+                                              struct CompileStats* stats) {
+    uint64_t phase_start = compile_stats_now();
+    // whatever the optimizer adds to the IR goes into the function's own memory
+    size_t optimize_bytes = mem_ctx_allocated(compiler_mem) + mem_ctx_allocated(func->ir_mem);
 #ifdef OJIT_OPTIMIZATIONS
-    ojit_optimize_func(func, callback);
+    // the optimizer rewrites the IR in place, so a function which is compiled again skips it
+    if (!func->optimized) {
+        ojit_optimize_func(func, callback);
+        func->optimized = true;
+    }
 #endif
-    dump_function(func);
+    if (stats) {
+        stats->phase_ns[PHASE_OPTIMIZE] += compile_stats_now() - phase_start;
+        stats->phase_arena_bytes[PHASE_OPTIMIZE] += mem_ctx_allocated(compiler_mem) + mem_ctx_allocated(func->ir_mem) - optimize_bytes;
+    }
+    if (callback.dump_ir) {
+        dump_function(func, compiler_mem);
+    }
 
-    assign_function_parameters(func);
+    phase_start = compile_stats_now();
+    size_t phase_bytes = mem_ctx_allocated(compiler_mem);
 
     struct BlockIR* block = func->first_block;
     Segment* first_label;
@@ -273,102 +403,226 @@ struct CompiledFunction ojit_compile_function(struct FunctionIR* func, MemCtx* c
 
     struct AssemblerState state;
     state.writer.write_mem = compiler_mem;
-    state.jit_mem = create_mem_ctx();
+    state.func = func;
+    state.locs = ojit_alloc_uninit(compiler_mem, func->values.len * sizeof(VLoc));
+    state.entry_locs = ojit_alloc_uninit(compiler_mem, func->values.len * sizeof(VLoc));
+    for (uint32_t i = 0; i < func->values.len; i++) {
+        state.locs[i] = WRAP_NONE();
+        state.entry_locs[i] = WRAP_NONE();
+    }
+    state.live_values = ojit_alloc_uninit(compiler_mem, func->values.len * sizeof(IRRef));
+    state.live_value_index = ojit_alloc_uninit(compiler_mem, func->values.len * sizeof(uint32_t));
+    assign_function_parameters(func, &state);
     state.callback = callback;
     state.errs_label = errs_label;
     state.err_return_label = err_return_label;
+    state.num_spills = 0;
+    state.num_moves = 0;
+    state.profile_counters = callback.profile ? func->profile_counters : NULL;
 
     state.writer.curr = create_segment_code(err_return_label, NULL, compiler_mem);
     state.writer.label = err_return_label;
     asm_emit_ret(&state.writer);
+    asm_emit_pop_r64(TMP_1_REG, &state.writer);
+    asm_emit_pop_r64(TMP_2_REG, &state.writer);
     asm_emit_mov(WRAP_REG(RAX), WRAP_REG(RCX), &state.writer);
     asm_emit_pop_r64(RBP, &state.writer);
     asm_emit_mov_r64_r64(RSP, RBP, &state.writer);
     asm_emit_add_r64_i32(RSP, 32, &state.writer);
     asm_emit_call_r64(RAX, &state.writer);
     asm_emit_sub_r64_i32(RSP, 32, &state.writer);
-    asm_emit_mov_r64_i64(RAX, (uint64_t) ojit_jit_error, &state.writer);
+    // a check can fail with registers pushed for a call, the frame is left anyway
+    asm_emit_mov_r64_r64(RSP, RBP, &state.writer);
+    emit_mov_reloc(RAX, RELOC_ERROR_HANDLER, ojit_jit_error, &state);
 
     block = func->first_block;
     Segment* segment = NULL;
     uint32_t max_num_vars = 0;
+    uint64_t num_blocks = 0;
+    uint64_t num_instrs = 0;
     while (block) {
+        num_blocks++;
         struct BlockIR* next_block = block->next_block;
         segment = create_segment_code(block->data, next_block ? next_block->data : errs_label, compiler_mem);
         init_asm_state(&state, block, block->data, segment);
 
         emit_terminator(&block->terminator, &state);
+        emit_source_marker(&state, block->block_index, SOURCE_MARKER_TERMINATOR);
 
-        LAListIter instr_iter;
-        lalist_init_iter(&instr_iter, block->last_instrs, block->last_instrs->len, sizeof(Instruction));
-        Instruction* instr = lalist_iter_prev(&instr_iter);
-        while (instr) {
-            if (INSTR_TYPE(instr) == ID_BLOCK_PARAMETER_IR) break;
+        // code is emitted back to front, and the parameters come first
+        int32_t instr_index = (int32_t) block->instrs.len - 1;
+        while (instr_index >= 0) {
+            Instruction* instr = BLOCK_INSTR(block, instr_index);
+            if (INSTR_TYPE(func, instr) == ID_BLOCK_PARAMETER_IR) break;
             emit_instruction(instr, &state);
-            instr = lalist_iter_prev(&instr_iter);
+            emit_source_marker(&state, block->block_index, instr->base.index);
+            num_instrs++;
+            instr_index--;
         }
         int k = block->num_params-1;
         VLoc* swap_from[block->num_params];
         VLoc* swap_to[block->num_params];
         uint32_t skipped_count = 0;
-        while (instr) {
-            if (instr->base.id == ID_BLOCK_PARAMETER_IR) {
+        while (instr_index >= 0) {
+            Instruction* instr = BLOCK_INSTR(block, instr_index);
+            if (INSTR_TYPE(func, instr) == ID_BLOCK_PARAMETER_IR) {
                 struct ParameterIR* param = &instr->ir_parameter;
-                if (param->base.refs != 0 && IS_ASSIGNED(GET_LOC(param))) {
-                    swap_to[k] = &GET_LOC(param);
-                    swap_from[k] = &param->entry_loc;
+                if (INSTR_REF(func, param) != 0 && IS_ASSIGNED(GET_LOC(&state, param))) {
+                    swap_to[k] = &GET_LOC(&state, param);
+                    swap_from[k] = &ENTRY_LOC(&state, param);
                     k -= 1;
                 } else {
                     skipped_count += 1;
                 }
             }
-            instr = lalist_iter_prev(&instr_iter);
+            instr_index--;
+        }
+        state.num_moves += map_registers(swap_from + skipped_count, swap_to + skipped_count, block->num_params - skipped_count, &state.writer);
+        if (state.profile_counters) {
+            asm_emit_inc_counter(&state.profile_counters[block->block_index * 2], &state.writer);
         }
-        map_registers(swap_from + skipped_count, swap_to + skipped_count, block->num_params - skipped_count, &state.writer);
+        emit_source_marker(&state, block->block_index, SOURCE_MARKER_BLOCK_ENTRY);
 
         block = block->next_block;
         if (state.max_num_vars > max_num_vars) max_num_vars = state.max_num_vars;
     }
 
-    struct AssemblyWriter writer;
-    writer.curr = first_code;
-    writer.label = first_label;
-    asm_emit_sub_r64_i32(RSP, max_num_vars * 8, &writer);
-    asm_emit_mov_r64_r64(RBP, RSP, &writer);
-    asm_emit_push_r64(RBP, &writer);
-
-    return stitch_segments(first_label, compiler_mem);
+    // the error paths are all emitted by now
+    state.writer.label = errs_label;
+    state.writer.curr = errs_label->base.next_segment;
+    emit_source_marker(&state, SOURCE_MARKER_ERRORS, 0);
+
+    state.writer.curr = first_code;
+    state.writer.label = first_label;
+    // an even number of slots, RSP stays 16 byte aligned for the calls
+    asm_emit_sub_r64_i32(RSP, ((max_num_vars + 1) & ~1u) * 8, &state.writer);
+    asm_emit_mov_r64_r64(RBP, RSP, &state.writer);
+    asm_emit_push_r64(RBP, &state.writer);
+    // the temp registers are callee saved, pushed before the frame is set up
+    asm_emit_push_r64(TMP_2_REG, &state.writer);
+    asm_emit_push_r64(TMP_1_REG, &state.writer);
+    emit_source_marker(&state, SOURCE_MARKER_PROLOGUE, 0);
+
+    if (stats == NULL) return stitch_segments(first_label, compiler_mem);
+
+    uint64_t stitch_start = compile_stats_now();
+    size_t stitch_bytes = mem_ctx_allocated(compiler_mem);
+    stats->phase_ns[PHASE_EMIT] += stitch_start - phase_start;
+    stats->phase_arena_bytes[PHASE_EMIT] += stitch_bytes - phase_bytes;
+
+    struct CompiledFunction compiled = stitch_segments(first_label, compiler_mem);
+
+    stats->phase_ns[PHASE_STITCH] += compile_stats_now() - stitch_start;
+    stats->phase_arena_bytes[PHASE_STITCH] += mem_ctx_allocated(compiler_mem) - stitch_bytes;
+    stats->functions++;
+    stats->blocks += num_blocks;
+    stats->instructions += num_instrs;
+    stats->spills += state.num_spills;
+    stats->moves += state.num_moves;
+    stats->code_bytes += compiled.size;
+    return compiled;
 }
+// endregion
+
+// region Code Heap
+#define OJIT_CODE_CHUNK_SIZE (1024 * 1024)
+#define OJIT_CODE_ALIGN (16)
+
+struct CodeHeap {
+    pthread_mutex_t lock;
+    uint8_t* curr_ptr;
+    uint8_t* end_ptr;
+    ptrdiff_t write_offset;  // from the current chunk's executable view to its writable view
+};
 
+// Each chunk is mapped twice, read+execute where the code runs and read+write where it's installed,
+// so no page is ever writable and executable at once.
 #ifdef WIN32
 #include <windows.h>
-void* copy_to_executable(void* from, size_t len) {
-    SYSTEM_INFO info;
-    GetSystemInfo(&info);
-    void* mem = VirtualAlloc(NULL, info.dwPageSize, MEM_COMMIT, PAGE_READWRITE);
-    if (mem == NULL) {
-        ojit_new_error();
-        ojit_build_error_chars("Failed to move generated code to executable memory.\n");
-        ojit_error();
-        exit(0);
-    }
-    memcpy(mem, from, len);
-
-    DWORD dummy;
-    bool success = VirtualProtect(mem, len, PAGE_EXECUTE_READ, &dummy);
-    if (!success) {
-        ojit_new_error();
-        ojit_build_error_chars("Failed to move generated code to executable memory.\n");
-        ojit_error();
-        exit(-1);
-    }
+bool alloc_executable(size_t size, uint8_t** exec_view, uint8_t** write_view) {
+    HANDLE mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_EXECUTE_READWRITE | SEC_COMMIT,
+                                       (DWORD) ((uint64_t) size >> 32), (DWORD) size, NULL);
+    if (mapping == NULL) return false;
+    *write_view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+    *exec_view = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, size);
+    // the views keep the mapping alive
+    CloseHandle(mapping);
+    if (*write_view != NULL && *exec_view != NULL) return true;
+    if (*write_view != NULL) UnmapViewOfFile(*write_view);
+    if (*exec_view != NULL) UnmapViewOfFile(*exec_view);
+    return false;
+}
 
-    return mem;
+void flush_executable(void* mem, size_t len) {
+    FlushInstructionCache(GetCurrentProcess(), mem, len);
 }
 #else
-#warning Executing jited code is currently unsupported on platforms other than Windows.
-void* copy_to_executable(CState* bstate, void* from, size_t len) {
-    ojit_fatal_error(bstate->error, "Executing jit'ed code is currently unsupported on platforms other than Windows.\n");
+#include <sys/mman.h>
+#include <unistd.h>
+// Note that the emitted code still follows the Windows x64 calling convention
+bool alloc_executable(size_t size, uint8_t** exec_view, uint8_t** write_view) {
+    int fd = memfd_create("ojit-code", MFD_CLOEXEC);
+    if (fd < 0) return false;
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return false;
+    }
+    void* write_mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* exec_mem = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    // the mappings keep the memory alive
+    close(fd);
+    if (write_mem == MAP_FAILED || exec_mem == MAP_FAILED) {
+        if (write_mem != MAP_FAILED) munmap(write_mem, size);
+        if (exec_mem != MAP_FAILED) munmap(exec_mem, size);
+        return false;
+    }
+    *write_view = write_mem;
+    *exec_view = exec_mem;
+    return true;
+}
+
+void flush_executable(void* mem, size_t len) {
+    __builtin___clear_cache(mem, (char*) mem + len);
 }
 #endif
+
+struct CodeHeap* create_code_heap() {
+    struct CodeHeap* heap = malloc(sizeof(struct CodeHeap));
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->curr_ptr = NULL;
+    heap->end_ptr = NULL;
+    heap->write_offset = 0;
+    return heap;
+}
+
+// Code from every function (and every compile thread) is packed into shared chunks.
+// Installing writes through the chunk's writable view, so functions can go next to code which is already running.
+void* code_heap_install(struct CodeHeap* heap, void* from, size_t len) {
+    size_t aligned_len = (len + OJIT_CODE_ALIGN - 1) & ~(size_t) (OJIT_CODE_ALIGN - 1);
+
+    pthread_mutex_lock(&heap->lock);
+    if (heap->curr_ptr == NULL || heap->curr_ptr + aligned_len > heap->end_ptr) {
+        size_t chunk_size = aligned_len > OJIT_CODE_CHUNK_SIZE ? aligned_len : OJIT_CODE_CHUNK_SIZE;
+        uint8_t* chunk;
+        uint8_t* write_chunk;
+        if (!alloc_executable(chunk_size, &chunk, &write_chunk)) {
+            pthread_mutex_unlock(&heap->lock);
+            ojit_new_error();
+            ojit_build_error_chars("Failed to move generated code to executable memory.\n");
+            ojit_error();
+            exit(-1);
+        }
+        heap->curr_ptr = chunk;
+        heap->end_ptr = chunk + chunk_size;
+        heap->write_offset = write_chunk - chunk;
+    }
+    uint8_t* mem = heap->curr_ptr;
+    uint8_t* write_mem = mem + heap->write_offset;
+    heap->curr_ptr += aligned_len;
+    pthread_mutex_unlock(&heap->lock);
+
+    memcpy(write_mem, from, len);
+    flush_executable(mem, len);
+    return mem;
+}
 // endregion
@@ -2,13 +2,78 @@
 #define OJIT_COMPILER_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "../asm_ir.h"
+#include "../ojit_def.h"
+#include "../compile_stats.h"
+
+// Describes where boxed values live while a call made by jitted code is in progress.
+// Registers which are also in `pushed_regs` were pushed before the call (in the order RAX, RDX, RCX, R8, R9, R10, R11),
+// so their value must be read from (and written back to) the stack rather than the register.
+struct StackMap {
+    uint32_t return_offset;  // offset of the return address from the start of the function
+    uint16_t live_regs;      // bit n set: register n holds a boxed value
+    uint16_t pushed_regs;    // bit n set: register n was pushed before the call
+    uint64_t live_slots;     // bit n set: [rbp - (n+1)*8] holds a boxed value
+};
+
+// Compiling fails if an object is live in a spill slot past these across a call
+#define OJIT_MAX_MAP_SLOTS (64)
+
+// Every absolute address baked into generated code is a 64-bit immediate with one of these kinds,
+// so the code can be moved to another process (see code_cache.c).
+// AOT code loads them from the GOT instead, through a 32-bit RIP relative displacement.
+enum RelocKind {
+    RELOC_JIT_PTR,
+    RELOC_COMPILED_CALLBACK,
+    RELOC_NEW_OBJECT_CALLBACK,
+    RELOC_ERROR_HANDLER,
+    RELOC_HASH_TABLE_GET,
+    RELOC_STRING,
+    RELOC_FUNCTION,  // only emitted for AOT code, target is the function's name
+};
+
+struct Relocation {
+    uint32_t offset;  // offset of the 8 byte immediate (4 byte displacement in AOT code) from the start of the function
+    enum RelocKind kind;
+    void* target;     // the String for RELOC_STRING
+};
+
+#define SOURCE_MARKER_PROLOGUE    (-1)  // block_index of the code in front of the first block
+#define SOURCE_MARKER_ERRORS      (-2)  // block_index of the out of line error paths after the last block
+#define SOURCE_MARKER_BLOCK_ENTRY (-1)  // instr_index of a block's parameter moves and counters
+#define SOURCE_MARKER_TERMINATOR  (-2)
+
+// Says which part of the IR the code from offset up to the next marker was emitted for
+struct SourceMarker {
+    uint32_t offset;
+    int32_t block_index;  // BlockIR.block_index
+    int32_t instr_index;  // InstructionBase.index within the block
+};
 
 struct CompiledFunction {
     uint8_t* mem;
     size_t size;
+    struct StackMap* stack_maps;
+    uint32_t num_stack_maps;
+    struct Relocation* relocs;
+    uint32_t num_relocs;
+    struct SourceMarker* markers;  // only with GetFunctionCallback.source_markers, sorted by offset
+    uint32_t num_markers;
 };
 
-struct CompiledFunction ojit_compile_function(struct FunctionIR* func, MemCtx* compiler_mem, struct GetFunctionCallback callback);
-void* copy_to_executable(void* from, size_t len);
+// stats may be NULL, otherwise the optimize, emit and stitch phases of this function are added to it
+struct CompiledFunction ojit_compile_function(struct FunctionIR* func, MemCtx* compiler_mem, struct GetFunctionCallback callback,
+                                              struct CompileStats* stats);
+
+// The IR printers behind dump_function; var_names maps every printed value to its $number
+void number_function_values(struct FunctionIR* func, struct HashTable* var_names);
+void print_instruction(FILE* stream, struct FunctionIR* func, Instruction* instr, struct HashTable* var_names);
+void print_terminator(FILE* stream, struct FunctionIR* func, union TerminatorIR* terminator, struct HashTable* var_names);
+void* ojit_reloc_address(enum RelocKind kind, void* target, struct GetFunctionCallback callback);
+// Runtime helpers behind RELOC_ERROR_HANDLER and RELOC_HASH_TABLE_GET
+OJIT_JIT_ABI void ojit_jit_error(uint64_t val);
+OJIT_JIT_ABI void* ojit_get_attr_ptr(struct HashTable* table, String attr);
+struct CodeHeap* create_code_heap();
+void* code_heap_install(struct CodeHeap* heap, void* from, size_t len);
 #endif //OJIT_COMPILER_H
@@ -5,11 +5,15 @@
 #include <stdbool.h>
 
 #include "../asm_ir.h"
+#include "compiler.h"
 
 enum SegmentType {
     SEGMENT_CODE,
     SEGMENT_JUMP,
     SEGMENT_LABEL,
+    SEGMENT_SAFEPOINT,
+    SEGMENT_RELOC,
+    SEGMENT_MARKER,
 };
 
 struct SegmentBase {
@@ -38,11 +42,38 @@ struct SegmentJump {
     struct SegmentLabel* jump_to;
 };
 
+// Zero-sized marker placed directly after a call instruction, so its final offset is the return address
+struct SegmentSafepoint {
+    struct SegmentBase base;
+    uint16_t live_regs;
+    uint16_t pushed_regs;
+    uint64_t live_slots;
+};
+
+// Zero-sized marker placed directly after a 64-bit immediate which holds an absolute address
+struct SegmentReloc {
+    struct SegmentBase base;
+    enum RelocKind kind;
+    void* target;
+    uint8_t size;  // of the immediate or displacement in front of the marker
+};
+
+// Zero-sized marker placed in front of the code emitted for a block, IR instruction or terminator
+struct SegmentMarker {
+    struct SegmentBase base;
+    int32_t block_index;
+    int32_t instr_index;
+};
+
+// Segments are allocated at the size of their own type and without zeroing, the create functions and emitters set every field
 typedef union u_Segment {
     struct SegmentBase base;
     struct SegmentCode code;
     struct SegmentJump jump;
     struct SegmentLabel label;
+    struct SegmentSafepoint safepoint;
+    struct SegmentReloc reloc;
+    struct SegmentMarker marker;
 } Segment;
 
 struct AssemblyWriter {
@@ -56,19 +87,31 @@ struct AssemblerState {
     uint8_t curr_num_vars;
     uint8_t max_num_vars;
 
+    struct FunctionIR* func;
     struct BlockIR* block;
+    // by IRRef, for the whole function
+    VLoc* locs;
+    VLoc* entry_locs;  // where a block's caller leaves each of its parameters
 
     Segment* errs_label;
     Segment* err_return_label;
 
     bool used_registers[16];
+    // values whose uses have been emitted but not their definition, see value_used
+    IRRef* live_values;
+    uint32_t* live_value_index;  // by IRRef
+    uint32_t num_live_values;
     enum Registers swap_owner_of[16];
     enum Registers swap_contents[16];
     Instruction* curr_tmp_1_user;
     Instruction* curr_tmp_2_user;
 
-    MemCtx* jit_mem;
     struct GetFunctionCallback callback;
+
+    // counted over the whole function, init_asm_state leaves these alone
+    uint32_t num_spills;
+    uint32_t num_moves;
+    uint64_t* profile_counters;  // NULL unless the function is instrumented
 };
 
 void init_asm_state(struct AssemblerState* state, struct BlockIR* block, Segment* label, Segment* curr) {
@@ -81,6 +124,7 @@ void init_asm_state(struct AssemblerState* state, struct BlockIR* block, Segment
 
     // Windows makes you assume the registers RBX, RSI, RDI, RBP, R12-R15 are used
     // Additionally, we assumed RBP, RSP, R12, and R13 are used because it's a pain to use them
+    // (R12 and R13 are the temp registers, saved in the prologue)
     // 7 registers should be enough for anyone
 
     state->used_registers[RAX] = false;
@@ -107,11 +151,22 @@ void init_asm_state(struct AssemblerState* state, struct BlockIR* block, Segment
         state->swap_owner_of[i] = i;
         state->swap_contents[i] = i;
     }
+    // values never live across blocks, those are passed as block parameters
+    state->num_live_values = 0;
 }
 
 
 uint8_t state_alloc_var(struct AssemblerState* state) {
+    if (state->curr_num_vars >= OJIT_MAX_SPILL_SLOTS) {
+        ojit_new_error();
+        ojit_build_error_chars("Too many values spilled at once, a function can use ");
+        ojit_build_error_int(OJIT_MAX_SPILL_SLOTS);
+        ojit_build_error_chars(" spill slots");
+        ojit_error();
+        exit(-1);
+    }
     uint8_t num = state->curr_num_vars++;
+    state->num_spills++;
     if (state->curr_num_vars > state->max_num_vars) {
         state->max_num_vars = state->curr_num_vars;
     }
@@ -119,7 +174,7 @@ uint8_t state_alloc_var(struct AssemblerState* state) {
 }
 
 Segment* create_segment_label(Segment* prev_block, Segment* next_block, MemCtx* ctx) {
-    struct SegmentLabel* segment = ojit_alloc(ctx, sizeof(Segment));
+    struct SegmentLabel* segment = ojit_alloc_uninit(ctx, sizeof(struct SegmentLabel));
     segment->base.max_size = 0;
     segment->base.final_size = 0;
     segment->base.type = SEGMENT_LABEL;
@@ -137,7 +192,7 @@ Segment* create_segment_label(Segment* prev_block, Segment* next_block, MemCtx*
 }
 
 Segment* create_segment_code(Segment* prev_block, Segment* next_block, MemCtx* ctx) {
-    struct SegmentCode* segment = ojit_alloc(ctx, sizeof(Segment));
+    struct SegmentCode* segment = ojit_alloc_uninit(ctx, sizeof(struct SegmentCode));
     segment->base.max_size = 0;
     segment->base.final_size = 0;
     segment->base.type = SEGMENT_CODE;
@@ -154,7 +209,7 @@ Segment* create_segment_code(Segment* prev_block, Segment* next_block, MemCtx* c
 }
 
 Segment* create_mem_block_jump(Segment* prev_block, Segment* next_block, MemCtx* ctx) {
-    struct SegmentJump* segment = &((Segment*) ojit_alloc(ctx, sizeof(Segment)))->jump;
+    struct SegmentJump* segment = ojit_alloc_uninit(ctx, sizeof(struct SegmentJump));
     segment->base.max_size = 0;
     segment->base.final_size = 0;
     segment->base.type = SEGMENT_JUMP;
@@ -170,4 +225,55 @@ Segment* create_mem_block_jump(Segment* prev_block, Segment* next_block, MemCtx*
     return (Segment*) segment;
 }
 
+Segment* create_segment_safepoint(Segment* prev_block, Segment* next_block, MemCtx* ctx) {
+    struct SegmentSafepoint* segment = ojit_alloc_uninit(ctx, sizeof(struct SegmentSafepoint));
+    segment->base.max_size = 0;
+    segment->base.final_size = 0;
+    segment->base.type = SEGMENT_SAFEPOINT;
+
+    segment->base.prev_segment = prev_block;
+    segment->base.next_segment = next_block;
+    if (next_block) {
+        next_block->base.prev_segment = (Segment*) segment;
+    }
+    if (prev_block) {
+        prev_block->base.next_segment = (Segment*) segment;
+    }
+    return (Segment*) segment;
+}
+
+Segment* create_segment_reloc(Segment* prev_block, Segment* next_block, MemCtx* ctx) {
+    struct SegmentReloc* segment = ojit_alloc_uninit(ctx, sizeof(struct SegmentReloc));
+    segment->base.max_size = 0;
+    segment->base.final_size = 0;
+    segment->base.type = SEGMENT_RELOC;
+
+    segment->base.prev_segment = prev_block;
+    segment->base.next_segment = next_block;
+    if (next_block) {
+        next_block->base.prev_segment = (Segment*) segment;
+    }
+    if (prev_block) {
+        prev_block->base.next_segment = (Segment*) segment;
+    }
+    return (Segment*) segment;
+}
+
+Segment* create_segment_marker(Segment* prev_block, Segment* next_block, MemCtx* ctx) {
+    struct SegmentMarker* segment = ojit_alloc_uninit(ctx, sizeof(struct SegmentMarker));
+    segment->base.max_size = 0;
+    segment->base.final_size = 0;
+    segment->base.type = SEGMENT_MARKER;
+
+    segment->base.prev_segment = prev_block;
+    segment->base.next_segment = next_block;
+    if (next_block) {
+        next_block->base.prev_segment = (Segment*) segment;
+    }
+    if (prev_block) {
+        prev_block->base.next_segment = (Segment*) segment;
+    }
+    return (Segment*) segment;
+}
+
 #endif //OJIT_COMPILER_RECORDS_H
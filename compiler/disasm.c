@@ -0,0 +1,357 @@
+#include "disasm.h"
+
+#include <string.h>
+
+#include "../hash_table.h"
+
+// region Decoder
+char* reg64_names[16] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                         "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+char* reg32_names[16] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                         "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+char* reg8_names[16] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+                        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+char* reg8_legacy_names[4] = {"ah", "ch", "dh", "bh"};  // what 4-7 mean without a REX prefix
+
+char* cond_names[16] = {"o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"};
+char* group1_names[8] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+char* group2_names[8] = {"rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar"};
+
+struct Decoder {
+    uint8_t* code;
+    uint32_t size;
+    uint32_t pos;
+    uint8_t rex;
+    bool ok;
+};
+
+enum OperandWidth {
+    WIDTH_8,
+    WIDTH_32,
+    WIDTH_64,
+    WIDTH_NONE,  // lea, which doesn't access memory
+};
+
+uint8_t decode_u8(struct Decoder* dec) {
+    if (dec->pos >= dec->size) {
+        dec->ok = false;
+        return 0;
+    }
+    return dec->code[dec->pos++];
+}
+
+uint32_t decode_u32(struct Decoder* dec) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t) decode_u8(dec) << (i * 8);
+    }
+    return value;
+}
+
+uint64_t decode_u64(struct Decoder* dec) {
+    uint64_t low = decode_u32(dec);
+    return low | ((uint64_t) decode_u32(dec) << 32);
+}
+
+char* reg_name(struct Decoder* dec, uint8_t reg, enum OperandWidth width) {
+    switch (width) {
+        case WIDTH_8:
+            if (dec->rex == 0 && reg >= 4 && reg < 8) return reg8_legacy_names[reg - 4];
+            return reg8_names[reg];
+        case WIDTH_32:
+            return reg32_names[reg];
+        default:
+            return reg64_names[reg];
+    }
+}
+
+// signed immediates and displacements come out as +0x10 / -0x8
+int format_signed(char* buf, size_t size, int64_t value) {
+    if (value < 0) return snprintf(buf, size, "-0x%llx", (unsigned long long) -value);
+    return snprintf(buf, size, "0x%llx", (unsigned long long) value);
+}
+
+// Reads a ModRM byte (plus SIB and displacement) and writes the r/m operand; returns the reg field with REX.R applied
+uint8_t decode_modrm(struct Decoder* dec, enum OperandWidth width, char* rm_text, size_t rm_size) {
+    uint8_t modrm = decode_u8(dec);
+    uint8_t mod = modrm >> 6;
+    uint8_t reg = ((modrm >> 3) & 0b111) | ((dec->rex >> 2 & 1) << 3);
+    uint8_t rm = modrm & 0b111;
+
+    if (mod == 0b11) {
+        snprintf(rm_text, rm_size, "%s", reg_name(dec, rm | ((dec->rex & 1) << 3), width));
+        return reg;
+    }
+
+    char* base = NULL;
+    char* index = NULL;
+    uint8_t scale = 1;
+    bool rip_relative = false;
+    if (rm == 0b100) {
+        uint8_t sib = decode_u8(dec);
+        uint8_t index_reg = ((sib >> 3) & 0b111) | ((dec->rex >> 1 & 1) << 3);
+        if (index_reg != 0b100) {
+            index = reg64_names[index_reg];
+            scale = 1 << (sib >> 6);
+        }
+        if ((sib & 0b111) == 0b101 && mod == 0) {
+            mod = 0b10;  // a disp32 without a base
+        } else {
+            base = reg64_names[(sib & 0b111) | ((dec->rex & 1) << 3)];
+        }
+    } else if (rm == 0b101 && mod == 0) {
+        rip_relative = true;
+        mod = 0b10;
+    } else {
+        base = reg64_names[rm | ((dec->rex & 1) << 3)];
+    }
+
+    int64_t disp = 0;
+    if (mod == 0b01) disp = (int8_t) decode_u8(dec);
+    if (mod == 0b10) disp = (int32_t) decode_u32(dec);
+
+    char* size_names[] = {[WIDTH_8] = "byte ptr ", [WIDTH_32] = "dword ptr ", [WIDTH_64] = "qword ptr ", [WIDTH_NONE] = ""};
+    int len = snprintf(rm_text, rm_size, "%s[", size_names[width]);
+    bool first = true;
+    if (rip_relative) {
+        len += snprintf(rm_text + len, rm_size - len, "rip");
+        first = false;
+    }
+    if (base) {
+        len += snprintf(rm_text + len, rm_size - len, "%s", base);
+        first = false;
+    }
+    if (index) {
+        len += snprintf(rm_text + len, rm_size - len, "%s%s*%u", first ? "" : "+", index, scale);
+        first = false;
+    }
+    if (disp != 0 || first) {
+        if (!first && disp >= 0) len += snprintf(rm_text + len, rm_size - len, "+");
+        len += format_signed(rm_text + len, rm_size - len, disp);
+    }
+    snprintf(rm_text + len, rm_size - len, "]");
+    return reg;
+}
+
+
+bool disasm_instruction(uint8_t* code, uint32_t size, uint32_t offset, struct DisasmInstr* instr) {
+    struct Decoder dec = {.code = code, .size = size, .pos = offset, .rex = 0, .ok = true};
+    char rm[DISASM_RM_SIZE];
+    char imm[DISASM_IMM_SIZE];
+    char* text = instr->text;
+    instr->offset = offset;
+    instr->has_target = false;
+    text[0] = 0;
+
+    uint8_t op = decode_u8(&dec);
+    if ((op & 0xF0) == 0x40) {
+        dec.rex = op;
+        op = decode_u8(&dec);
+    }
+    enum OperandWidth width = (dec.rex & 0b1000) ? WIDTH_64 : WIDTH_32;
+
+    bool known = true;
+    if (op < 0x40 && (op & 0b111) <= 0b011 && (op & 0b111) != 0b010 && (op & 0b111) != 0b000) {
+        // the ALU ops: 01 (r/m, reg) and 03 (reg, r/m) for each of group1_names
+        uint8_t reg = decode_modrm(&dec, width, rm, sizeof(rm));
+        if ((op & 0b111) == 0b001) {
+            snprintf(text, DISASM_TEXT_SIZE, "%s %s, %s", group1_names[op >> 3], rm, reg_name(&dec, reg, width));
+        } else {
+            snprintf(text, DISASM_TEXT_SIZE, "%s %s, %s", group1_names[op >> 3], reg_name(&dec, reg, width), rm);
+        }
+    } else if (op < 0x40 && (op & 0b111) == 0b101) {
+        format_signed(imm, sizeof(imm), (int32_t) decode_u32(&dec));
+        snprintf(text, DISASM_TEXT_SIZE, "%s %s, %s", group1_names[op >> 3], reg_name(&dec, 0, width), imm);
+    } else if (op >= 0x50 && op <= 0x5F) {
+        snprintf(text, DISASM_TEXT_SIZE, "%s %s", op < 0x58 ? "push" : "pop", reg64_names[(op & 0b111) | ((dec.rex & 1) << 3)]);
+    } else if (op >= 0x70 && op <= 0x7F) {
+        int8_t rel = (int8_t) decode_u8(&dec);
+        instr->has_target = true;
+        instr->target = dec.pos + rel;
+        snprintf(text, DISASM_TEXT_SIZE, "j%s 0x%x", cond_names[op & 0xF], instr->target);
+    } else if (op == 0x80 || op == 0x81 || op == 0x83) {
+        enum OperandWidth op_width = op == 0x80 ? WIDTH_8 : width;
+        uint8_t reg = decode_modrm(&dec, op_width, rm, sizeof(rm));
+        int64_t value = op == 0x81 ? (int32_t) decode_u32(&dec) : (int8_t) decode_u8(&dec);
+        if (op == 0x80) value = (uint8_t) value;
+        format_signed(imm, sizeof(imm), value);
+        snprintf(text, DISASM_TEXT_SIZE, "%s %s, %s", group1_names[reg & 0b111], rm, imm);
+    } else if (op == 0x85 || op == 0x87 || op == 0x89) {
+        uint8_t reg = decode_modrm(&dec, width, rm, sizeof(rm));
+        char* name = op == 0x85 ? "test" : op == 0x87 ? "xchg" : "mov";
+        snprintf(text, DISASM_TEXT_SIZE, "%s %s, %s", name, rm, reg_name(&dec, reg, width));
+    } else if (op == 0x8B || op == 0x8D) {
+        uint8_t reg = decode_modrm(&dec, op == 0x8D ? WIDTH_NONE : width, rm, sizeof(rm));
+        snprintf(text, DISASM_TEXT_SIZE, "%s %s, %s", op == 0x8D ? "lea" : "mov", reg_name(&dec, reg, width), rm);
+    } else if (op == 0x90) {
+        snprintf(text, DISASM_TEXT_SIZE, "nop");
+    } else if (op >= 0xB8 && op <= 0xBF) {
+        uint64_t value = width == WIDTH_64 ? decode_u64(&dec) : decode_u32(&dec);
+        snprintf(text, DISASM_TEXT_SIZE, "mov %s, 0x%llx", reg_name(&dec, (op & 0b111) | ((dec.rex & 1) << 3), width),
+                 (unsigned long long) value);
+    } else if (op == 0xC1) {
+        uint8_t reg = decode_modrm(&dec, width, rm, sizeof(rm));
+        snprintf(text, DISASM_TEXT_SIZE, "%s %s, %u", group2_names[reg & 0b111], rm, decode_u8(&dec));
+    } else if (op == 0xC3) {
+        snprintf(text, DISASM_TEXT_SIZE, "ret");
+    } else if (op == 0xCC) {
+        snprintf(text, DISASM_TEXT_SIZE, "int3");
+    } else if (op == 0xE8 || op == 0xE9 || op == 0xEB) {
+        int32_t rel = op == 0xEB ? (int8_t) decode_u8(&dec) : (int32_t) decode_u32(&dec);
+        instr->has_target = true;
+        instr->target = dec.pos + rel;
+        snprintf(text, DISASM_TEXT_SIZE, "%s 0x%x", op == 0xE8 ? "call" : "jmp", instr->target);
+    } else if (op == 0xFF) {
+        uint8_t reg = decode_modrm(&dec, WIDTH_64, rm, sizeof(rm)) & 0b111;
+        char* names[8] = {"inc", "dec", "call", NULL, "jmp", NULL, "push", NULL};
+        if (names[reg]) {
+            snprintf(text, DISASM_TEXT_SIZE, "%s %s", names[reg], rm);
+        } else {
+            known = false;
+        }
+    } else if (op == 0x0F) {
+        uint8_t op2 = decode_u8(&dec);
+        if (op2 >= 0x80 && op2 <= 0x8F) {
+            int32_t rel = (int32_t) decode_u32(&dec);
+            instr->has_target = true;
+            instr->target = dec.pos + rel;
+            snprintf(text, DISASM_TEXT_SIZE, "j%s 0x%x", cond_names[op2 & 0xF], instr->target);
+        } else if (op2 >= 0x90 && op2 <= 0x9F) {
+            decode_modrm(&dec, WIDTH_8, rm, sizeof(rm));
+            snprintf(text, DISASM_TEXT_SIZE, "set%s %s", cond_names[op2 & 0xF], rm);
+        } else {
+            known = false;
+        }
+    } else {
+        known = false;
+    }
+
+    if (!known || !dec.ok) {
+        instr->length = 1;
+        instr->has_target = false;
+        snprintf(text, DISASM_TEXT_SIZE, "(bad)");
+        return false;
+    }
+    instr->length = dec.pos - offset;
+    return true;
+}
+// endregion
+
+// region Listing
+struct BlockIR* block_by_index(struct FunctionIR* func, int32_t block_index) {
+    if (block_index < 0 || (uint32_t) block_index >= func->blocks.len) return NULL;
+    return VEC_GET(&func->blocks, struct BlockIR*, block_index);
+}
+
+Instruction* instr_by_index(struct BlockIR* block, int32_t instr_index) {
+    if (instr_index < 0 || (uint32_t) instr_index >= block->instrs.len) return NULL;
+    return BLOCK_INSTR(block, instr_index);
+}
+
+void print_marker(FILE* stream, struct FunctionIR* func, struct SourceMarker* marker, struct HashTable* var_names,
+                  struct DisasmAnnotations* annotations) {
+    if (marker->block_index == SOURCE_MARKER_PROLOGUE) {
+        fprintf(stream, "prologue:\n");
+        return;
+    }
+    if (marker->block_index == SOURCE_MARKER_ERRORS) {
+        fprintf(stream, "error paths:\n");
+        return;
+    }
+    struct BlockIR* block = block_by_index(func, marker->block_index);
+    if (block == NULL) return;
+    if (marker->instr_index == SOURCE_MARKER_BLOCK_ENTRY) {
+        fprintf(stream, "block %u:", block->block_index);
+        if (annotations->block_counts) {
+            fprintf(stream, "  (entered %llu times)", (unsigned long long) annotations->block_counts[block->block_index]);
+        }
+        fprintf(stream, "\n");
+    } else if (marker->instr_index == SOURCE_MARKER_TERMINATOR) {
+        fprintf(stream, "  ; ");
+        print_terminator(stream, func, &block->terminator, var_names);
+        fprintf(stream, "\n");
+    } else {
+        Instruction* instr = instr_by_index(block, marker->instr_index);
+        if (instr == NULL) return;
+        fprintf(stream, "  ; ");
+        print_instruction(stream, func, instr, var_names);
+        fprintf(stream, "\n");
+    }
+}
+
+// the name of the block starting at offset, if there is one
+bool block_at(struct DisasmAnnotations* annotations, uint32_t offset, int32_t* block_index) {
+    for (uint32_t i = 0; i < annotations->num_markers; i++) {
+        struct SourceMarker* marker = &annotations->markers[i];
+        if (marker->offset == offset && marker->block_index >= 0 && marker->instr_index == SOURCE_MARKER_BLOCK_ENTRY) {
+            *block_index = marker->block_index;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void disasm_function(FILE* stream, struct FunctionIR* func, uint8_t* code, uint32_t size, struct DisasmAnnotations* annotations) {
+    struct DisasmAnnotations none = {0};
+    if (annotations == NULL) annotations = &none;
+
+    fprintf(stream, "FUNCTION %.*s (%u bytes)\n", func->name->length, func->name->start_ptr, size);
+    // profile data goes into columns in front of each instruction
+    if (annotations->sample_counts) fprintf(stream, "%10s ", "samples");
+    if (annotations->block_counts) fprintf(stream, "%10s ", "executed");
+    fprintf(stream, "%6s  %-30s %s\n", "offset", "bytes", "instruction");
+
+    MemCtx* tmp_mem = create_tagged_mem_ctx(MEM_TAG_COMPILER);
+    struct HashTable var_names;
+    init_hash_table(&var_names, tmp_mem);
+    number_function_values(func, &var_names);
+
+    uint32_t next_marker = 0;
+    int32_t curr_block = -1;
+    uint32_t offset = 0;
+    while (offset < size) {
+        while (next_marker < annotations->num_markers && annotations->markers[next_marker].offset <= offset) {
+            struct SourceMarker* marker = &annotations->markers[next_marker++];
+            curr_block = marker->block_index;
+            print_marker(stream, func, marker, &var_names, annotations);
+        }
+
+        struct DisasmInstr instr;
+        disasm_instruction(code, size, offset, &instr);
+
+        if (annotations->sample_counts) {
+            uint64_t samples = 0;
+            for (uint32_t i = 0; i < instr.length; i++) samples += annotations->sample_counts[offset + i];
+            if (samples) {
+                fprintf(stream, "%10llu ", (unsigned long long) samples);
+            } else {
+                fprintf(stream, "%10s ", "");
+            }
+        }
+        if (annotations->block_counts) {
+            if (curr_block >= 0) {
+                fprintf(stream, "%10llu ", (unsigned long long) annotations->block_counts[curr_block]);
+            } else {
+                fprintf(stream, "%10s ", "");
+            }
+        }
+
+        char bytes[32];
+        int bytes_len = 0;
+        for (uint32_t i = 0; i < instr.length && bytes_len < (int) sizeof(bytes) - 3; i++) {
+            bytes_len += snprintf(bytes + bytes_len, sizeof(bytes) - bytes_len, "%02x ", code[offset + i]);
+        }
+        fprintf(stream, "%6x  %-30s %s", offset, bytes, instr.text);
+        int32_t target_block;
+        if (instr.has_target && block_at(annotations, instr.target, &target_block)) {
+            fprintf(stream, "  <block %d>", target_block);
+        }
+        fprintf(stream, "\n");
+        offset += instr.length;
+    }
+
+    destroy_mem_ctx(tmp_mem);
+    fflush(stream);
+}
+// endregion
@@ -0,0 +1,39 @@
+#ifndef OJIT_DISASM_H
+#define OJIT_DISASM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "compiler.h"
+
+// Decodes the x86-64 instructions emit_x64.h produces (plus the rest of their opcode groups), in Intel syntax
+
+// Operands are formatted into these first, so an instruction's text fits the longest mnemonic and two operands
+#define DISASM_RM_SIZE (40)
+#define DISASM_IMM_SIZE (24)
+#define DISASM_TEXT_SIZE (8 + DISASM_RM_SIZE + DISASM_IMM_SIZE + 8)
+
+struct DisasmInstr {
+    uint32_t offset;
+    uint8_t length;
+    bool has_target;  // relative jumps and calls
+    uint32_t target;  // offset the jump goes to
+    char text[DISASM_TEXT_SIZE];
+};
+
+// Returns false for bytes outside the supported subset, which are then shown as a single (bad) byte
+bool disasm_instruction(uint8_t* code, uint32_t size, uint32_t offset, struct DisasmInstr* instr);
+
+// Optional extras for disasm_function; all of them may be NULL/0
+struct DisasmAnnotations {
+    struct SourceMarker* markers;  // sorted by offset
+    uint32_t num_markers;
+    uint64_t* block_counts;        // by block_index, see jit_read_profile
+    uint64_t* sample_counts;       // by code offset, one per byte
+};
+
+// Prints an annotated listing of a compiled function. The function's IR has to be the one the code was compiled from.
+void disasm_function(FILE* stream, struct FunctionIR* func, uint8_t* code, uint32_t size, struct DisasmAnnotations* annotations);
+
+#endif //OJIT_DISASM_H
@@ -0,0 +1,322 @@
+#include "elf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// region ELF Records
+#define ELF_SHT_SYMTAB (2)
+#define ELF_SHT_STRTAB (3)
+#define ELF_SHT_RELA   (4)
+#define ELF_SHF_INFO_LINK (0x40)
+
+struct Elf64Header {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+
+struct Elf64SectionHeader {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t addr;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t addralign;
+    uint64_t entsize;
+};
+
+struct Elf64Symbol {
+    uint32_t name;
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+};
+
+struct Elf64Rela {
+    uint64_t offset;
+    uint64_t info;
+    int64_t addend;
+};
+// endregion
+
+// region Buffers
+struct ElfBuffer {
+    uint8_t* data;
+    uint64_t len;
+    uint64_t cap;
+};
+
+void* elf_buffer_reserve(struct ElfBuffer* buf, uint64_t len) {
+    if (buf->len + len > buf->cap) {
+        uint64_t new_cap = buf->cap ? buf->cap * 2 : 256;
+        while (new_cap < buf->len + len) new_cap *= 2;
+        buf->data = realloc(buf->data, new_cap);
+        buf->cap = new_cap;
+    }
+    void* ptr = buf->data + buf->len;
+    buf->len += len;
+    return ptr;
+}
+
+uint64_t elf_buffer_append(struct ElfBuffer* buf, void* data, uint64_t len) {
+    uint64_t offset = buf->len;
+    if (len) memcpy(elf_buffer_reserve(buf, len), data, len);
+    return offset;
+}
+
+void elf_buffer_align(struct ElfBuffer* buf, uint64_t align) {
+    while (buf->len % align) {
+        *(uint8_t*) elf_buffer_reserve(buf, 1) = 0;
+    }
+}
+// endregion
+
+struct ElfSection {
+    char* name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t align;
+    uint64_t addr;
+    struct ElfBuffer data;
+    struct ElfBuffer relocs;  // Elf64Rela, with symbol handles instead of indices
+};
+
+struct ElfObject {
+    struct ElfSection sections[ELF_MAX_SECTIONS];
+    uint16_t num_sections;  // including the null section
+    struct ElfBuffer symbols;
+    struct ElfBuffer strtab;
+};
+
+
+struct ElfObject* elf_create() {
+    struct ElfObject* elf = calloc(1, sizeof(struct ElfObject));
+    elf->num_sections = 1;
+    // both the null symbol and the empty name come first
+    *(uint8_t*) elf_buffer_reserve(&elf->strtab, 1) = 0;
+    memset(elf_buffer_reserve(&elf->symbols, sizeof(struct Elf64Symbol)), 0, sizeof(struct Elf64Symbol));
+    return elf;
+}
+
+
+void elf_destroy(struct ElfObject* elf) {
+    for (uint16_t i = 1; i < elf->num_sections; i++) {
+        free(elf->sections[i].name);
+        free(elf->sections[i].data.data);
+        free(elf->sections[i].relocs.data);
+    }
+    free(elf->symbols.data);
+    free(elf->strtab.data);
+    free(elf);
+}
+
+
+uint16_t elf_add_section(struct ElfObject* elf, char* name, uint32_t type, uint64_t flags, uint64_t align) {
+    if (elf->num_sections >= ELF_MAX_SECTIONS) return 0;
+    uint16_t index = elf->num_sections++;
+    struct ElfSection* section = &elf->sections[index];
+    size_t name_len = strlen(name);
+    section->name = malloc(name_len + 1);
+    memcpy(section->name, name, name_len + 1);
+    section->type = type;
+    section->flags = flags;
+    section->align = align ? align : 1;
+    section->addr = 0;
+    return index;
+}
+
+
+uint64_t elf_section_append(struct ElfObject* elf, uint16_t section, void* data, uint64_t len) {
+    struct ElfSection* sec = &elf->sections[section];
+    elf_buffer_align(&sec->data, sec->align);
+    return elf_buffer_append(&sec->data, data, len);
+}
+
+
+uint64_t elf_section_size(struct ElfObject* elf, uint16_t section) {
+    return elf->sections[section].data.len;
+}
+
+
+void elf_set_section_addr(struct ElfObject* elf, uint16_t section, uint64_t addr) {
+    elf->sections[section].addr = addr;
+}
+
+
+uint32_t elf_add_symbol(struct ElfObject* elf, char* name, uint32_t name_len, uint8_t bind, uint8_t type,
+                        uint16_t section, uint64_t value, uint64_t size) {
+    struct Elf64Symbol symbol = {
+        .name = 0,
+        .info = (bind << 4) | (type & 0xF),
+        .other = 0,
+        .shndx = section,
+        .value = value,
+        .size = size,
+    };
+    if (name_len) {
+        symbol.name = elf_buffer_append(&elf->strtab, name, name_len);
+        *(uint8_t*) elf_buffer_reserve(&elf->strtab, 1) = 0;
+    }
+    return elf_buffer_append(&elf->symbols, &symbol, sizeof(symbol)) / sizeof(struct Elf64Symbol);
+}
+
+
+void elf_add_reloc(struct ElfObject* elf, uint16_t section, uint64_t offset, uint32_t symbol, uint32_t type, int64_t addend) {
+    struct Elf64Rela rela = {
+        .offset = offset,
+        .info = ((uint64_t) symbol << 32) | type,
+        .addend = addend,
+    };
+    elf_buffer_append(&elf->sections[section].relocs, &rela, sizeof(rela));
+}
+
+
+uint8_t* elf_finish(struct ElfObject* elf, uint64_t* size) {
+    // ELF wants every local symbol in front of the globals
+    struct Elf64Symbol* symbols = (struct Elf64Symbol*) elf->symbols.data;
+    uint32_t num_symbols = elf->symbols.len / sizeof(struct Elf64Symbol);
+    uint32_t* symbol_index = malloc(num_symbols * sizeof(uint32_t));
+    struct ElfBuffer symtab = {0};
+    uint32_t first_global = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < num_symbols; i++) {
+            bool is_local = (symbols[i].info >> 4) == ELF_STB_LOCAL;
+            if (is_local == (pass == 0)) {
+                symbol_index[i] = elf_buffer_append(&symtab, &symbols[i], sizeof(struct Elf64Symbol)) / sizeof(struct Elf64Symbol);
+            }
+        }
+        if (pass == 0) first_global = symtab.len / sizeof(struct Elf64Symbol);
+    }
+
+    uint16_t num_user_sections = elf->num_sections;
+    uint16_t num_rela_sections = 0;
+    for (uint16_t i = 1; i < num_user_sections; i++) {
+        if (elf->sections[i].relocs.len) num_rela_sections++;
+    }
+    uint16_t symtab_index = num_user_sections + num_rela_sections;
+    uint16_t strtab_index = symtab_index + 1;
+    uint16_t shstrtab_index = symtab_index + 2;
+    uint16_t num_headers = shstrtab_index + 1;
+    struct Elf64SectionHeader* headers = calloc(num_headers, sizeof(struct Elf64SectionHeader));
+
+    struct ElfBuffer shstrtab = {0};
+    *(uint8_t*) elf_buffer_reserve(&shstrtab, 1) = 0;
+
+    struct ElfBuffer image = {0};
+    // the header is filled in last, once the section header table has been placed
+    memset(elf_buffer_reserve(&image, sizeof(struct Elf64Header)), 0, sizeof(struct Elf64Header));
+
+    uint16_t rela_index = num_user_sections;
+    for (uint16_t i = 1; i < num_user_sections; i++) {
+        struct ElfSection* section = &elf->sections[i];
+        struct Elf64SectionHeader* header = &headers[i];
+        header->name = elf_buffer_append(&shstrtab, section->name, strlen(section->name) + 1);
+        header->type = section->type;
+        header->flags = section->flags;
+        header->addr = section->addr;
+        header->addralign = section->align;
+        header->size = section->data.len;
+        elf_buffer_align(&image, section->align);
+        header->offset = image.len;
+        if (section->type != ELF_SHT_NOBITS) {
+            elf_buffer_append(&image, section->data.data, section->data.len);
+        }
+
+        if (section->relocs.len) {
+            struct Elf64Rela* relocs = (struct Elf64Rela*) section->relocs.data;
+            uint64_t num_relocs = section->relocs.len / sizeof(struct Elf64Rela);
+            for (uint64_t r = 0; r < num_relocs; r++) {
+                uint32_t handle = relocs[r].info >> 32;
+                relocs[r].info = ((uint64_t) symbol_index[handle] << 32) | (relocs[r].info & 0xFFFFFFFF);
+            }
+            struct Elf64SectionHeader* rela_header = &headers[rela_index++];
+            rela_header->name = elf_buffer_append(&shstrtab, ".rela", 5);
+            elf_buffer_append(&shstrtab, section->name, strlen(section->name) + 1);
+            rela_header->type = ELF_SHT_RELA;
+            rela_header->flags = ELF_SHF_INFO_LINK;
+            rela_header->link = symtab_index;
+            rela_header->info = i;
+            rela_header->addralign = 8;
+            rela_header->entsize = sizeof(struct Elf64Rela);
+            rela_header->size = section->relocs.len;
+            // the relocations themselves are written once every section header is known
+        }
+    }
+
+    rela_index = num_user_sections;
+    for (uint16_t i = 1; i < num_user_sections; i++) {
+        struct ElfSection* section = &elf->sections[i];
+        if (section->relocs.len == 0) continue;
+        elf_buffer_align(&image, 8);
+        headers[rela_index++].offset = elf_buffer_append(&image, section->relocs.data, section->relocs.len);
+    }
+
+    struct Elf64SectionHeader* symtab_header = &headers[symtab_index];
+    symtab_header->name = elf_buffer_append(&shstrtab, ".symtab", 8);
+    symtab_header->type = ELF_SHT_SYMTAB;
+    symtab_header->link = strtab_index;
+    symtab_header->info = first_global;
+    symtab_header->addralign = 8;
+    symtab_header->entsize = sizeof(struct Elf64Symbol);
+    symtab_header->size = symtab.len;
+    elf_buffer_align(&image, 8);
+    symtab_header->offset = elf_buffer_append(&image, symtab.data, symtab.len);
+
+    struct Elf64SectionHeader* strtab_header = &headers[strtab_index];
+    strtab_header->name = elf_buffer_append(&shstrtab, ".strtab", 8);
+    strtab_header->type = ELF_SHT_STRTAB;
+    strtab_header->addralign = 1;
+    strtab_header->size = elf->strtab.len;
+    strtab_header->offset = elf_buffer_append(&image, elf->strtab.data, elf->strtab.len);
+
+    struct Elf64SectionHeader* shstrtab_header = &headers[shstrtab_index];
+    shstrtab_header->name = elf_buffer_append(&shstrtab, ".shstrtab", 10);
+    shstrtab_header->type = ELF_SHT_STRTAB;
+    shstrtab_header->addralign = 1;
+    shstrtab_header->size = shstrtab.len;
+    shstrtab_header->offset = elf_buffer_append(&image, shstrtab.data, shstrtab.len);
+
+    elf_buffer_align(&image, 8);
+    uint64_t section_headers_offset = elf_buffer_append(&image, headers, num_headers * sizeof(struct Elf64SectionHeader));
+
+    struct Elf64Header header = {
+        .ident = {0x7F, 'E', 'L', 'F', 2 /* 64 bit */, 1 /* little endian */, 1 /* version */, 0 /* System V ABI */},
+        .type = 1,  // relocatable
+        .machine = 62,  // x86-64
+        .version = 1,
+        .entry = 0,
+        .phoff = 0,
+        .shoff = section_headers_offset,
+        .flags = 0,
+        .ehsize = sizeof(struct Elf64Header),
+        .phentsize = 0,
+        .phnum = 0,
+        .shentsize = sizeof(struct Elf64SectionHeader),
+        .shnum = num_headers,
+        .shstrndx = shstrtab_index,
+    };
+    memcpy(image.data, &header, sizeof(header));
+
+    free(symbol_index);
+    free(symtab.data);
+    free(shstrtab.data);
+    free(headers);
+    *size = image.len;
+    return image.data;
+}
@@ -0,0 +1,54 @@
+#ifndef OJIT_ELF_H
+#define OJIT_ELF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Builds ELF64 x86-64 relocatable objects in memory
+
+#define ELF_SHT_PROGBITS (1)
+#define ELF_SHT_NOBITS   (8)
+
+#define ELF_SHF_WRITE     (0x1)
+#define ELF_SHF_ALLOC     (0x2)
+#define ELF_SHF_EXECINSTR (0x4)
+
+#define ELF_STB_LOCAL  (0)
+#define ELF_STB_GLOBAL (1)
+#define ELF_STB_WEAK   (2)
+
+#define ELF_STT_NOTYPE  (0)
+#define ELF_STT_OBJECT  (1)
+#define ELF_STT_FUNC    (2)
+#define ELF_STT_SECTION (3)
+
+#define ELF_SHN_UNDEF (0)
+#define ELF_SHN_ABS   (0xFFF1)
+
+#define ELF_R_X86_64_64   (1)
+#define ELF_R_X86_64_PC32 (2)
+#define ELF_R_X86_64_GOTPCREL (9)
+
+#define ELF_MAX_SECTIONS (16)
+
+struct ElfObject;
+
+struct ElfObject* elf_create();
+void elf_destroy(struct ElfObject* elf);
+
+uint16_t elf_add_section(struct ElfObject* elf, char* name, uint32_t type, uint64_t flags, uint64_t align);
+// Appends data to a section and returns the offset it was placed at
+uint64_t elf_section_append(struct ElfObject* elf, uint16_t section, void* data, uint64_t len);
+uint64_t elf_section_size(struct ElfObject* elf, uint16_t section);
+// For objects describing code which is already loaded (symbol values stay relative to their section)
+void elf_set_section_addr(struct ElfObject* elf, uint16_t section, uint64_t addr);
+
+// Returns a handle for elf_add_reloc; locals are moved in front of globals when the object is finished
+uint32_t elf_add_symbol(struct ElfObject* elf, char* name, uint32_t name_len, uint8_t bind, uint8_t type,
+                        uint16_t section, uint64_t value, uint64_t size);
+void elf_add_reloc(struct ElfObject* elf, uint16_t section, uint64_t offset, uint32_t symbol, uint32_t type, int64_t addend);
+
+// Lays out the object file; the returned image is malloc'd and owned by the caller
+uint8_t* elf_finish(struct ElfObject* elf, uint64_t* size);
+
+#endif //OJIT_ELF_H
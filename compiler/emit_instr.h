@@ -5,36 +5,47 @@
 #include "registers.h"
 
 // region Emit Instructions
+// AOT code goes through the GOT, JIT code holds the address itself
+void static inline emit_mov_reloc(enum Registers dest, enum RelocKind kind, void* target, struct AssemblerState* state) {
+    if (state->callback.aot) {
+        asm_emit_mov_r64_got(dest, kind, target, &state->writer);
+    } else {
+        asm_emit_mov_r64_reloc(dest, kind, target, &state->writer);
+    }
+}
+
 void static inline emit_int(Instruction* instruction, struct AssemblerState* state) {
     struct IntIR* instr = &instruction->ir_int;
-    if (IS_ASSIGNED(GET_LOC(instr))) {
-        emit_wrap_int_i32(&GET_LOC(instr), instr->constant, state);
-        unmark_loc(GET_LOC(instr), state);
+    if (IS_ASSIGNED(GET_LOC(state, instr))) {
+        emit_wrap_int_i32(&GET_LOC(state, instr), instr->constant, state);
+        unmark_loc(GET_LOC(state, instr), state);
     }
 }
 
 void static inline emit_add(Instruction* instruction, struct AssemblerState* state) {
     struct AddIR* instr = &instruction->ir_add;
+    Instruction* a = IR_VALUE(state->func, instr->a);
+    Instruction* b = IR_VALUE(state->func, instr->b);
     struct AssemblyWriter* writer = &state->writer;
 
-    if (!IS_ASSIGNED(GET_LOC(instr))) return;
-    VLoc this_loc = GET_LOC(instr);
+    if (!IS_ASSIGNED(GET_LOC(state, instr))) return;
+    VLoc this_loc = GET_LOC(state, instr);
     // by unmarking the register the result is stored in, we can use it as the register of one of the arguments
     unmark_loc(this_loc, state);
 
 #ifdef OJIT_OPTIMIZATIONS
-    if (INSTR_TYPE(instr->a) == ID_INT_IR || INSTR_TYPE(instr->b) == ID_INT_IR) {
+    if (INSTR_TYPE(state->func, a) == ID_INT_IR || INSTR_TYPE(state->func, b) == ID_INT_IR) {
         VLoc add_to;
         Instruction* check_instr;
         uint32_t constant;
-        if (INSTR_TYPE(instr->a) == ID_INT_IR) {
-            add_to = *instr_assign_loc(instr->b, this_loc, state);
-            check_instr = instr->b;
-            constant = instr->a->ir_int.constant;
+        if (INSTR_TYPE(state->func, a) == ID_INT_IR) {
+            add_to = *instr_assign_loc(b, this_loc, state);
+            check_instr = b;
+            constant = a->ir_int.constant;
         } else {
-            add_to = *instr_assign_loc(instr->a, this_loc, state);
-            check_instr = instr->a;
-            constant = instr->b->ir_int.constant;
+            add_to = *instr_assign_loc(a, this_loc, state);
+            check_instr = a;
+            constant = b->ir_int.constant;
         }
         enum Registers tmp_reg = store_loc(&this_loc, WRAP_NONE(), state);
         asm_emit_add_r64_i32(tmp_reg, constant, &state->writer);
@@ -44,8 +55,8 @@ void static inline emit_add(Instruction* instruction, struct AssemblerState* sta
         return;
     }
 #endif
-    VLoc a_loc = *instr_assign_loc(instr->a, this_loc, state);
-    VLoc b_loc = *instr_assign_loc(instr->b, this_loc, state);
+    VLoc a_loc = *instr_assign_loc(a, this_loc, state);
+    VLoc b_loc = *instr_assign_loc(b, this_loc, state);
 
     if (loc_equal(a_loc, this_loc)) {
         asm_emit_add(this_loc, WRAP_REG(TMP_1_REG), writer);
@@ -58,29 +69,31 @@ void static inline emit_add(Instruction* instruction, struct AssemblerState* sta
         asm_emit_mov32(this_loc, a_loc, writer);
     }
 
-    emit_assert_instr_i32(instr->a, state);
-    emit_assert_instr_i32(instr->b, state);
+    emit_assert_instr_i32(a, state);
+    emit_assert_instr_i32(b, state);
 }
 
 void static inline emit_sub(Instruction* instruction, struct AssemblerState* state) {
     struct SubIR* instr = &instruction->ir_sub;
+    Instruction* a = IR_VALUE(state->func, instr->a);
+    Instruction* b = IR_VALUE(state->func, instr->b);
     struct AssemblyWriter* writer = &state->writer;
 
-    if (!IS_ASSIGNED(GET_LOC(instr))) return;
-    VLoc this_loc = GET_LOC(instr);
+    if (!IS_ASSIGNED(GET_LOC(state, instr))) return;
+    VLoc this_loc = GET_LOC(state, instr);
     // by unmarking the register the result is stored in, we can use it as the register of one of the arguments
     unmark_loc(this_loc, state);
 
 #ifdef OJIT_OPTIMIZATIONS
-    if (INSTR_TYPE(instr->a) == ID_INT_IR || INSTR_TYPE(instr->b) == ID_INT_IR) {
+    if (INSTR_TYPE(state->func, a) == ID_INT_IR || INSTR_TYPE(state->func, b) == ID_INT_IR) {
         VLoc* add_to;
         uint32_t constant;
-        if (INSTR_TYPE(instr->a) == ID_INT_IR) {
-            add_to = instr_assign_loc(instr->b, this_loc, state);
-            constant = instr->a->ir_int.constant;
+        if (INSTR_TYPE(state->func, a) == ID_INT_IR) {
+            add_to = instr_assign_loc(b, this_loc, state);
+            constant = a->ir_int.constant;
         } else {
-            add_to = instr_assign_loc(instr->a, this_loc, state);
-            constant = instr->b->ir_int.constant;
+            add_to = instr_assign_loc(a, this_loc, state);
+            constant = b->ir_int.constant;
         }
         enum Registers tmp_reg = store_loc(&this_loc, WRAP_NONE(), state);
         asm_emit_sub_r64_i32(tmp_reg, constant, &state->writer);
@@ -90,8 +103,8 @@ void static inline emit_sub(Instruction* instruction, struct AssemblerState* sta
         return;
     }
 #endif
-    VLoc a_loc = *instr_assign_loc(instr->a, this_loc, state);
-    VLoc b_loc = *instr_assign_loc(instr->b, this_loc, state);
+    VLoc a_loc = *instr_assign_loc(a, this_loc, state);
+    VLoc b_loc = *instr_assign_loc(b, this_loc, state);
 
     if (loc_equal(a_loc, this_loc)) {
         asm_emit_sub(this_loc, b_loc, writer);
@@ -110,38 +123,40 @@ void static inline emit_sub(Instruction* instruction, struct AssemblerState* sta
 
 void static inline emit_cmp(Instruction* instruction, struct AssemblerState* state, bool store) {
     struct CompareIR* instr = &instruction->ir_cmp;
+    Instruction* a = IR_VALUE(state->func, instr->a);
+    Instruction* b = IR_VALUE(state->func, instr->b);
 
-    if (store && !IS_ASSIGNED(GET_LOC(instr))) return;
+    if (store && !IS_ASSIGNED(GET_LOC(state, instr))) return;
     if (store) ojit_exit(-1);   // TODO
-    VLoc this_loc = GET_LOC(instr);
+    VLoc this_loc = GET_LOC(state, instr);
     if (IS_ASSIGNED(this_loc)) unmark_loc(this_loc, state);
 
 #ifdef OJIT_OPTIMIZATIONS
-    if (INSTR_TYPE(instr->a) == ID_INT_IR || INSTR_TYPE(instr->b) == ID_INT_IR) {
+    if (INSTR_TYPE(state->func, a) == ID_INT_IR || INSTR_TYPE(state->func, b) == ID_INT_IR) {
         VLoc* cmp_with;
         Instruction* check_instr;
         uint32_t constant;
-        if (INSTR_TYPE(instr->a) == ID_INT_IR) {
-            cmp_with = instr_assign_loc(instr->b, this_loc, state);
-            check_instr = instr->b;
-            constant = instr->a->ir_int.constant;
+        if (INSTR_TYPE(state->func, a) == ID_INT_IR) {
+            cmp_with = instr_assign_loc(b, this_loc, state);
+            check_instr = b;
+            constant = a->ir_int.constant;
         } else {
-            cmp_with = instr_assign_loc(instr->a, this_loc, state);
-            check_instr = instr->a;
-            constant = instr->b->ir_int.constant;
+            cmp_with = instr_assign_loc(a, this_loc, state);
+            check_instr = a;
+            constant = b->ir_int.constant;
         }
 //        if (store) asm_emit_setcc(instr->cmp, this_loc, &state->writer);
         enum Registers reg = postload_loc(cmp_with, this_loc, state);
         asm_emit_cmp_r32_i32(reg, constant, &state->writer);
-        if (check_instr->base.type != TYPE_INT)
+        if (VALUE_TYPE(state->func, check_instr) != TYPE_INT)
             emit_assert_loc_i32(WRAP_REG(reg), state);
         load_loc(cmp_with, state);
         return;
     }
 #endif
 
-    VLoc* a_loc = instr_assign_loc(instr->a, WRAP_NONE(), state);
-    VLoc* b_loc = instr_assign_loc(instr->b, WRAP_NONE(), state);
+    VLoc* a_loc = instr_assign_loc(a, WRAP_NONE(), state);
+    VLoc* b_loc = instr_assign_loc(b, WRAP_NONE(), state);
 
 //    if (store) asm_emit_setcc(instr->cmp, this_loc, &state->writer);
     asm_emit_cmp(*a_loc, *b_loc, &state->writer);
@@ -150,77 +165,140 @@ void static inline emit_cmp(Instruction* instruction, struct AssemblerState* sta
 void static inline emit_global(Instruction* instruction, struct AssemblerState* state) {
     struct GlobalIR* instr = &instruction->ir_global;
 
-    if (!IS_ASSIGNED(GET_LOC(instr))) return;
-    VLoc this_loc = GET_LOC(instr);
+    if (!IS_ASSIGNED(GET_LOC(state, instr))) return;
+    VLoc this_loc = GET_LOC(state, instr);
     unmark_loc(this_loc, state);
 
+    if (state->callback.aot) {
+        if (this_loc.is_reg) {
+            emit_mov_reloc(this_loc.reg, RELOC_FUNCTION, instr->name, state);
+        } else {
+            asm_emit_mov(this_loc, WRAP_REG(TMP_1_REG), &state->writer);
+            emit_mov_reloc(TMP_1_REG, RELOC_FUNCTION, instr->name, state);
+        }
+        return;
+    }
+
     if (state->used_registers[RAX]) asm_emit_pop_r64(RAX, &state->writer);
     if (state->used_registers[RDX]) asm_emit_pop_r64(RDX, &state->writer);
     if (state->used_registers[RCX]) asm_emit_pop_r64(RCX, &state->writer);
+    uint16_t saved = emit_restore_volatile_regs(state);
 
     asm_emit_mov(this_loc, WRAP_REG(RAX), &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xc4, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
+    emit_release_shadow_space(PUSHED_REGS(state) | saved, state);
+    emit_safepoint(PUSHED_REGS(state) | saved, state);
     asm_emit_call_r64(RAX, &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xec, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
-    asm_emit_mov_r64_i64(RAX, (uint64_t) state->callback.compiled_callback, &state->writer);
-    asm_emit_mov_r64_i64(RCX, (uint64_t) state->callback.jit_ptr, &state->writer);
-    asm_emit_mov_r64_i64(RDX, (uint64_t) instr->name, &state->writer);
+    emit_reserve_shadow_space(PUSHED_REGS(state) | saved, state);
+    emit_mov_reloc(RAX, RELOC_COMPILED_CALLBACK, state->callback.compiled_callback, state);
+    emit_mov_reloc(RCX, RELOC_JIT_PTR, state->callback.jit_ptr, state);
+    emit_mov_reloc(RDX, RELOC_STRING, instr->name, state);
 
+    emit_save_volatile_regs(saved, state);
     if (state->used_registers[RCX]) asm_emit_push_r64(RCX, &state->writer);
     if (state->used_registers[RDX]) asm_emit_push_r64(RDX, &state->writer);
     if (state->used_registers[RAX]) asm_emit_push_r64(RAX, &state->writer);
 }
 
+// Moves the callee and the arguments into place at once, no move may overwrite a source which is still needed.
+// Every target is a register, so whatever is left once no move is free is a cycle of registers, broken up by exchanges.
+void static inline emit_call_moves(VLoc* from, VLoc* to, uint32_t num_moves, struct AssemblerState* state) {
+    // worked out in program order, then emitted back to front
+    VLoc op_from[2 * num_moves + 1];
+    VLoc op_to[2 * num_moves + 1];
+    bool op_xchg[2 * num_moves + 1];
+    uint32_t num_ops = 0;
+
+    bool done[num_moves];
+    uint32_t num_left = 0;
+    for (uint32_t i = 0; i < num_moves; i++) {
+        done[i] = loc_equal(from[i], to[i]);
+        if (!done[i]) num_left++;
+    }
+    while (num_left) {
+        bool progress = false;
+        for (uint32_t i = 0; i < num_moves; i++) {
+            if (done[i]) continue;
+            bool blocked = false;
+            for (uint32_t k = 0; k < num_moves; k++) {
+                if (k != i && !done[k] && loc_equal(from[k], to[i])) blocked = true;
+            }
+            if (blocked) continue;
+            op_from[num_ops] = from[i]; op_to[num_ops] = to[i]; op_xchg[num_ops++] = false;
+            done[i] = true;
+            num_left--;
+            progress = true;
+        }
+        if (progress) continue;
+
+        uint32_t i = 0;
+        while (done[i]) i++;
+        VLoc a = from[i];
+        VLoc b = to[i];
+        op_from[num_ops] = a; op_to[num_ops] = b; op_xchg[num_ops++] = true;
+        done[i] = true;
+        num_left--;
+        for (uint32_t k = 0; k < num_moves; k++) {
+            if (done[k]) continue;
+            if (loc_equal(from[k], a)) from[k] = b;
+            else if (loc_equal(from[k], b)) from[k] = a;
+            if (loc_equal(from[k], to[k])) {
+                done[k] = true;
+                num_left--;
+            }
+        }
+    }
+
+    for (int32_t op = (int32_t) num_ops - 1; op >= 0; op--) {
+        if (op_xchg[op]) asm_emit_xchg(op_to[op], op_from[op], &state->writer);
+        else asm_emit_mov(op_to[op], op_from[op], &state->writer);
+    }
+    state->num_moves += num_ops;
+}
+
 void static inline emit_call(Instruction* instruction, struct AssemblerState* state) {
     struct CallIR* instr = &instruction->ir_call;
 
-    if (!IS_ASSIGNED(GET_LOC(instr))) return;
-    VLoc this_loc = GET_LOC(instr);
+    if (!IS_ASSIGNED(GET_LOC(state, instr))) return;
+    VLoc this_loc = GET_LOC(state, instr);
     unmark_loc(this_loc, state);
 
-    // TODO here and above state saving
     bool push_rax = false;
     bool push_rdx = false;
     bool push_rcx = false;
     if (state->used_registers[RAX]) { asm_emit_pop_r64(RAX, &state->writer); push_rax = true;}
     if (state->used_registers[RDX]) { asm_emit_pop_r64(RDX, &state->writer); push_rdx = true;}
     if (state->used_registers[RCX]) { asm_emit_pop_r64(RCX, &state->writer); push_rcx = true;}
-
-    VLoc* callee_reg = instr_assign_loc(instr->callee, WRAP_REG(RAX), state);
+    uint16_t saved = emit_restore_volatile_regs(state);
 
     asm_emit_mov(this_loc, WRAP_REG(RAX), &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xc4, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
-    asm_emit_call(*callee_reg, &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xec, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
-
-    int arg_num = 0;
-    FOREACH(arg_ptr, instr->arguments, IRValue) {
-        IRValue arg = *arg_ptr;
+    uint16_t pushed = (push_rax << RAX) | (push_rcx << RCX) | (push_rdx << RDX) | saved;
+    emit_release_shadow_space(pushed, state);
+    emit_safepoint(pushed, state);
+    asm_emit_call_r64(RAX, &state->writer);
+    emit_reserve_shadow_space(pushed, state);
+
+    // the callee goes into RAX, which the call clobbers anyway
+    VLoc move_from[5];
+    VLoc move_to[5];
+    uint32_t num_moves = 0;
+    move_to[num_moves] = WRAP_REG(RAX);
+    move_from[num_moves++] = *instr_assign_loc(IR_VALUE(state->func, instr->callee), WRAP_REG(RAX), state);
+    FOREACH_VEC(arg_ptr, instr->arguments, IRRef) {
+        IRValue arg = IR_VALUE(state->func, *arg_ptr);
         VLoc reg;
-        switch (arg_num) {
+        switch (num_moves - 1) {
             case 0: reg = WRAP_REG(RCX); break;
             case 1: reg = WRAP_REG(RDX); break;
             case 2: reg = WRAP_REG(R8); break;
-            case 4: reg = WRAP_REG(R9); break;
+            case 3: reg = WRAP_REG(R9); break;
             default: exit(-1);
         }
-        asm_emit_mov(reg, *instr_assign_loc(arg, reg, state), &state->writer);
-        // TODO convert to swap
-        arg_num++;
+        move_to[num_moves] = reg;
+        move_from[num_moves++] = *instr_assign_loc(arg, reg, state);
     }
+    emit_call_moves(move_from, move_to, num_moves, state);
 
+    emit_save_volatile_regs(saved, state);
     if (push_rcx) asm_emit_push_r64(RCX, &state->writer);
     if (push_rdx) asm_emit_push_r64(RDX, &state->writer);
     if (push_rax) asm_emit_push_r64(RAX, &state->writer);
@@ -228,95 +306,102 @@ void static inline emit_call(Instruction* instruction, struct AssemblerState* st
 
 void static inline emit_get_attr(Instruction* instruction, struct AssemblerState* state) {
     struct GetAttrIR* instr = &instruction->ir_get_attr;
+    Instruction* obj = IR_VALUE(state->func, instr->obj);
 
-    if (!IS_ASSIGNED(GET_LOC(instr))) return;
-    VLoc this_loc = GET_LOC(instr);
+    if (!IS_ASSIGNED(GET_LOC(state, instr))) return;
+    VLoc this_loc = GET_LOC(state, instr);
     unmark_loc(this_loc, state);
 
-    VLoc* obj_reg = instr_assign_loc(instr->obj, WRAP_REG(RCX), state);
-
-    if (state->used_registers[RAX]) asm_emit_pop_r64(RAX, &state->writer);
-    if (state->used_registers[RDX]) asm_emit_pop_r64(RDX, &state->writer);
-    if (state->used_registers[RCX]) asm_emit_pop_r64(RCX, &state->writer);
+    // only what is live past the call is saved, the object may be dead after it
+    uint16_t pushed = PUSHED_REGS(state);
+    if (pushed >> RAX & 1) asm_emit_pop_r64(RAX, &state->writer);
+    if (pushed >> RDX & 1) asm_emit_pop_r64(RDX, &state->writer);
+    if (pushed >> RCX & 1) asm_emit_pop_r64(RCX, &state->writer);
+    uint16_t saved = emit_restore_volatile_regs(state);
+    pushed |= saved;
 
     asm_emit_mov(this_loc, WRAP_REG(RAX), &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xc4, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
+    emit_release_shadow_space(pushed, state);
+    emit_safepoint(pushed, state);
     asm_emit_call_r64(RAX, &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xec, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
-    asm_emit_mov_r64_i64(RAX, (uint64_t) hash_table_get_ptr, &state->writer);
+    emit_reserve_shadow_space(pushed, state);
+    emit_mov_reloc(RAX, RELOC_HASH_TABLE_GET, ojit_get_attr_ptr, state);
+    emit_mov_reloc(RDX, RELOC_STRING, instr->attr, state);
+    VLoc* obj_reg = instr_assign_loc(obj, WRAP_REG(RCX), state);
     asm_emit_mov(WRAP_REG(RCX), *obj_reg, &state->writer);
-    asm_emit_mov_r64_i64(RDX, (uint64_t) instr->attr, &state->writer);
 
-    if (state->used_registers[RCX]) asm_emit_push_r64(RCX, &state->writer);
-    if (state->used_registers[RDX]) asm_emit_push_r64(RDX, &state->writer);
-    if (state->used_registers[RAX]) asm_emit_push_r64(RAX, &state->writer);
+    emit_save_volatile_regs(saved, state);
+    if (pushed >> RCX & 1) asm_emit_push_r64(RCX, &state->writer);
+    if (pushed >> RDX & 1) asm_emit_push_r64(RDX, &state->writer);
+    if (pushed >> RAX & 1) asm_emit_push_r64(RAX, &state->writer);
 }
 
+// The attribute's location is a pointer to its value in the object's table
 void static inline emit_get_loc(Instruction* instruction, struct AssemblerState* state) {
     struct GetLocIR* instr = &instruction->ir_get_loc;
-    OJIT_ASSERT(INSTR_TYPE(instr->loc) == ID_GET_ATTR_IR, "err");
+    Instruction* loc = IR_VALUE(state->func, instr->loc);
+    OJIT_ASSERT(INSTR_TYPE(state->func, loc) == ID_GET_ATTR_IR, "err");
 
-    if (!IS_ASSIGNED(GET_LOC(instr))) return;
-    VLoc this_loc = GET_LOC(instr);
+    if (!IS_ASSIGNED(GET_LOC(state, instr))) return;
+    VLoc this_loc = GET_LOC(state, instr);
     unmark_loc(this_loc, state);
 
-    VLoc* loc_reg = instr_assign_loc(instr->loc, this_loc, state);
+    VLoc* loc_reg = instr_assign_loc(loc, this_loc, state);
 
-    asm_emit_mov(this_loc, *loc_reg, &state->writer);
+    asm_emit_mov(this_loc, WRAP_REG(TMP_1_REG), &state->writer);
+    asm_emit_load_with_offset(TMP_1_REG, TMP_2_REG, 0, &state->writer);
+    asm_emit_mov(WRAP_REG(TMP_2_REG), *loc_reg, &state->writer);
 }
 
 void static inline emit_set_loc(Instruction* instruction, struct AssemblerState* state) {
     struct SetLocIR* instr = &instruction->ir_set_loc;
-    OJIT_ASSERT(INSTR_TYPE(instr->loc) == ID_GET_ATTR_IR, "err");
+    Instruction* loc = IR_VALUE(state->func, instr->loc);
+    Instruction* value = IR_VALUE(state->func, instr->value);
+    OJIT_ASSERT(INSTR_TYPE(state->func, loc) == ID_GET_ATTR_IR, "err");
 
-    VLoc this_loc = GET_LOC(instr);
+    VLoc this_loc = GET_LOC(state, instr);
     if (IS_ASSIGNED(this_loc)) {
         unmark_loc(this_loc, state);
     }
 
-    VLoc* loc_reg = instr_assign_loc(instr->loc, this_loc, state);
-    VLoc* value_reg = instr_assign_loc(instr->value, this_loc, state);
+    VLoc* loc_reg = instr_assign_loc(loc, this_loc, state);
+    VLoc* value_reg = instr_assign_loc(value, this_loc, state);
 
-    asm_emit_mov(*loc_reg, *value_reg, &state->writer);
+    asm_emit_store_with_offset(TMP_2_REG, 0, TMP_1_REG, &state->writer);
+    asm_emit_mov(WRAP_REG(TMP_1_REG), *value_reg, &state->writer);
+    asm_emit_mov(WRAP_REG(TMP_2_REG), *loc_reg, &state->writer);
 }
 
 void static inline emit_new_object(Instruction* instruction, struct AssemblerState* state) {
     struct NewObjectIR* instr = &instruction->ir_new_object;
 
-    if (!IS_ASSIGNED(GET_LOC(instr))) return;
-    VLoc this_loc = GET_LOC(instr);
+    if (!IS_ASSIGNED(GET_LOC(state, instr))) return;
+    VLoc this_loc = GET_LOC(state, instr);
     unmark_loc(this_loc, state);
 
     if (state->used_registers[RAX]) asm_emit_pop_r64(RAX, &state->writer);
     if (state->used_registers[RDX]) asm_emit_pop_r64(RDX, &state->writer);
     if (state->used_registers[RCX]) asm_emit_pop_r64(RCX, &state->writer);
+    uint16_t saved = emit_restore_volatile_regs(state);
 
     asm_emit_mov(this_loc, WRAP_REG(RAX), &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xc4, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
+    emit_release_shadow_space(PUSHED_REGS(state) | saved, state);
+    emit_safepoint(PUSHED_REGS(state) | saved, state);
     asm_emit_call_r64(RAX, &state->writer);
-    asm_emit_byte(0x20, &state->writer);
-    asm_emit_byte(0xec, &state->writer);
-    asm_emit_byte(0x83, &state->writer);
-    asm_emit_byte(0x48, &state->writer);
-    asm_emit_mov_r64_i64(RAX, (uint64_t) new_hash_table, &state->writer);
-    asm_emit_mov_r64_i64(RCX, (uint64_t) state->jit_mem, &state->writer);
+    emit_reserve_shadow_space(PUSHED_REGS(state) | saved, state);
+    emit_mov_reloc(RAX, RELOC_NEW_OBJECT_CALLBACK, state->callback.new_object_callback, state);
+    emit_mov_reloc(RCX, RELOC_JIT_PTR, state->callback.jit_ptr, state);
 
+    emit_save_volatile_regs(saved, state);
     if (state->used_registers[RCX]) asm_emit_push_r64(RCX, &state->writer);
     if (state->used_registers[RDX]) asm_emit_push_r64(RDX, &state->writer);
     if (state->used_registers[RAX]) asm_emit_push_r64(RAX, &state->writer);
 }
 
 void static inline emit_instruction(Instruction* instruction_ir, struct AssemblerState* state) {
-    switch (instruction_ir->base.id) {
+    // not live at its own call, if it makes one
+    value_defined(IR_REF(instruction_ir), state);
+    switch (INSTR_TYPE(state->func, instruction_ir)) {
         case ID_INT_IR: emit_int(instruction_ir, state); break;
         case ID_ADD_IR: emit_add(instruction_ir, state); break;
         case ID_SUB_IR: emit_sub(instruction_ir, state); break;
@@ -331,7 +416,7 @@ void static inline emit_instruction(Instruction* instruction_ir, struct Assemble
         case ID_INSTR_NONE:
             ojit_new_error();
             ojit_build_error_chars("Broken or Unimplemented instruction: ");
-            ojit_build_error_int(instruction_ir->base.id);
+            ojit_build_error_int(INSTR_TYPE(state->func, instruction_ir));
             ojit_error();
             exit(-1);
     }
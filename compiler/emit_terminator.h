@@ -7,8 +7,11 @@
 void static inline emit_return(union TerminatorIR* terminator, struct AssemblerState* state) {
     struct ReturnIR* ret = &terminator->ir_return;
     asm_emit_ret(&state->writer);
-    instr_assign_loc(ret->value, WRAP_REG(RAX), state);
-    asm_emit_mov(WRAP_REG(RAX), GET_LOC(ret->value), &state->writer);
+    asm_emit_pop_r64(TMP_1_REG, &state->writer);
+    asm_emit_pop_r64(TMP_2_REG, &state->writer);
+    Instruction* value = IR_VALUE(state->func, ret->value);
+    instr_assign_loc(value, WRAP_REG(RAX), state);
+    asm_emit_mov(WRAP_REG(RAX), GET_LOC(state, value), &state->writer);
     asm_emit_pop_r64(RBP, &state->writer);
     asm_emit_mov_r64_r64(RSP, RBP, &state->writer);
 }
@@ -22,17 +25,17 @@ bool vloc_list_contains(VLoc** list, uint32_t num_items, VLoc item) {
 }
 
 void static inline resolve_defined_arguments(struct BlockIR* target, VLoc** swap_from, VLoc** swap_to, VLoc** target_locs, uint32_t* target_locs_index, struct AssemblerState* state) {
-    FOREACH_INSTR(instr, target->first_instrs) {
-        if (instr->base.id == ID_BLOCK_PARAMETER_IR) {
+    FOREACH_INSTR(instr, target) {
+        if (INSTR_TYPE(state->func, instr) == ID_BLOCK_PARAMETER_IR) {
             struct ParameterIR* param = &instr->ir_parameter;
-            if (param->base.refs == 0) continue;
+            if (INSTR_REF(state->func, param) == 0) continue;
             IRValue argument;
             hash_table_get(&state->block->variables, STRING_KEY(param->var_name), (uint64_t*) &argument);
 
-            if (IS_ASSIGNED(GET_LOC(argument)) || INSTR_TYPE(argument) == ID_BLOCK_PARAMETER_IR) {
-                instr_assign_loc(argument, param->entry_loc, state);
-                VLoc* arg_loc = &GET_LOC(argument);
-                VLoc* param_loc = &param->entry_loc;
+            if (IS_ASSIGNED(GET_LOC(state, argument)) || INSTR_TYPE(state->func, argument) == ID_BLOCK_PARAMETER_IR) {
+                instr_assign_loc(argument, ENTRY_LOC(state, param), state);
+                VLoc* arg_loc = &GET_LOC(state, argument);
+                VLoc* param_loc = &ENTRY_LOC(state, param);
                 if (!IS_ASSIGNED(*param_loc)) {
                     *param_loc = *arg_loc;
                     if (vloc_list_contains(target_locs, target->num_params, *arg_loc)) {
@@ -71,17 +74,17 @@ void static inline resolve_defined_arguments(struct BlockIR* target, VLoc** swap
 }
 
 void static inline resolve_undefined_arguments(struct BlockIR* target, VLoc** swap_from, VLoc** swap_to, VLoc** target_locs, uint32_t* target_locs_index, struct AssemblerState* state) {
-    FOREACH_INSTR(instr, target->first_instrs) {
-        if (instr->base.id == ID_BLOCK_PARAMETER_IR) {
+    FOREACH_INSTR(instr, target) {
+        if (INSTR_TYPE(state->func, instr) == ID_BLOCK_PARAMETER_IR) {
             struct ParameterIR* param = &instr->ir_parameter;
-            if (param->base.refs == 0) continue;
+            if (INSTR_REF(state->func, param) == 0) continue;
             IRValue argument;
             hash_table_get(&state->block->variables, STRING_KEY(param->var_name), (uint64_t*) &argument);
 
-            if (!IS_ASSIGNED(GET_LOC(argument)) || INSTR_TYPE(argument) != ID_BLOCK_PARAMETER_IR) {
-                instr_assign_loc(argument, param->entry_loc, state);
-                VLoc* arg_loc = &GET_LOC(argument);
-                VLoc* param_loc = &param->entry_loc;
+            if (!IS_ASSIGNED(GET_LOC(state, argument)) || INSTR_TYPE(state->func, argument) != ID_BLOCK_PARAMETER_IR) {
+                instr_assign_loc(argument, ENTRY_LOC(state, param), state);
+                VLoc* arg_loc = &GET_LOC(state, argument);
+                VLoc* param_loc = &ENTRY_LOC(state, param);
                 if (!IS_ASSIGNED(*param_loc)) {
                     *param_loc = *arg_loc;
                     if (vloc_list_contains(target_locs, target->num_params, *arg_loc)) {
@@ -141,7 +144,7 @@ void static inline resolve_branch(struct BlockIR* target, struct AssemblerState*
     resolve_defined_arguments(target, swap_from, swap_to, target_locs, &target_locs_index, state);
     resolve_undefined_arguments(target, swap_from, swap_to, target_locs, &target_locs_index, state);
 
-    map_registers(swap_from, swap_to, target->num_params, &state->writer);
+    state->num_moves += map_registers(swap_from, swap_to, target->num_params, &state->writer);
 }
 
 void static inline emit_branch(union TerminatorIR* terminator, struct AssemblerState* state) {
@@ -152,17 +155,25 @@ void static inline emit_branch(union TerminatorIR* terminator, struct AssemblerS
     resolve_branch(branch->target, state);
 }
 
+void static inline emit_count_true_edge(struct AssemblerState* state) {
+    if (state->profile_counters) {
+        asm_emit_inc_counter(&state->profile_counters[state->block->block_index * 2 + 1], &state->writer);
+    }
+}
+
 void static inline emit_cbranch(union TerminatorIR* terminator, struct AssemblerState* state) {
     struct CBranchIR* cbranch = &terminator->ir_cbranch;
+    Instruction* cond = IR_VALUE(state->func, cbranch->cond);
 
 #ifdef OJIT_OPTIMIZATIONS
-    if (INSTR_TYPE(cbranch->cond) == ID_CMP_IR) {
-        if (!IS_ASSIGNED(GET_LOC(cbranch->cond))) {
+    if (INSTR_TYPE(state->func, cond) == ID_CMP_IR) {
+        if (!IS_ASSIGNED(GET_LOC(state, cond))) {
             asm_emit_jcc(IF_NOT_ZERO, cbranch->true_target->data, &state->writer);
             resolve_branch(cbranch->true_target, state);
-            asm_emit_jcc(INV_CMP(cbranch->cond->ir_cmp.cmp), cbranch->false_target->data, &state->writer);
+            emit_count_true_edge(state);
+            asm_emit_jcc(INV_CMP(cond->ir_cmp.cmp), cbranch->false_target->data, &state->writer);
             resolve_branch(cbranch->false_target, state);
-            emit_cmp(cbranch->cond, state, false);
+            emit_cmp(cond, state, false);
             return;
         }
     }
@@ -170,12 +181,13 @@ void static inline emit_cbranch(union TerminatorIR* terminator, struct Assembler
 
     asm_emit_jcc(IF_NOT_ZERO, cbranch->true_target->data, &state->writer);
     resolve_branch(cbranch->true_target, state);
+    emit_count_true_edge(state);
     asm_emit_jcc(IF_ZERO, cbranch->false_target->data, &state->writer);
     resolve_branch(cbranch->false_target, state);
 
-    enum Registers reg = postload_loc(&GET_LOC(cbranch->cond), WRAP_NONE(), state);
+    enum Registers reg = postload_loc(&GET_LOC(state, cond), WRAP_NONE(), state);
     asm_emit_test_r64_r64(reg, reg, &state->writer);
-    load_loc(&GET_LOC(cbranch->cond), state);
+    load_loc(&GET_LOC(state, cond), state);
 }
 
 void static inline emit_terminator(union TerminatorIR* terminator_ir, struct AssemblerState* state) {
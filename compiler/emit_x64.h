@@ -70,7 +70,7 @@ void static inline asm_emit_mov_r32_r32(enum Registers dest, enum Registers sour
 
 void static inline asm_emit_mov_r32_ir32(enum Registers dest, enum Registers base, uint8_t offset, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, dest, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, dest & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x8B, writer);
     if ((base >> 3 & 0b1) || (dest >> 3 & 0b1))
         asm_emit_byte(REX(0b0, dest >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
@@ -78,7 +78,7 @@ void static inline asm_emit_mov_r32_ir32(enum Registers dest, enum Registers bas
 
 void static inline asm_emit_mov_ir32_r32(enum Registers base, uint8_t offset, enum Registers source, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, source, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, source & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x89, writer);
     if ((base >> 3 & 0b1) || (source >> 3 & 0b1))
         asm_emit_byte(REX(0b1, source >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
@@ -95,14 +95,14 @@ void static inline asm_emit_mov_r64_r64(enum Registers dest, enum Registers sour
 
 void static inline asm_emit_load_with_offset(enum Registers dest, enum Registers base, uint8_t offset, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, dest, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, dest & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x8B, writer);
     asm_emit_byte(REX(0b1, dest >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
 
 void static inline asm_emit_store_with_offset(enum Registers base, uint8_t offset, enum Registers source, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, source, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, source & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x89, writer);
     asm_emit_byte(REX(0b1, source >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
@@ -113,6 +113,14 @@ void static inline asm_emit_mov_ir64_r64(enum Registers in_dest, enum Registers
     asm_emit_byte(REX(0b1, source >> 3 & 0b1, 0b0, in_dest >> 3 & 0b1), writer);
 }
 
+void static inline asm_emit_lea_r64_ir64(enum Registers dest, enum Registers base, uint8_t offset, struct AssemblyWriter* writer) {
+    asm_emit_int8(offset, writer);
+    if ((base & 0b0111) == 0b0100) asm_emit_byte(0x24, writer);  // RSP and R12 can only be addressed through a SIB byte
+    asm_emit_byte(MODRM(0b01, dest & 0b0111, base & 0b0111), writer);
+    asm_emit_byte(0x8D, writer);
+    asm_emit_byte(REX(0b1, dest >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
+}
+
 void static inline asm_emit_mov_r64_i64(enum Registers dest, uint64_t constant, struct AssemblyWriter* writer) {
     // TODO look into movzx instruction
 #ifdef OJIT_OPTIMIZATIONS
@@ -134,9 +142,45 @@ void static inline asm_emit_mov_r64_i64(enum Registers dest, uint64_t constant,
     asm_emit_byte(REX(0b1, 0b0, 0b0, dest >> 3 & 0b0001), writer);
 }
 
+// Adds one to the counter without touching the flags, so it can sit between a compare and the jumps using it
+void static inline asm_emit_inc_counter(uint64_t* counter, struct AssemblyWriter* writer) {
+    asm_emit_store_with_offset(TMP_2_REG, 0, TMP_1_REG, writer);
+    asm_emit_lea_r64_ir64(TMP_1_REG, TMP_1_REG, 1, writer);
+    asm_emit_load_with_offset(TMP_1_REG, TMP_2_REG, 0, writer);
+    asm_emit_mov_r64_i64(TMP_2_REG, (uint64_t) counter, writer);
+}
+
+// Always uses the full 64-bit immediate, so the address can be patched when the code is loaded elsewhere
+void static inline asm_emit_mov_r64_reloc(enum Registers dest, enum RelocKind kind, void* target, struct AssemblyWriter* writer) {
+    struct SegmentReloc* reloc = &create_segment_reloc(writer->label, writer->curr, writer->write_mem)->reloc;
+    reloc->kind = kind;
+    reloc->target = target;
+    reloc->size = 8;
+    writer->curr = create_segment_code(writer->label, (Segment*) reloc, writer->write_mem);
+
+    asm_emit_int64((uint64_t) target, writer);
+    asm_emit_byte(0xB8 + (dest & 0b0111), writer);
+    asm_emit_byte(REX(0b1, 0b0, 0b0, dest >> 3 & 0b0001), writer);
+}
+
+// mov dest, [rip + disp32], loading the address from a GOT entry the linker fills in,
+// so AOT code needs no relocations in .text when it's linked into a position independent executable
+void static inline asm_emit_mov_r64_got(enum Registers dest, enum RelocKind kind, void* target, struct AssemblyWriter* writer) {
+    struct SegmentReloc* reloc = &create_segment_reloc(writer->label, writer->curr, writer->write_mem)->reloc;
+    reloc->kind = kind;
+    reloc->target = target;
+    reloc->size = 4;
+    writer->curr = create_segment_code(writer->label, (Segment*) reloc, writer->write_mem);
+
+    asm_emit_int32(0, writer);
+    asm_emit_byte(MODRM(0b00, dest & 0b0111, 0b101), writer);
+    asm_emit_byte(0x8B, writer);
+    asm_emit_byte(REX(0b1, dest >> 3 & 0b1, 0b0, 0b0), writer);
+}
+
 void static inline asm_emit_xchg_r64_ir64(enum Registers dest, enum Registers base, uint8_t offset, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, dest, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, dest & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x87, writer);
     asm_emit_byte(REX(0b1, dest >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
@@ -177,14 +221,14 @@ void static inline asm_emit_and_r64_r64(enum Registers dest, enum Registers sour
 
 void static inline asm_emit_and_r64_ir64(enum Registers dest, enum Registers base, uint8_t offset, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, dest, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, dest & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x23, writer);
     asm_emit_byte(REX(0b1, dest >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
 
 void static inline asm_emit_and_ir64_r64(enum Registers base, uint8_t offset, enum Registers source, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, source, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, source & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x21, writer);
     asm_emit_byte(REX(0b1, source >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
@@ -197,14 +241,14 @@ void static inline asm_emit_add_r64_r64(enum Registers dest, enum Registers sour
 
 void static inline asm_emit_add_r64_ir64(enum Registers dest, enum Registers base, uint8_t offset, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, dest, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, dest & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x03, writer);
     asm_emit_byte(REX(0b1, dest >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
 
 void static inline asm_emit_add_ir64_r64(enum Registers base, uint8_t offset, enum Registers source, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, source, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, source & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x01, writer);
     asm_emit_byte(REX(0b1, source >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
@@ -239,14 +283,14 @@ void static inline asm_emit_sub_r64_r64(enum Registers dest, enum Registers sour
 
 void static inline asm_emit_sub_r64_ir64(enum Registers dest, enum Registers base, uint8_t offset, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, dest, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, dest & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x2B, writer);
     asm_emit_byte(REX(0b1, dest >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
 
 void static inline asm_emit_sub_ir64_r64(enum Registers base, uint8_t offset, enum Registers source, struct AssemblyWriter* writer) {
     asm_emit_int8(offset, writer);
-    asm_emit_byte(MODRM(0b01, source, base & 0b0111), writer);
+    asm_emit_byte(MODRM(0b01, source & 0b0111, base & 0b0111), writer);
     asm_emit_byte(0x29, writer);
     asm_emit_byte(REX(0b1, source >> 3 & 0b1, 0b0, base >> 3 & 0b1), writer);
 }
@@ -417,12 +461,12 @@ void static inline asm_emit_mov(VLoc dest, VLoc source, struct AssemblyWriter* w
     if (dest.is_reg && source.is_reg) {
         asm_emit_mov_r64_r64(dest.reg, source.reg, writer);
     } else if (dest.is_reg) {
-        asm_emit_load_with_offset(dest.reg, RBP, source.offset * 8, writer);
+        asm_emit_load_with_offset(dest.reg, RBP, VAR_DISP(source.offset), writer);
     } else if (source.is_reg) {
-        asm_emit_store_with_offset(RBP, dest.offset * 8, source.reg, writer);
+        asm_emit_store_with_offset(RBP, VAR_DISP(dest.offset), source.reg, writer);
     } else {
-        asm_emit_store_with_offset(RBP, dest.offset * 8, TMP_1_REG, writer);
-        asm_emit_load_with_offset(TMP_1_REG, RBP, source.offset * 8, writer);
+        asm_emit_store_with_offset(RBP, VAR_DISP(dest.offset), TMP_1_REG, writer);
+        asm_emit_load_with_offset(TMP_1_REG, RBP, VAR_DISP(source.offset), writer);
     }
 }
 
@@ -430,12 +474,12 @@ void static inline asm_emit_mov32(VLoc dest, VLoc source, struct AssemblyWriter*
     if (dest.is_reg && source.is_reg) {
         asm_emit_mov_r32_r32(dest.reg, source.reg, writer);
     } else if (dest.is_reg) {
-        asm_emit_mov_r32_ir32(dest.reg, RBP, source.offset * 8, writer);
+        asm_emit_mov_r32_ir32(dest.reg, RBP, VAR_DISP(source.offset), writer);
     } else if (source.is_reg) {
-        asm_emit_mov_ir32_r32(RBP, dest.offset * 8, source.reg, writer);
+        asm_emit_mov_ir32_r32(RBP, VAR_DISP(dest.offset), source.reg, writer);
     } else {
-        asm_emit_mov_ir32_r32(RBP, dest.offset * 8, TMP_1_REG, writer);
-        asm_emit_mov_r32_ir32(TMP_1_REG, RBP, source.offset * 8, writer);
+        asm_emit_mov_ir32_r32(RBP, VAR_DISP(dest.offset), TMP_1_REG, writer);
+        asm_emit_mov_r32_ir32(TMP_1_REG, RBP, VAR_DISP(source.offset), writer);
     }
 }
 
@@ -443,13 +487,13 @@ void static inline asm_emit_xchg(VLoc dest, VLoc source, struct AssemblyWriter*
     if (dest.is_reg && source.is_reg) {
         asm_emit_xchg_r64_r64(dest.reg, source.reg, writer);
     } else if (dest.is_reg) {
-        asm_emit_xchg_r64_ir64(dest.reg, RBP, source.offset * 8, writer);
+        asm_emit_xchg_r64_ir64(dest.reg, RBP, VAR_DISP(source.offset), writer);
     } else if (source.is_reg) {
-        asm_emit_xchg_r64_ir64(source.reg, RBP, dest.offset * 8, writer);
+        asm_emit_xchg_r64_ir64(source.reg, RBP, VAR_DISP(dest.offset), writer);
     } else {
-        asm_emit_store_with_offset(RBP, source.offset * 8, TMP_1_REG, writer);
-        asm_emit_xchg_r64_ir64(TMP_1_REG, RBP, dest.offset * 8, writer);
-        asm_emit_load_with_offset(TMP_1_REG, RBP, source.offset * 8, writer);
+        asm_emit_store_with_offset(RBP, VAR_DISP(source.offset), TMP_1_REG, writer);
+        asm_emit_xchg_r64_ir64(TMP_1_REG, RBP, VAR_DISP(dest.offset), writer);
+        asm_emit_load_with_offset(TMP_1_REG, RBP, VAR_DISP(source.offset), writer);
     }
 }
 
@@ -458,7 +502,7 @@ void static inline asm_emit_call(VLoc callee, struct AssemblyWriter* writer) {
     if (callee.is_reg) {
         asm_emit_call_r64(callee.reg, writer);
     } else {
-        asm_emit_call_ir64(RBP, callee.offset * 8, writer);
+        asm_emit_call_ir64(RBP, VAR_DISP(callee.offset), writer);
     }
 }
 
@@ -466,12 +510,12 @@ void static inline asm_emit_and(VLoc dest, VLoc source, struct AssemblyWriter* w
     if (dest.is_reg && source.is_reg) {
         asm_emit_and_r64_r64(dest.reg, source.reg, writer);
     } else if (dest.is_reg) {
-        asm_emit_and_r64_ir64(dest.reg, RBP, source.offset * 8, writer);
+        asm_emit_and_r64_ir64(dest.reg, RBP, VAR_DISP(source.offset), writer);
     } else if (source.is_reg) {
-        asm_emit_and_ir64_r64(RBP, dest.offset * 8, source.reg, writer);
+        asm_emit_and_ir64_r64(RBP, VAR_DISP(dest.offset), source.reg, writer);
     } else {
-        asm_emit_and_ir64_r64(RBP, dest.offset * 8, TMP_1_REG, writer);
-        asm_emit_load_with_offset(TMP_1_REG, RBP, source.offset * 8, writer);
+        asm_emit_and_ir64_r64(RBP, VAR_DISP(dest.offset), TMP_1_REG, writer);
+        asm_emit_load_with_offset(TMP_1_REG, RBP, VAR_DISP(source.offset), writer);
     }
 }
 
@@ -479,12 +523,12 @@ void static inline asm_emit_add(VLoc dest, VLoc source, struct AssemblyWriter* w
     if (dest.is_reg && source.is_reg) {
         asm_emit_add_r64_r64(dest.reg, source.reg, writer);
     } else if (dest.is_reg) {
-        asm_emit_add_r64_ir64(dest.reg, RBP, source.offset * 8, writer);
+        asm_emit_add_r64_ir64(dest.reg, RBP, VAR_DISP(source.offset), writer);
     } else if (source.is_reg) {
-        asm_emit_add_ir64_r64(RBP, dest.offset * 8, source.reg, writer);
+        asm_emit_add_ir64_r64(RBP, VAR_DISP(dest.offset), source.reg, writer);
     } else {
-        asm_emit_add_ir64_r64(RBP, dest.offset * 8, TMP_1_REG, writer);
-        asm_emit_load_with_offset(TMP_1_REG, RBP, source.offset * 8, writer);
+        asm_emit_add_ir64_r64(RBP, VAR_DISP(dest.offset), TMP_1_REG, writer);
+        asm_emit_load_with_offset(TMP_1_REG, RBP, VAR_DISP(source.offset), writer);
     }
 }
 
@@ -492,12 +536,12 @@ void static inline asm_emit_sub(VLoc dest, VLoc source, struct AssemblyWriter* w
     if (dest.is_reg && source.is_reg) {
         asm_emit_sub_r64_r64(dest.reg, source.reg, writer);
     } else if (dest.is_reg) {
-        asm_emit_sub_r64_ir64(dest.reg, RBP, source.offset * 8, writer);
+        asm_emit_sub_r64_ir64(dest.reg, RBP, VAR_DISP(source.offset), writer);
     } else if (source.is_reg) {
-        asm_emit_sub_ir64_r64(RBP, dest.offset * 8, source.reg, writer);
+        asm_emit_sub_ir64_r64(RBP, VAR_DISP(dest.offset), source.reg, writer);
     } else {
-        asm_emit_sub_ir64_r64(RBP, dest.offset * 8, TMP_1_REG, writer);
-        asm_emit_load_with_offset(TMP_1_REG, RBP, source.offset * 8, writer);
+        asm_emit_sub_ir64_r64(RBP, VAR_DISP(dest.offset), TMP_1_REG, writer);
+        asm_emit_load_with_offset(TMP_1_REG, RBP, VAR_DISP(source.offset), writer);
     }
 }
 
@@ -505,16 +549,18 @@ void static inline asm_emit_cmp(VLoc a, VLoc b, struct AssemblyWriter* writer) {
     if (a.is_reg && b.is_reg) {
         asm_emit_cmp_r64_r64(a.reg, b.reg, writer);
     } else if (a.is_reg) {
-        asm_emit_cmp_r64_ir64(a.reg, RBP, b.offset * 8, writer);
+        asm_emit_cmp_r64_ir64(a.reg, RBP, VAR_DISP(b.offset), writer);
     } else if (b.is_reg) {
-        asm_emit_cmp_ir64_r64(RBP, a.offset * 8, b.reg, writer);
+        asm_emit_cmp_ir64_r64(RBP, VAR_DISP(a.offset), b.reg, writer);
     } else {
-        asm_emit_cmp_ir64_r64(RBP, b.offset * 8, TMP_1_REG, writer);
-        asm_emit_load_with_offset(TMP_1_REG, RBP, a.offset * 8, writer);
+        asm_emit_cmp_ir64_r64(RBP, VAR_DISP(b.offset), TMP_1_REG, writer);
+        asm_emit_load_with_offset(TMP_1_REG, RBP, VAR_DISP(a.offset), writer);
     }
 }
 
-void static inline map_registers(VLoc** map_from, VLoc** map_to, uint32_t rows, struct AssemblyWriter* writer) {
+// Returns how many moves and exchanges were emitted
+uint32_t static inline map_registers(VLoc** map_from, VLoc** map_to, uint32_t rows, struct AssemblyWriter* writer) {
+    uint32_t num_moves = 0;
     VLoc* moves_from[rows];
     VLoc* moves_to[rows];
     for (int i = 0; i < rows; i++) {
@@ -553,7 +599,9 @@ void static inline map_registers(VLoc** map_from, VLoc** map_to, uint32_t rows,
         } else {
             asm_emit_mov(*loc_into, *from, writer);
         }
+        if (!loc_equal(*loc_into, *from)) num_moves++;
     }
+    return num_moves;
 }
 
 #endif //OJIT_EMIT_X64_H
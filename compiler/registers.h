@@ -5,7 +5,9 @@
 #include "emit_x64.h"
 
 // region Registers
-#define GET_LOC(value) ((value)->base.loc)
+// The locations only exist while a function is being compiled, see AssemblerState.locs
+#define GET_LOC(state, value) ((state)->locs[IR_REF(value)])
+#define ENTRY_LOC(state, param) ((state)->entry_locs[IR_REF(param)])
 
 //void static inline mark_reg(enum Registers reg, struct AssemblerState* state);
 //
@@ -42,6 +44,122 @@
 //
 //void static inline emit_wrap_int_i32(VLoc* loc, uint32_t constant, struct AssemblerState* state);
 
+// region Stack Maps
+// Ints are stored unboxed, and globals, attribute locations and comparisons never hold a reference to an object
+bool static inline instr_may_hold_object(struct FunctionIR* func, Instruction* instr) {
+    if (instr == NULL || VALUE_TYPE(func, instr) == TYPE_INT) return false;
+    switch (INSTR_TYPE(func, instr)) {
+        case ID_INT_IR:
+        case ID_CMP_IR:
+        case ID_GLOBAL_IR:
+        case ID_GET_ATTR_IR:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Code is emitted back to front, so a value is live from the first of its uses the emitter sees until its definition.
+// The set is sparse: live_value_index is never cleared, an entry only counts if live_values points back at it.
+bool static inline value_is_live(IRRef ref, struct AssemblerState* state) {
+    uint32_t index = state->live_value_index[ref];
+    return index < state->num_live_values && state->live_values[index] == ref;
+}
+
+void static inline value_used(IRRef ref, struct AssemblerState* state) {
+    if (value_is_live(ref, state)) return;
+    state->live_value_index[ref] = state->num_live_values;
+    state->live_values[state->num_live_values++] = ref;
+}
+
+void static inline value_defined(IRRef ref, struct AssemblerState* state) {
+    if (!value_is_live(ref, state)) return;
+    uint32_t index = state->live_value_index[ref];
+    IRRef last = state->live_values[--state->num_live_values];
+    state->live_values[index] = last;
+    state->live_value_index[last] = index;
+}
+
+// The registers a Windows x64 callee may clobber
+#define REG_IS_VOLATILE(reg) ((reg) == RAX || (reg) == RCX || (reg) == RDX || ((reg) >= R8 && (reg) <= R11))
+
+// Must be emitted directly before the call instruction, since the code is written back to front.
+// Every value live across the call is reported at its location, however it got there.
+void static inline emit_safepoint(uint16_t pushed_regs, struct AssemblerState* state) {
+    struct AssemblyWriter* writer = &state->writer;
+
+    uint16_t live_regs = 0;
+    uint64_t live_slots = 0;
+    for (uint32_t i = 0; i < state->num_live_values; i++) {
+        IRRef ref = state->live_values[i];
+        if (!instr_may_hold_object(state->func, IR_VALUE(state->func, ref))) continue;
+        VLoc loc = state->locs[ref];
+        if (loc.is_reg) {
+            OJIT_ASSERT(!REG_IS_VOLATILE(loc.reg) || (pushed_regs >> loc.reg & 1), "A boxed value in a volatile register isn't saved across a call");
+            live_regs |= 1 << loc.reg;
+        } else {
+            if (loc.offset >= OJIT_MAX_MAP_SLOTS) {
+                ojit_new_error();
+                ojit_build_error_chars("Too many spill slots for a stack map, an object is live in slot ");
+                ojit_build_error_int(loc.offset);
+                ojit_error();
+                exit(-1);
+            }
+            live_slots |= (uint64_t) 1 << loc.offset;
+        }
+    }
+
+    struct SegmentSafepoint* safepoint = &create_segment_safepoint(writer->label, writer->curr, writer->write_mem)->safepoint;
+    safepoint->live_regs = live_regs;
+    safepoint->pushed_regs = pushed_regs;
+    safepoint->live_slots = live_slots;
+
+    writer->curr = create_segment_code(writer->label, (Segment*) safepoint, writer->write_mem);
+}
+
+// RAX, RCX and RDX are saved by each call site itself, since they also carry the arguments and the result.
+// R8-R11 are saved around every call they are in use at; the pops have to be emitted first.
+uint16_t static inline emit_restore_volatile_regs(struct AssemblerState* state) {
+    uint16_t saved = 0;
+    for (enum Registers reg = R8; reg <= R11; reg++) {
+        if (state->used_registers[reg]) {
+            asm_emit_pop_r64(reg, &state->writer);
+            saved |= 1 << reg;
+        }
+    }
+    return saved;
+}
+
+void static inline emit_save_volatile_regs(uint16_t saved, struct AssemblerState* state) {
+    for (enum Registers reg = R11; reg >= R8; reg--) {
+        if (saved >> reg & 1) asm_emit_push_r64(reg, &state->writer);
+    }
+}
+
+// The frame keeps RSP 16 byte aligned, so a call site pads the 32 byte shadow space when it pushed an odd number of registers
+uint32_t static inline shadow_space_size(uint16_t pushed_regs) {
+    uint32_t num_pushed = 0;
+    for (; pushed_regs; pushed_regs &= pushed_regs - 1) num_pushed++;
+    return num_pushed % 2 ? 0x28 : 0x20;
+}
+
+void static inline emit_release_shadow_space(uint16_t pushed_regs, struct AssemblerState* state) {
+    asm_emit_byte(shadow_space_size(pushed_regs), &state->writer);
+    asm_emit_byte(0xc4, &state->writer);
+    asm_emit_byte(0x83, &state->writer);
+    asm_emit_byte(0x48, &state->writer);
+}
+
+void static inline emit_reserve_shadow_space(uint16_t pushed_regs, struct AssemblerState* state) {
+    asm_emit_byte(shadow_space_size(pushed_regs), &state->writer);
+    asm_emit_byte(0xec, &state->writer);
+    asm_emit_byte(0x83, &state->writer);
+    asm_emit_byte(0x48, &state->writer);
+}
+
+#define PUSHED_REGS(state) ((uint16_t) (((state)->used_registers[RAX] << RAX) | ((state)->used_registers[RCX] << RCX) | ((state)->used_registers[RDX] << RDX)))
+// endregion
+
 void static inline mark_reg(enum Registers reg, struct AssemblerState* state) {
     OJIT_ASSERT(state->used_registers[reg] == false, "Attempted to mark a register which is already marked");
     state->used_registers[reg] = true;
@@ -86,10 +204,10 @@ enum Registers get_unused_tmp(const bool* registers) {
 }
 
 VLoc* instr_assign_loc(Instruction* instr, VLoc suggested, struct AssemblerState* state) {
-    VLoc* loc = &GET_LOC(instr);
+    VLoc* loc = &GET_LOC(state, instr);
     if (!IS_ASSIGNED(*loc)) {
-        if (instr->base.id == ID_BLOCK_PARAMETER_IR && IS_ASSIGNED(instr->ir_parameter.entry_loc) && !loc_is_marked(instr->ir_parameter.entry_loc, state)) {
-            *loc = instr->ir_parameter.entry_loc;
+        if (INSTR_TYPE(state->func, instr) == ID_BLOCK_PARAMETER_IR && IS_ASSIGNED(ENTRY_LOC(state, instr)) && !loc_is_marked(ENTRY_LOC(state, instr), state)) {
+            *loc = ENTRY_LOC(state, instr);
         } else if (IS_ASSIGNED(suggested) && !loc_is_marked(suggested, state) && suggested.reg != NO_REG) {
             // Since NO_REG will always be assigned, we don't need to have a specific check
             *loc = suggested;
@@ -104,6 +222,7 @@ VLoc* instr_assign_loc(Instruction* instr, VLoc suggested, struct AssemblerState
         }
         mark_loc(*loc, state);
     }
+    value_used(IR_REF(instr), state);
     return loc;
 }
 
@@ -123,6 +242,8 @@ VLoc* assign_loc(VLoc* loc, VLoc suggested, struct AssemblerState* state) {
         }
         mark_loc(*loc, state);
     }
+    // a use of the value, unless loc is a copy the caller keeps for itself
+    if (loc >= state->locs && loc < state->locs + state->func->values.len) value_used(loc - state->locs, state);
     return loc;
 }
 
@@ -141,7 +262,7 @@ enum Registers store_loc(VLoc* loc, VLoc suggested, struct AssemblerState* state
     assign_loc(loc, suggested, state);
     if (!loc->is_reg) {
         loc->reg = get_unused_tmp(state->used_registers);
-        asm_emit_store_with_offset(RBP, loc->offset * 8, loc->reg, &state->writer);
+        asm_emit_store_with_offset(RBP, VAR_DISP(loc->offset), loc->reg, &state->writer);
         mark_reg(loc->reg, state);
     }
     return loc->reg;
@@ -149,7 +270,7 @@ enum Registers store_loc(VLoc* loc, VLoc suggested, struct AssemblerState* state
 
 void load_loc(VLoc* loc, struct AssemblerState* state) {
     if (!loc->is_reg) {
-        asm_emit_load_with_offset(loc->reg, RBP, loc->offset * 8, &state->writer);
+        asm_emit_load_with_offset(loc->reg, RBP, VAR_DISP(loc->offset), &state->writer);
         unmark_reg(loc->reg, state);
         loc->reg = SPILLED_REG;
     }
@@ -164,7 +285,7 @@ void prestore_loc(VLoc* loc, struct AssemblerState* state) {
 
 void load_loc_into(VLoc* loc, enum Registers reg, struct AssemblerState* state) {
     if (!loc->is_reg) {
-        asm_emit_load_with_offset(reg, RBP, loc->offset * 8, &state->writer);
+        asm_emit_load_with_offset(reg, RBP, VAR_DISP(loc->offset), &state->writer);
     } else {
         asm_emit_mov_r64_r64(reg, loc->reg, &state->writer);
     }
@@ -190,9 +311,9 @@ void static inline emit_assert_loc_i32(VLoc check_loc, struct AssemblerState* st
 }
 
 void static inline emit_assert_instr_i32(Instruction* instr, struct AssemblerState* state) {
-    if (instr->base.type == TYPE_INT)
+    if (VALUE_TYPE(state->func, instr) == TYPE_INT)
         return;
-    emit_assert_loc_i32(GET_LOC(instr), state);
+    emit_assert_loc_i32(GET_LOC(state, instr), state);
 }
 
 void static inline emit_wrap_int_i32(VLoc* loc, uint32_t constant, struct AssemblerState* state) {
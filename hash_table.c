@@ -1,4 +1,5 @@
 #include <string.h>
+#include <emmintrin.h>
 
 #include "hash_table.h"
 
@@ -15,21 +16,143 @@ uint32_t hash_bytes(char* char_p, uint32_t length) {
 }
 
 
-uint32_t hash_ptr(void* ptr) {
-    uint32_t hash = 2166136261;  // MAGIC
+// 64-bit FNV-1a, for keys which outlive the process
+uint64_t hash_bytes_64(char* char_p, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;  // MAGIC
 
-    for (size_t i = 0; i < 64; i += 8) {
-        hash ^= ((uintptr_t) ptr >> i) & 0xFF;
-        hash *= 16777619;        // MAGIC
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) *(char_p++);
+        hash *= 1099511628211ULL;             // MAGIC
     }
 
+    return hash;
+}
+
+
+// Fibonacci hashing: the high half of the product depends on every bit of the pointer
+uint32_t hash_ptr(void* ptr) {
+    uint32_t hash = (uint32_t) (((uint64_t) (uintptr_t) ptr * 11400714819323198485ULL) >> 32);  // MAGIC 2^64 / golden ratio
     return hash == 0 ? 1 : hash;
 }
 
 
+// region Groups
+// Tables start out pointing here, so lookups in an empty table need no special case
+_Alignas(HASH_GROUP_SIZE) static uint8_t empty_group[HASH_GROUP_SIZE] = {
+    HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY,
+    HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY,
+    HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY,
+    HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY, HASH_CTRL_EMPTY,
+};
+
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t) ((hash) & 0x7F))
+
+// One bit per slot of the group whose control byte is ctrl
+static inline uint32_t group_match(uint8_t* group, uint8_t ctrl) {
+    __m128i ctrls = _mm_load_si128((__m128i*) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrls, _mm_set1_epi8((char) ctrl)));
+}
+
+// Empty and deleted are the only control bytes with the high bit set
+static inline uint32_t group_match_free(uint8_t* group) {
+    return (uint32_t) _mm_movemask_epi8(_mm_load_si128((__m128i*) group));
+}
+
+static inline uint32_t table_capacity(struct HashTable* table) {
+    return table->ctrl == empty_group ? 0 : (table->group_mask + 1) * HASH_GROUP_SIZE;
+}
+
+// Groups are probed triangularly (1, 2, 3... groups further each time), which visits every one of them
+// since their number is a power of two
+TableEntry** table_find_slot(struct HashTable* table, HashKey key) {
+    uint32_t group = HASH_GROUP(key.hash) & table->group_mask;
+    uint8_t tag = HASH_TAG(key.hash);
+    for (uint32_t step = 1;; step++) {
+        uint8_t* ctrl = table->ctrl + group * HASH_GROUP_SIZE;
+        uint32_t matches = group_match(ctrl, tag);
+        while (matches) {
+            uint32_t slot = group * HASH_GROUP_SIZE + __builtin_ctz(matches);
+            if (table->slots[slot]->key.cmp_obj == key.cmp_obj) return &table->slots[slot];
+            matches &= matches - 1;
+        }
+        // the key would have gone into the first empty slot on its way
+        if (group_match(ctrl, HASH_CTRL_EMPTY)) return NULL;
+        group = (group + step) & table->group_mask;
+    }
+}
+
+// The first free slot on the key's probe sequence. There always is one, since the table grows before it fills up.
+uint32_t table_find_free_slot(struct HashTable* table, uint32_t hash) {
+    uint32_t group = HASH_GROUP(hash) & table->group_mask;
+    for (uint32_t step = 1;; step++) {
+        uint32_t free_slots = group_match_free(table->ctrl + group * HASH_GROUP_SIZE);
+        if (free_slots) return group * HASH_GROUP_SIZE + __builtin_ctz(free_slots);
+        group = (group + step) & table->group_mask;
+    }
+}
+
+// Up to 7/8 of the slots are used before growing, tombstones included. Rehashing drops the tombstones.
+void table_rehash(struct HashTable* table, uint32_t capacity) {
+    if (capacity != table_capacity(table)) {
+        table->ctrl = ojit_alloc_aligned_uninit(table->mem, capacity, HASH_GROUP_SIZE);
+        // the old arrays stay in the arena until the context is destroyed
+        table->slots = ojit_alloc_uninit(table->mem, capacity * sizeof(TableEntry*));
+        table->group_mask = capacity / HASH_GROUP_SIZE - 1;
+    }
+    memset(table->ctrl, HASH_CTRL_EMPTY, capacity);
+    table->growth_left = capacity - capacity / 8 - table->len;
+    table->tombstones = 0;
+
+    for (TableEntry* entry = table->last_entry; entry; entry = entry->prev) {
+        uint32_t slot = table_find_free_slot(table, entry->key.hash);
+        table->ctrl[slot] = HASH_TAG(entry->key.hash);
+        table->slots[slot] = entry;
+    }
+}
+
+TableEntry* table_add_entry(struct HashTable* table, HashKey key, uint64_t value) {
+    if (table->growth_left == 0) {
+        uint32_t capacity = table_capacity(table);
+        // when tombstones are most of what fills the table, getting rid of them makes enough room
+        if (table->tombstones <= capacity / 4) capacity = capacity ? capacity * 2 : HASH_GROUP_SIZE;
+        table_rehash(table, capacity);
+    }
+    uint32_t slot = table_find_free_slot(table, key.hash);
+    if (table->ctrl[slot] == HASH_CTRL_EMPTY) {
+        table->growth_left--;
+    } else {
+        table->tombstones--;
+    }
+    table->ctrl[slot] = HASH_TAG(key.hash);
+
+    TableEntry* entry = table->free_entries;
+    if (entry) {
+        table->free_entries = entry->prev;
+    } else {
+        entry = ojit_alloc_uninit(table->mem, sizeof(TableEntry));
+    }
+    entry->key = key;
+    entry->value = value;
+    entry->prev = table->last_entry;
+    entry->next = NULL;
+    if (table->last_entry) table->last_entry->next = entry;
+    table->last_entry = entry;
+    table->slots[slot] = entry;
+    table->len++;
+    return entry;
+}
+// endregion
+
+
 void init_hash_table(struct HashTable* table, MemCtx* mem) {
-    table->first_block = lalist_grow(mem, NULL, NULL);
+    table->ctrl = empty_group;
+    table->slots = NULL;
+    table->group_mask = 0;
+    table->growth_left = 0;
+    table->tombstones = 0;
     table->last_entry = NULL;
+    table->free_entries = NULL;
     table->mem = mem;
     table->len = 0;
 }
@@ -43,152 +166,65 @@ struct HashTable* new_hash_table(MemCtx* mem) {
 
 
 bool hash_table_insert(struct HashTable* table, HashKey key, uint64_t value) {
-    size_t insert_index = key.hash % (LALIST_BLOCK_SIZE / sizeof(TableEntry));
-
-    LAList* curr_block = table->first_block;
-    while (true) {
-        TableEntry* existing = lalist_get(curr_block, sizeof(TableEntry), insert_index);
-        if (existing->key.cmp_obj) {
-            if (key.cmp_obj == existing->key.cmp_obj) {
-                return false;
-            } else {
-                if (curr_block->next) {
-                    curr_block = curr_block->next;
-                } else {
-                    curr_block = lalist_grow(table->mem, curr_block, NULL);
-                }
-            }
-        } else {
-            existing->prev = table->last_entry;
-            table->last_entry = existing;
-            existing->key = key;
-            existing->value = value;
-            table->len++;
-            return true;
-        }
-    }
+    if (table_find_slot(table, key)) return false;
+    table_add_entry(table, key, value);
+    return true;
 }
 
 
 bool hash_table_set(struct HashTable* table, HashKey key, uint64_t value) {
-    size_t insert_index = key.hash % (LALIST_BLOCK_SIZE / sizeof(TableEntry));
-
-    LAList* curr_block = table->first_block;
-    while (true) {
-        TableEntry* existing = lalist_get(curr_block, sizeof(TableEntry), insert_index);
-        if (existing->key.cmp_obj) {
-            if (key.cmp_obj == existing->key.cmp_obj) {
-                existing->key = key;
-                existing->value = value;
-                return true;
-            } else {
-                if (curr_block->next) {
-                    curr_block = curr_block->next;
-                } else {
-                    curr_block = lalist_grow(table->mem, curr_block, NULL);
-                }
-            }
-        } else {
-            return false;
-        }
-    }
+    TableEntry** slot = table_find_slot(table, key);
+    if (slot == NULL) return false;
+    (*slot)->key = key;
+    (*slot)->value = value;
+    return true;
 }
 
 
 void* hash_table_get_ptr(struct HashTable* table, HashKey key) {
-    size_t insert_index = key.hash % (LALIST_BLOCK_SIZE / sizeof(TableEntry));
-
-    LAList* curr_block = table->first_block;
-    while (true) {
-        TableEntry* existing = lalist_get(curr_block, sizeof(TableEntry), insert_index);
-        if (existing->key.cmp_obj) {
-            if (key.cmp_obj == existing->key.cmp_obj) {
-                return &existing->value;
-            }
-            if (curr_block->next) {
-                curr_block = curr_block->next;
-            } else {
-                curr_block = lalist_grow(table->mem, curr_block, NULL);
-            }
-        } else {
-            existing->prev = table->last_entry;
-            table->last_entry = existing;
-            existing->key = key;
-            existing->value = (uint64_t) NULL;
-            table->len++;
-            return &existing->value;
-        }
-    }
+    TableEntry** slot = table_find_slot(table, key);
+    if (slot) return &(*slot)->value;
+    return &table_add_entry(table, key, (uint64_t) NULL)->value;
 }
 
 bool hash_table_get(struct HashTable* table, HashKey key, uint64_t* value_ptr) {
-    size_t insert_index = key.hash % (LALIST_BLOCK_SIZE / sizeof(TableEntry));
-
-    LAList* curr_block = table->first_block;
-    while (curr_block) {
-        TableEntry* existing = lalist_get(curr_block, sizeof(TableEntry), insert_index);
-        if (existing->key.cmp_obj) {
-            if (key.cmp_obj == existing->key.cmp_obj) {
-                *value_ptr = existing->value;
-                return true;
-            }
-            curr_block = curr_block->next;
-        } else {
-            return false;
-        }
-    }
-    return false;
+    TableEntry** slot = table_find_slot(table, key);
+    if (slot == NULL) return false;
+    *value_ptr = (*slot)->value;
+    return true;
 }
 
 
 bool hash_table_has(struct HashTable* table, HashKey key) {
-    size_t insert_index = key.hash % (LALIST_BLOCK_SIZE / sizeof(TableEntry));
-
-    LAList* curr_block = table->first_block;
-    while (curr_block) {
-        TableEntry* existing = lalist_get(curr_block, sizeof(TableEntry), insert_index);
-        if (existing->key.cmp_obj) {
-            if (key.cmp_obj == existing->key.cmp_obj) {
-                return true;
-            }
-            curr_block = curr_block->next;
-        } else {
-            return false;
-        }
+    return table_find_slot(table, key) != NULL;
+}
+
+bool hash_table_remove(struct HashTable* table, HashKey key) {
+    TableEntry** slot = table_find_slot(table, key);
+    if (slot == NULL) return false;
+    uint32_t slot_index = slot - table->slots;
+    // Lookups stop at the first group with an empty slot, so if this group has one, no key's probe sequence
+    // goes past it and the slot can be empty again. Otherwise it has to stay a tombstone until the next rehash.
+    if (group_match(table->ctrl + slot_index / HASH_GROUP_SIZE * HASH_GROUP_SIZE, HASH_CTRL_EMPTY)) {
+        table->ctrl[slot_index] = HASH_CTRL_EMPTY;
+        table->growth_left++;
+    } else {
+        table->ctrl[slot_index] = HASH_CTRL_DELETED;
+        table->tombstones++;
     }
-    return false;
-}
-
-bool hash_table_remove(struct HashTable* table, HashKey key, TableEntry* next) {
-    size_t insert_index = key.hash % (LALIST_BLOCK_SIZE / sizeof(TableEntry));
-
-    LAList* curr_block = table->first_block;
-    while (curr_block) {
-        TableEntry* existing = lalist_get(curr_block, sizeof(TableEntry), insert_index);
-        if (existing->key.cmp_obj) {
-            if (key.cmp_obj == existing->key.cmp_obj) {
-                existing->key.hash = 0;
-                existing->key.cmp_obj = NULL;
-                existing->value = 0;
-                if (table->last_entry == existing) table->last_entry = existing->prev;
-                if (next) next->prev = existing->prev;
-
-                TableEntry* last_collided = NULL;
-                curr_block = curr_block->next;
-                while ((curr_block = curr_block->next) != NULL) {
-                    TableEntry* collided = lalist_get(curr_block, sizeof(TableEntry), insert_index);
-                    if (collided->key.cmp_obj) last_collided = collided;
-                }
-                existing->key = last_collided->key;
-                existing->value = last_collided->value;
-                existing->prev = last_collided->prev;
-                table->len--;
-                return true;
-            }
-            curr_block = curr_block->next;
-        } else {
-            return false;
-        }
+
+    TableEntry* entry = *slot;
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        table->last_entry = entry->prev;
     }
-    return false;
-}
\ No newline at end of file
+    if (entry->prev) entry->prev->next = entry->next;
+    entry->prev = table->free_entries;
+    table->free_entries = entry;
+    table->len--;
+    return true;
+}
+
+#undef HASH_GROUP
+#undef HASH_TAG
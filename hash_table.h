@@ -3,9 +3,22 @@
 
 #include "ojit_mem.h"
 
+// Open addressing over groups of HASH_GROUP_SIZE slots. Each slot has a control byte, which is HASH_CTRL_EMPTY,
+// HASH_CTRL_DELETED or the low 7 bits of its key's hash, so a whole group is matched with a few SSE2 instructions
+// before any entry is looked at. The slots point to the entries, which never move, so pointers to their values
+// stay valid while the table grows. Removed entries are kept for the next inserts.
+#define HASH_GROUP_SIZE (16)
+#define HASH_CTRL_EMPTY (0x80)
+#define HASH_CTRL_DELETED (0xFE)
+
 struct HashTable {
-    LAList* first_block;
-    struct s_TableEntry* last_entry;
+    uint8_t* ctrl;                     // a shared all-empty group until the first insert
+    struct s_TableEntry** slots;
+    uint32_t group_mask;               // number of groups - 1
+    uint32_t growth_left;              // inserts until the table has to grow
+    uint32_t tombstones;
+    struct s_TableEntry* last_entry;   // the entries are chained in insertion order
+    struct s_TableEntry* free_entries; // removed ones, linked through prev
     MemCtx* mem;
     uint64_t len;
 };
@@ -19,12 +32,14 @@ typedef struct s_TableEntry {
     HashKey key;
     uint64_t value;
     struct s_TableEntry* prev;
+    struct s_TableEntry* next;
 } TableEntry;
 
 #define HASH_KEY(ptr) ((HashKey) {.hash=hash_ptr(ptr), .cmp_obj=(ptr)})
 #define STRING_KEY(str) ((HashKey) {.hash=(str)->hash, .cmp_obj=(str)})
 
 uint32_t hash_bytes(char* char_p, uint32_t length);
+uint64_t hash_bytes_64(char* char_p, size_t length);
 uint32_t hash_ptr(void* ptr);
 
 void init_hash_table(struct HashTable* table, MemCtx* mem);
@@ -34,6 +49,7 @@ bool hash_table_set(struct HashTable* table, HashKey key, uint64_t value);
 void* hash_table_get_ptr(struct HashTable* table, HashKey key);
 bool hash_table_get(struct HashTable* table, HashKey key, uint64_t* value_ptr);
 bool hash_table_has(struct HashTable* table, HashKey key);
-bool hash_table_remove(struct HashTable* table, HashKey key, TableEntry* next);
+// Iterating through the entries' prev links is still in insertion order afterwards
+bool hash_table_remove(struct HashTable* table, HashKey key);
 
 #endif //OJIT_HASH_TABLE_H
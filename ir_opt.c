@@ -11,122 +11,125 @@ enum FoldStep {
 };
 
 #define AS_INSTR(instr) ((Instruction*) (instr))
+#define OPERAND(ref) IR_VALUE(func, (ref))
 
 void disable_instr(Instruction* instr) {
     (void) instr;
 }
-void replace_instr_int(Instruction* instr, uint32_t constant) {
-    instr->base.id = ID_INT_IR;
+void replace_instr_int(struct FunctionIR* func, Instruction* instr, uint32_t constant) {
+    INSTR_TYPE(func, instr) = ID_INT_IR;
     instr->ir_int.constant = constant;
 }
-void replace_instr_add(Instruction* instr, Instruction* a, Instruction* b) {
-    instr->base.id = ID_ADD_IR;
-    instr->ir_add.a = a;
-    instr->ir_add.b = b;
+void replace_instr_add(struct FunctionIR* func, Instruction* instr, Instruction* a, Instruction* b) {
+    INSTR_TYPE(func, instr) = ID_ADD_IR;
+    instr->ir_add.a = IR_REF(a);
+    instr->ir_add.b = IR_REF(b);
 }
 
-void optimize_add_ir(Instruction* instr) {
+void optimize_add_ir(struct FunctionIR* func, Instruction* instr) {
     struct AddIR* add_ir = &instr->ir_add;
+    Instruction* add_a = OPERAND(add_ir->a);
+    Instruction* add_b = OPERAND(add_ir->b);
 
-    bool a_is_int = INSTR_TYPE(add_ir->a) == ID_INT_IR;
-    bool b_is_int = INSTR_TYPE(add_ir->b) == ID_INT_IR;
+    bool a_is_int = INSTR_TYPE(func, add_a) == ID_INT_IR;
+    bool b_is_int = INSTR_TYPE(func, add_b) == ID_INT_IR;
 
     if (a_is_int && b_is_int) {
-        replace_instr_int(instr, add_ir->a->ir_int.constant + add_ir->b->ir_int.constant);
-        disable_instr(add_ir->a);
-        disable_instr(add_ir->b);
-    } else if (a_is_int && INSTR_TYPE(add_ir->b) == ID_ADD_IR) {
-        struct AddIR* inner_add = &add_ir->b->ir_add;
-        uint32_t outer_const = add_ir->a->ir_int.constant;
-        if (INSTR_TYPE(inner_add->a) == ID_INT_IR || INSTR_TYPE(inner_add->b) == ID_INT_IR) {
+        replace_instr_int(func, instr, add_a->ir_int.constant + add_b->ir_int.constant);
+        disable_instr(add_a);
+        disable_instr(add_b);
+    } else if (a_is_int && INSTR_TYPE(func, add_b) == ID_ADD_IR) {
+        struct AddIR* inner_add = &add_b->ir_add;
+        uint32_t outer_const = add_a->ir_int.constant;
+        if (INSTR_TYPE(func, OPERAND(inner_add->a)) == ID_INT_IR || INSTR_TYPE(func, OPERAND(inner_add->b)) == ID_INT_IR) {
             uint32_t inner_const;
             Instruction* inner_val;
-            if (INSTR_TYPE(inner_add->a) == ID_INT_IR) {
-                inner_const = inner_add->a->ir_int.constant;
-                inner_val = inner_add->b;
-                disable_instr(inner_add->a);
+            if (INSTR_TYPE(func, OPERAND(inner_add->a)) == ID_INT_IR) {
+                inner_const = OPERAND(inner_add->a)->ir_int.constant;
+                inner_val = OPERAND(inner_add->b);
+                disable_instr(OPERAND(inner_add->a));
             } else {
-                inner_const = inner_add->b->ir_int.constant;
-                inner_val = inner_add->a;
-                disable_instr(inner_add->b);
+                inner_const = OPERAND(inner_add->b)->ir_int.constant;
+                inner_val = OPERAND(inner_add->a);
+                disable_instr(OPERAND(inner_add->b));
             }
             uint32_t new_constant = outer_const + inner_const;
-            disable_instr(add_ir->b);
-            replace_instr_int(add_ir->a, new_constant);
-            replace_instr_add((Instruction*) add_ir, add_ir->a, inner_val);
+            disable_instr(add_b);
+            replace_instr_int(func, add_a, new_constant);
+            replace_instr_add(func, (Instruction*) add_ir, add_a, inner_val);
         }
-    } else if (b_is_int && INSTR_TYPE(add_ir->a) == ID_ADD_IR) {
-        struct AddIR* inner_add = &add_ir->a->ir_add;
-        uint32_t outer_const = add_ir->b->ir_int.constant;
-        if (INSTR_TYPE(inner_add->a) == ID_INT_IR || INSTR_TYPE(inner_add->b) == ID_INT_IR) {
+    } else if (b_is_int && INSTR_TYPE(func, add_a) == ID_ADD_IR) {
+        struct AddIR* inner_add = &add_a->ir_add;
+        uint32_t outer_const = add_b->ir_int.constant;
+        if (INSTR_TYPE(func, OPERAND(inner_add->a)) == ID_INT_IR || INSTR_TYPE(func, OPERAND(inner_add->b)) == ID_INT_IR) {
             uint32_t inner_const;
             Instruction* inner_val;
-            if (INSTR_TYPE(inner_add->a) == ID_INT_IR) {
-                inner_const = inner_add->a->ir_int.constant;
-                inner_val = inner_add->b;
-                disable_instr(inner_add->a);
+            if (INSTR_TYPE(func, OPERAND(inner_add->a)) == ID_INT_IR) {
+                inner_const = OPERAND(inner_add->a)->ir_int.constant;
+                inner_val = OPERAND(inner_add->b);
+                disable_instr(OPERAND(inner_add->a));
             } else {
-                inner_const = inner_add->b->ir_int.constant;
-                inner_val = inner_add->a;
-                disable_instr(inner_add->b);
+                inner_const = OPERAND(inner_add->b)->ir_int.constant;
+                inner_val = OPERAND(inner_add->a);
+                disable_instr(OPERAND(inner_add->b));
             }
             uint32_t new_constant = outer_const + inner_const;
-            disable_instr(add_ir->a);
-            replace_instr_int(add_ir->b, new_constant);
-            replace_instr_add((Instruction*) add_ir, inner_val, add_ir->b);
+            disable_instr(add_a);
+            replace_instr_int(func, add_b, new_constant);
+            replace_instr_add(func, (Instruction*) add_ir, inner_val, add_b);
         }
     }
 }
 
-#define MATCH_ADD(a_type, b_type, func) \
-    if (INSTR_TYPE(instr) == ID_ADD_IR && INSTR_TYPE(instr->ir_add.a) == (a_type) && INSTR_TYPE(instr->ir_add.b) == (b_type)) { \
-        next_step = (func)((void*) instr, (void*) instr->ir_add.a, (void*) instr->ir_add.b); \
+#define MATCH_ADD(a_type, b_type, fold) \
+    if (INSTR_TYPE(func, instr) == ID_ADD_IR && IR_ID(func, instr->ir_add.a) == (a_type) && IR_ID(func, instr->ir_add.b) == (b_type)) { \
+        next_step = (fold)(func, (void*) instr, (void*) OPERAND(instr->ir_add.a), (void*) OPERAND(instr->ir_add.b)); \
     } else
 
-#define DEFAULT(func) {next_step = func(instr);}
+#define DEFAULT(fold) {next_step = fold(instr);}
 
-enum FoldStep fold_add_int_int(struct AddIR* instr, struct IntIR* a, struct IntIR* b) {
-    replace_instr_int(AS_INSTR(instr), a->constant + b->constant);
+enum FoldStep fold_add_int_int(struct FunctionIR* func, struct AddIR* instr, struct IntIR* a, struct IntIR* b) {
+    replace_instr_int(func, AS_INSTR(instr), a->constant + b->constant);
     return REPEAT_FOLD;
 }
 
-void fold_commutative_add(struct AddIR* instr, struct AddIR* inner_add, struct IntIR* outer_const, struct IntIR* inner_const, Instruction* val) {
+void fold_commutative_add(struct FunctionIR* func, struct AddIR* instr, struct AddIR* inner_add, struct IntIR* outer_const, struct IntIR* inner_const, Instruction* val) {
     uint32_t new_const = outer_const->constant + inner_const->constant;
-    replace_instr_int((Instruction*) outer_const, new_const);
-    replace_instr_add((Instruction*) instr, (Instruction*) outer_const, val);
-    DEC_INSTR(inner_add);
-    DEC_INSTR(inner_const);
+    replace_instr_int(func, (Instruction*) outer_const, new_const);
+    replace_instr_add(func, (Instruction*) instr, (Instruction*) outer_const, val);
+    DEC_INSTR(func, inner_add);
+    DEC_INSTR(func, inner_const);
 }
 
-enum FoldStep fold_add_int_add(struct AddIR* instr, struct IntIR* a, struct AddIR* b) {
-    if (INSTR_REF(b) == 1 && (INSTR_TYPE(b->a) == ID_INT_IR || INSTR_TYPE(b->b) == ID_INT_IR)) {
+enum FoldStep fold_add_int_add(struct FunctionIR* func, struct AddIR* instr, struct IntIR* a, struct AddIR* b) {
+    if (INSTR_REF(func, b) == 1 && (INSTR_TYPE(func, OPERAND(b->a)) == ID_INT_IR || INSTR_TYPE(func, OPERAND(b->b)) == ID_INT_IR)) {
         Instruction* val;
         struct IntIR* inner_const;
-        if (INSTR_TYPE(b->a) == ID_INT_IR) {
-            val = b->b;
-            inner_const = (struct IntIR*) b->a;
+        if (INSTR_TYPE(func, OPERAND(b->a)) == ID_INT_IR) {
+            val = OPERAND(b->b);
+            inner_const = &OPERAND(b->a)->ir_int;
         } else {
-            val = b->a;
-            inner_const = (struct IntIR*) b->b;
+            val = OPERAND(b->a);
+            inner_const = &OPERAND(b->b)->ir_int;
         }
-        fold_commutative_add(instr, b, a, inner_const, val);
+        fold_commutative_add(func, instr, b, a, inner_const, val);
         return REPEAT_FOLD;
     }
     return CONTINUE_FOLD;
 }
 
-enum FoldStep fold_add_add_int(struct AddIR* instr, struct AddIR* a, struct IntIR* b) {
-    if (INSTR_REF(a) == 1 && (INSTR_TYPE(a->a) == ID_INT_IR || INSTR_TYPE(a->b) == ID_INT_IR)) {
+enum FoldStep fold_add_add_int(struct FunctionIR* func, struct AddIR* instr, struct AddIR* a, struct IntIR* b) {
+    if (INSTR_REF(func, a) == 1 && (INSTR_TYPE(func, OPERAND(a->a)) == ID_INT_IR || INSTR_TYPE(func, OPERAND(a->b)) == ID_INT_IR)) {
         Instruction* val;
         struct IntIR* inner_const;
-        if (INSTR_TYPE(a->a) == ID_INT_IR) {
-            val = a->b;
-            inner_const = (struct IntIR*) a->a;
+        if (INSTR_TYPE(func, OPERAND(a->a)) == ID_INT_IR) {
+            val = OPERAND(a->b);
+            inner_const = &OPERAND(a->a)->ir_int;
         } else {
-            val = a->a;
-            inner_const = (struct IntIR*) a->b;
+            val = OPERAND(a->a);
+            inner_const = &OPERAND(a->b)->ir_int;
         }
-        fold_commutative_add(instr, a, b, inner_const, val);
+        fold_commutative_add(func, instr, a, b, inner_const, val);
         return REPEAT_FOLD;
     }
     return CONTINUE_FOLD;
@@ -139,11 +142,15 @@ enum FoldStep fold_default(Instruction* instr) {
 
 void ojit_peephole_optimizer(struct BlockIR* block, struct OptState* opt_state) {
     (void) opt_state;
+    struct FunctionIR* func = block->func;
 
-    bool was_used[block->num_instrs];
-    for (int i = 0; i < block->num_instrs; i++) was_used[i] = false;
+    bool was_used[block->instrs.len];
+    for (uint32_t i = 0; i < block->instrs.len; i++) was_used[i] = false;
 
-    FOREACH(instr, block->first_instrs, Instruction) {
+    FOREACH_VEC(ref, &block->instrs, IRRef) {
+        // only additions fold so far, and the opcode table tells them apart without loading the instruction
+        if (IR_ID(func, *ref) != ID_ADD_IR) continue;
+        Instruction* instr = IR_VALUE(func, *ref);
         enum FoldStep next_step = REPEAT_FOLD;
         while (next_step == REPEAT_FOLD) {
             MATCH_ADD(ID_INT_IR, ID_INT_IR, fold_add_int_int)
@@ -155,23 +162,24 @@ void ojit_peephole_optimizer(struct BlockIR* block, struct OptState* opt_state)
 }
 
 void static inline a(struct BlockIR* from, struct BlockIR* target) {
-    FOREACH_INSTR(instr, target->first_instrs) {
-        if (instr->base.id == ID_BLOCK_PARAMETER_IR) {
+    struct FunctionIR* func = target->func;
+    FOREACH_INSTR(instr, target) {
+        if (INSTR_TYPE(func, instr) == ID_BLOCK_PARAMETER_IR) {
             struct ParameterIR* param = &instr->ir_parameter;
-            if (param->base.refs == 0) continue;
+            if (INSTR_REF(func, param) == 0) continue;
             IRValue argument;
             hash_table_get(&from->variables, STRING_KEY(param->var_name), (uint64_t*) &argument);
 
-            ValueType old_type = param->base.type;
-            if (argument->base.type == TYPE_UNKNOWN) {
-                argument->base.type = param->base.type;
+            ValueType old_type = VALUE_TYPE(func, param);
+            if (VALUE_TYPE(func, argument) == TYPE_UNKNOWN) {
+                VALUE_TYPE(func, argument) = VALUE_TYPE(func, param);
                 // TODO figure out a way to reschedule a visit to target_block
             } else {
                 if (old_type == TYPE_UNKNOWN) {
-                    param->base.type = argument->base.type;
-                } else if (old_type != TYPE_CONFLICTING && argument->base.type != TYPE_CONFLICTING) {
-                    if (old_type != argument->base.type) {
-                        param->base.type = TYPE_CONFLICTING;
+                    VALUE_TYPE(func, param) = VALUE_TYPE(func, argument);
+                } else if (old_type != TYPE_CONFLICTING && VALUE_TYPE(func, argument) != TYPE_CONFLICTING) {
+                    if (old_type != VALUE_TYPE(func, argument)) {
+                        VALUE_TYPE(func, param) = TYPE_CONFLICTING;
                     }
                 }
             }
@@ -183,43 +191,44 @@ void static inline a(struct BlockIR* from, struct BlockIR* target) {
 
 
 void ojit_assign_types(struct BlockIR* block, struct OptState* state) {
-    FOREACH_INSTR(instr, block->first_instrs) {
-        switch (INSTR_TYPE(instr)) {
+    struct FunctionIR* func = block->func;
+    FOREACH_VEC(ref, &block->instrs, IRRef) {
+        switch (IR_ID(func, *ref)) {
             case ID_INT_IR:
-                instr->base.type = TYPE_INT;
+                IR_VALUE_TYPE(func, *ref) = TYPE_INT;
                 break;
             case ID_ADD_IR:
-                instr->base.type = TYPE_INT;
+                IR_VALUE_TYPE(func, *ref) = TYPE_INT;
                 break;
             case ID_SUB_IR:
-                instr->base.type = TYPE_INT;
+                IR_VALUE_TYPE(func, *ref) = TYPE_INT;
                 break;
             case ID_BLOCK_PARAMETER_IR:
-//                instr->base.type = TYPE_UNKNOWN;
+//                IR_VALUE_TYPE(func, *ref) = TYPE_UNKNOWN;
                 break;
             case ID_CALL_IR:
-                instr->base.type = TYPE_UNKNOWN;
+                IR_VALUE_TYPE(func, *ref) = TYPE_UNKNOWN;
                 break;
             case ID_CMP_IR:
-                instr->base.type = TYPE_INT;
+                IR_VALUE_TYPE(func, *ref) = TYPE_INT;
                 break;
             case ID_GET_ATTR_IR:
-                instr->base.type = TYPE_UNKNOWN;
+                IR_VALUE_TYPE(func, *ref) = TYPE_UNKNOWN;
                 break;
             case ID_GET_LOC_IR:
-                instr->base.type = TYPE_UNKNOWN;
+                IR_VALUE_TYPE(func, *ref) = TYPE_UNKNOWN;
                 break;
             case ID_SET_LOC_IR:
-                instr->base.type = instr->ir_set_loc.value->base.type;
+                IR_VALUE_TYPE(func, *ref) = IR_VALUE_TYPE(func, IR_VALUE(func, *ref)->ir_set_loc.value);
                 break;
             case ID_GLOBAL_IR:
-                instr->base.type = TYPE_UNKNOWN;
+                IR_VALUE_TYPE(func, *ref) = TYPE_UNKNOWN;
                 break;
             case ID_NEW_OBJECT_IR:
-                instr->base.type = TYPE_UNKNOWN;
+                IR_VALUE_TYPE(func, *ref) = TYPE_UNKNOWN;
                 break;
             case ID_INSTR_NONE:
-                instr->base.type = TYPE_UNKNOWN;
+                IR_VALUE_TYPE(func, *ref) = TYPE_UNKNOWN;
                 break;
         }
     }
@@ -248,15 +257,16 @@ void ojit_optimize_block(struct BlockIR* block, struct OptState* state) {
 }
 
 void ojit_optimize_params_branch(struct BlockIR* target, struct BlockIR* block) {
-    FOREACH_INSTR(param, target->first_instrs) {
-        if (param->base.id == ID_BLOCK_PARAMETER_IR) {
+    struct FunctionIR* func = target->func;
+    FOREACH_INSTR(param, target) {
+        if (INSTR_TYPE(func, param) == ID_BLOCK_PARAMETER_IR) {
             String var_name = param->ir_parameter.var_name;
             if (var_name) {
                 Instruction* instr_ptr;
                 hash_table_get(&block->variables, STRING_KEY(var_name), (uint64_t*) &instr_ptr);
-                if (param->base.refs > 0) {
+                if (INSTR_REF(func, param) > 0) {
                 } else {
-                    DEC_INSTR(instr_ptr);
+                    DEC_INSTR(func, instr_ptr);
                 }
             }
         } else {
@@ -296,4 +306,74 @@ void ojit_optimize_func(struct FunctionIR* func, struct GetFunctionCallback call
     }
 
     ojit_optimize_params(func);
-}
\ No newline at end of file
+}
+
+
+// region Block Layout
+struct BlockIR* hottest_unplaced_successor(struct BlockIR* block, const bool* placed) {
+    struct BlockIR* targets[2] = {NULL, NULL};
+    uint64_t counts[2] = {0, 0};
+    switch (block->terminator.ir_base.id) {
+        case ID_BRANCH_IR:
+            targets[0] = block->terminator.ir_branch.target;
+            counts[0] = block->exec_count;
+            break;
+        case ID_CBRANCH_IR:
+            targets[0] = block->terminator.ir_cbranch.true_target;
+            counts[0] = block->true_count;
+            targets[1] = block->terminator.ir_cbranch.false_target;
+            counts[1] = block->exec_count - block->true_count;
+            break;
+        default:
+            break;
+    }
+
+    struct BlockIR* hottest = NULL;
+    uint64_t hottest_count = 0;
+    for (int i = 0; i < 2; i++) {
+        if (targets[i] && !placed[targets[i]->block_index] && counts[i] > hottest_count) {
+            hottest = targets[i];
+            hottest_count = counts[i];
+        }
+    }
+    return hottest;
+}
+
+// Chains each block to its most frequent successor, so the hot path falls through instead of jumping,
+// and moves the blocks which never ran behind everything else.
+void ojit_layout_blocks(struct FunctionIR* func) {
+    uint32_t num_blocks = func->blocks.len;
+    struct BlockIR* order[num_blocks];
+    bool placed[num_blocks];
+    for (uint32_t i = 0; i < num_blocks; i++) placed[i] = false;
+    uint32_t num_placed = 0;
+
+    // the entry block has to stay first
+    struct BlockIR* block = func->first_block;
+    while (block) {
+        placed[block->block_index] = true;
+        order[num_placed++] = block;
+
+        block = hottest_unplaced_successor(block, placed);
+        if (block == NULL) {
+            struct BlockIR* next_chain = func->first_block;
+            while (next_chain && (placed[next_chain->block_index] || next_chain->exec_count == 0)) {
+                next_chain = next_chain->next_block;
+            }
+            block = next_chain;
+        }
+    }
+    block = func->first_block;
+    while (block) {
+        if (!placed[block->block_index]) order[num_placed++] = block;
+        block = block->next_block;
+    }
+
+    for (uint32_t i = 0; i < num_placed; i++) {
+        order[i]->prev_block = i > 0 ? order[i - 1] : NULL;
+        order[i]->next_block = i + 1 < num_placed ? order[i + 1] : NULL;
+    }
+    func->first_block = order[0];
+    func->last_block = order[num_placed - 1];
+}
+// endregion
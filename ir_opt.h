@@ -4,5 +4,7 @@
 #include "asm_ir.h"
 
 void ojit_optimize_func(struct FunctionIR* func, struct GetFunctionCallback callbacks);
+// Reorders the blocks by their profiled counts, see jit_read_profile
+void ojit_layout_blocks(struct FunctionIR* func);
 
 #endif //OJIT_IR_OPT_H
@@ -0,0 +1,175 @@
+#include "jit_debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "compiler/elf.h"
+
+// region GDB JIT Interface
+// These names and layouts are fixed by GDB, which puts a breakpoint in __jit_debug_register_code
+enum JITActions {
+    JIT_NOACTION = 0,
+    JIT_REGISTER_FN,
+    JIT_UNREGISTER_FN,
+};
+
+struct jit_code_entry {
+    struct jit_code_entry* next_entry;
+    struct jit_code_entry* prev_entry;
+    const char* symfile_addr;
+    uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+    uint32_t version;
+    uint32_t action_flag;
+    struct jit_code_entry* relevant_entry;
+    struct jit_code_entry* first_entry;
+};
+
+void __attribute__((noinline)) __jit_debug_register_code() {
+    __asm__ volatile("" ::: "memory");
+}
+
+struct jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, NULL, NULL};
+
+pthread_mutex_t jit_debug_lock = PTHREAD_MUTEX_INITIALIZER;
+// endregion
+
+// region Unwind Info
+#define DW_CFA_advance_loc      (0x40)
+#define DW_CFA_offset           (0x80)
+#define DW_CFA_def_cfa          (0x0C)
+#define DW_CFA_def_cfa_register (0x0D)
+#define DW_CFA_def_cfa_offset   (0x0E)
+#define DW_EH_PE_absptr         (0x00)
+
+#define DWARF_REG_RBP (6)
+#define DWARF_REG_RSP (7)
+#define DWARF_REG_R12 (12)
+#define DWARF_REG_R13 (13)
+#define DWARF_REG_RA  (16)
+
+#define EH_FRAME_MAX_SIZE (128)
+
+void eh_frame_u32(uint8_t* buf, size_t* pos, uint32_t value) {
+    memcpy(buf + *pos, &value, 4);
+    *pos += 4;
+}
+
+void eh_frame_u64(uint8_t* buf, size_t* pos, uint64_t value) {
+    memcpy(buf + *pos, &value, 8);
+    *pos += 8;
+}
+
+// pads the entry which started at entry_start with DW_CFA_nop and fills in its length
+void eh_frame_finish_entry(uint8_t* buf, size_t* pos, size_t entry_start) {
+    while ((*pos - entry_start) % 8) buf[(*pos)++] = 0;
+    uint32_t length = *pos - entry_start - 4;
+    memcpy(buf + entry_start, &length, 4);
+}
+
+// Every function starts with push r12; push r13; push rbp; mov rbp, rsp (see ojit_compile_function), and only
+// addresses its frame through rbp afterwards, so one CIE/FDE pair describes all of it.
+// Only the instructions between pop rbp and ret in an epilogue are described inaccurately.
+size_t build_eh_frame(uint8_t* buf, uint64_t code, uint64_t size) {
+    size_t pos = 0;
+
+    size_t cie_start = pos;
+    eh_frame_u32(buf, &pos, 0);  // length
+    eh_frame_u32(buf, &pos, 0);  // CIE id
+    buf[pos++] = 1;              // version
+    buf[pos++] = 'z';
+    buf[pos++] = 'R';
+    buf[pos++] = 0;
+    buf[pos++] = 1;              // code alignment factor
+    buf[pos++] = 0x78;           // data alignment factor (-8)
+    buf[pos++] = DWARF_REG_RA;
+    buf[pos++] = 1;              // augmentation data length
+    buf[pos++] = DW_EH_PE_absptr;
+    // on entry, the return address is right above rsp
+    buf[pos++] = DW_CFA_def_cfa;
+    buf[pos++] = DWARF_REG_RSP;
+    buf[pos++] = 8;
+    buf[pos++] = DW_CFA_offset | DWARF_REG_RA;
+    buf[pos++] = 1;
+    eh_frame_finish_entry(buf, &pos, cie_start);
+
+    size_t fde_start = pos;
+    eh_frame_u32(buf, &pos, 0);  // length
+    eh_frame_u32(buf, &pos, pos - cie_start);  // distance back to the CIE
+    eh_frame_u64(buf, &pos, code);
+    eh_frame_u64(buf, &pos, size);
+    buf[pos++] = 0;              // augmentation data length
+    // push r12
+    buf[pos++] = DW_CFA_advance_loc | 2;
+    buf[pos++] = DW_CFA_def_cfa_offset;
+    buf[pos++] = 16;
+    buf[pos++] = DW_CFA_offset | DWARF_REG_R12;
+    buf[pos++] = 2;
+    // push r13
+    buf[pos++] = DW_CFA_advance_loc | 2;
+    buf[pos++] = DW_CFA_def_cfa_offset;
+    buf[pos++] = 24;
+    buf[pos++] = DW_CFA_offset | DWARF_REG_R13;
+    buf[pos++] = 3;
+    // push rbp
+    buf[pos++] = DW_CFA_advance_loc | 1;
+    buf[pos++] = DW_CFA_def_cfa_offset;
+    buf[pos++] = 32;
+    buf[pos++] = DW_CFA_offset | DWARF_REG_RBP;
+    buf[pos++] = 4;
+    // mov rbp, rsp
+    buf[pos++] = DW_CFA_advance_loc | 3;
+    buf[pos++] = DW_CFA_def_cfa_register;
+    buf[pos++] = DWARF_REG_RBP;
+    eh_frame_finish_entry(buf, &pos, fde_start);
+
+    eh_frame_u32(buf, &pos, 0);  // terminator
+    return pos;
+}
+// endregion
+
+#if defined(__GNUC__) && !defined(WIN32)
+// from libgcc, takes a whole .eh_frame section which has to stay around
+void __register_frame(void* begin);
+#endif
+
+
+void debug_register_function(struct FunctionIR* func, void* code, size_t size) {
+    uint8_t eh_frame[EH_FRAME_MAX_SIZE];
+    size_t eh_frame_size = build_eh_frame(eh_frame, (uint64_t) code, size);
+
+#if defined(__GNUC__) && !defined(WIN32)
+    uint8_t* registered_eh_frame = malloc(eh_frame_size);
+    memcpy(registered_eh_frame, eh_frame, eh_frame_size);
+    __register_frame(registered_eh_frame);
+#endif
+
+    struct ElfObject* elf = elf_create();
+    uint16_t text = elf_add_section(elf, ".text", ELF_SHT_PROGBITS, ELF_SHF_ALLOC | ELF_SHF_EXECINSTR, 16);
+    elf_set_section_addr(elf, text, (uint64_t) code);
+    elf_section_append(elf, text, code, size);
+    uint16_t eh_frame_section = elf_add_section(elf, ".eh_frame", ELF_SHT_PROGBITS, ELF_SHF_ALLOC, 8);
+    elf_section_append(elf, eh_frame_section, eh_frame, eh_frame_size);
+    elf_add_symbol(elf, func->name->start_ptr, func->name->length, ELF_STB_GLOBAL, ELF_STT_FUNC, text, 0, size);
+
+    uint64_t symfile_size;
+    uint8_t* symfile = elf_finish(elf, &symfile_size);
+    elf_destroy(elf);
+
+    struct jit_code_entry* entry = malloc(sizeof(struct jit_code_entry));
+    entry->symfile_addr = (const char*) symfile;
+    entry->symfile_size = symfile_size;
+    entry->prev_entry = NULL;
+
+    pthread_mutex_lock(&jit_debug_lock);
+    entry->next_entry = __jit_debug_descriptor.first_entry;
+    if (entry->next_entry) entry->next_entry->prev_entry = entry;
+    __jit_debug_descriptor.first_entry = entry;
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+    pthread_mutex_unlock(&jit_debug_lock);
+}
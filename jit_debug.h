@@ -0,0 +1,15 @@
+#ifndef OJIT_JIT_DEBUG_H
+#define OJIT_JIT_DEBUG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "asm_ir.h"
+
+// Describes a compiled function to GDB (through its JIT interface) with a symbol and .eh_frame unwind info,
+// and registers the same unwind info with this process's unwinder where that is supported.
+// Functions stay registered for the rest of the process, just like their code.
+void debug_register_function(struct FunctionIR* func, void* code, size_t size);
+
+#endif //OJIT_JIT_DEBUG_H
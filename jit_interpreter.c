@@ -2,27 +2,116 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "parser.h"
 #include "compiler/compiler.h"
+#include "compiler/disasm.h"
+#include "ir_opt.h"
+#include "asm_ir_builders.h"
+#include "code_cache.h"
+#include "aot.h"
+#include "jit_perf.h"
+#include "jit_debug.h"
 
 
-JIT* ojit_create_jit() {
-    JIT* jit = malloc(sizeof(JIT));
-    jit->string_mem = create_mem_ctx();
-    jit->ir_mem = create_mem_ctx();
+void init_jit(JIT* jit) {
+    jit->string_mem = create_tagged_mem_ctx(MEM_TAG_STRINGS);
+    jit->ir_mem = create_tagged_mem_ctx(MEM_TAG_IR);
     init_string_table(&jit->strings, jit->string_mem);
     init_hash_table(&jit->function_records, jit->ir_mem);
+    pthread_rwlock_init(&jit->functions_lock, NULL);
+    jit->file_mems = lalist_new(jit->ir_mem);
+
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->has_work, NULL);
+    pthread_cond_init(&queue->finished, NULL);
+    queue->first = queue->last = NULL;
+    queue->running = false;
+    queue->block_on_compile = true;
+    queue->num_threads = 0;
+
+    jit->code_heap = create_code_heap();
+    jit->code_index_mem = create_tagged_mem_ctx(MEM_TAG_COMPILER);
+    init_vec(&jit->code_ranges, jit->code_index_mem, sizeof(struct CodeRange), 64);
+    pthread_rwlock_init(&jit->code_ranges_lock, NULL);
+    jit->code_cache = NULL;
+    jit->perf = NULL;
+    jit->debug_info = false;
+    jit->profile = false;
+    jit->source_markers = false;
+    jit->release_ir = false;
+    jit->dump_ir = false;
+    pthread_mutex_init(&jit->stats_lock, NULL);
+    memset(&jit->stats, 0, sizeof(struct CompileStats));
+}
+
+JIT* ojit_create_jit() {
+    JIT* jit = malloc(sizeof(JIT));
+    init_jit(jit);
     return jit;
 }
 
 
+// AOT compiled code refers to this JIT through a symbol
+JIT ojit_aot_jit;
+
+JIT* ojit_init_aot_jit() {
+    init_jit(&ojit_aot_jit);
+    return &ojit_aot_jit;
+}
+
+
+void jit_add_compile_stats(JIT* jit, struct CompileStats* stats) {
+    pthread_mutex_lock(&jit->stats_lock);
+    compile_stats_add(&jit->stats, stats);
+    pthread_mutex_unlock(&jit->stats_lock);
+}
+
+
 bool jit_add_file(JIT* jit, char* file_name) {
-    String source = read_file(&jit->strings, file_name);
+    String source = read_file(file_name);
     if (source) {
-        MemCtx* parser_mem = create_mem_ctx();
-        Parser* parser = create_parser(source, &jit->strings, &jit->function_records, jit->ir_mem, parser_mem);
+        // every file gets its own memory for its function records and its own function table, so files can be parsed side by side
+        MemCtx* file_ir_mem = create_tagged_mem_ctx(MEM_TAG_IR);
+        MemCtx* parser_mem = create_tagged_mem_ctx(MEM_TAG_PARSER);
+        struct HashTable file_functions;
+        init_hash_table(&file_functions, parser_mem);
+        struct CompileStats stats = {0};
+        uint64_t parse_start = compile_stats_now();
+        Parser* parser = create_parser(source, &jit->strings, &file_functions, file_ir_mem, parser_mem);
         parser_parse_source(parser);
+        stats.phase_ns[PHASE_PARSE] = compile_stats_now() - parse_start;
+        stats.phase_arena_bytes[PHASE_PARSE] = mem_ctx_allocated(file_ir_mem) + mem_ctx_allocated(parser_mem);
+        stats.files = 1;
+        TableEntry* entry = file_functions.last_entry;
+        while (entry) {
+            stats.phase_arena_bytes[PHASE_PARSE] += mem_ctx_allocated(((JITFunc) entry->value)->ir_mem);
+            entry = entry->prev;
+        }
+        jit_add_compile_stats(jit, &stats);
+
+        String file_name_str = string_table_add_copy(&jit->strings, file_name, strlen(file_name));
+
+        pthread_rwlock_wrlock(&jit->functions_lock);
+        MemCtx** mem_ptr = lalist_grow_add(&jit->file_mems, sizeof(MemCtx*));
+        *mem_ptr = file_ir_mem;
+        entry = file_functions.last_entry;
+        while (entry) {
+            ((JITFunc) entry->value)->source_file = file_name_str;
+            hash_table_insert(&jit->function_records, entry->key, entry->value);
+            entry = entry->prev;
+        }
+        pthread_rwlock_unlock(&jit->functions_lock);
+
         destroy_mem_ctx(parser_mem);
+        // identifiers are copied into the string table, so nothing points into the source anymore
+        free(source);
         return true;
     } else {
         return false;
@@ -30,52 +119,709 @@ bool jit_add_file(JIT* jit, char* file_name) {
 }
 
 
-JITFunc jit_get_function(JIT* jit, char* func_name, size_t name_len) {
-    String func_name_str = string_table_add(&jit->strings, func_name, name_len);
-    uint64_t func_ir_ptr;
-    hash_table_get(&jit->function_records, STRING_KEY(func_name_str), &func_ir_ptr);
-    return (void*) func_ir_ptr;
+JITFunc* jit_snapshot_functions(JIT* jit, uint64_t* num_funcs_ptr) {
+    pthread_rwlock_rdlock(&jit->functions_lock);
+    uint64_t num_funcs = jit->function_records.len;
+    JITFunc* funcs = malloc(num_funcs * sizeof(JITFunc));
+    uint64_t func_index = 0;
+    TableEntry* entry = jit->function_records.last_entry;
+    while (entry && func_index < num_funcs) {
+        funcs[func_index++] = (JITFunc) entry->value;
+        entry = entry->prev;
+    }
+    pthread_rwlock_unlock(&jit->functions_lock);
+    *num_funcs_ptr = func_index;
+    return funcs;
 }
 
-void* jit_compiled_callback(JIT* jit, String str) {
-    struct FunctionIR* func_ir_ptr;
-    hash_table_get(&jit->function_records, STRING_KEY(str), (uint64_t*) &func_ir_ptr);
-    return jit_get_compiled_function(jit, func_ir_ptr, NULL);
+
+bool jit_set_code_cache(JIT* jit, char* dir) {
+    struct CodeCache* cache = create_code_cache(dir);
+    if (cache == NULL) return false;
+    if (jit->code_cache) destroy_code_cache(jit->code_cache);
+    jit->code_cache = cache;
+    return true;
 }
 
+
+bool jit_enable_perf_output(JIT* jit, bool perf_map, char* jitdump_dir) {
+    struct PerfWriter* perf = create_perf_writer(perf_map, jitdump_dir);
+    if (perf == NULL) return false;
+    if (jit->perf) destroy_perf_writer(jit->perf);
+    jit->perf = perf;
+
+    // report whatever has been compiled already
+    uint64_t num_funcs;
+    JITFunc* funcs = jit_snapshot_functions(jit, &num_funcs);
+    for (uint64_t i = 0; i < num_funcs; i++) {
+        struct CompiledCode* version = atomic_load_explicit(&funcs[i]->compiled_code, memory_order_acquire);
+        if (version) perf_writer_add_function(perf, funcs[i], version->code, version->size);
+    }
+    free(funcs);
+    return true;
+}
+
+
+void jit_enable_debug_info(JIT* jit) {
+    jit->debug_info = true;
+}
+
+
+void jit_enable_profiling(JIT* jit) {
+    jit->profile = true;
+}
+
+
+void jit_enable_source_markers(JIT* jit) {
+    jit->source_markers = true;
+}
+
+
+void jit_enable_ir_dump(JIT* jit) {
+    jit->dump_ir = true;
+}
+
+
+void jit_enable_ir_release(JIT* jit) {
+    jit->release_ir = true;
+}
+
+
+// Profiled code gets recompiled from the IR once its counts are read, and source markers point into it
+void release_compiled_ir(JIT* jit, JITFunc func, struct GetFunctionCallback callback) {
+    if (jit->release_ir && !callback.profile && !callback.source_markers) {
+        release_function_ir(func);
+    }
+}
+
+
 void* jit_ir_callback(JIT* jit, String str) {
-    struct FunctionIR* func_ir_ptr;
+    struct FunctionIR* func_ir_ptr = NULL;
+    pthread_rwlock_rdlock(&jit->functions_lock);
     hash_table_get(&jit->function_records, STRING_KEY(str), (uint64_t*) &func_ir_ptr);
+    pthread_rwlock_unlock(&jit->functions_lock);
     return func_ir_ptr;
 }
 
+JITFunc jit_get_function(JIT* jit, char* func_name, size_t name_len) {
+    String func_name_str = string_table_add(&jit->strings, func_name, name_len);
+    return jit_ir_callback(jit, func_name_str);
+}
+
+OJIT_JIT_ABI void* jit_compiled_callback(JIT* jit, String str) {
+    struct FunctionIR* func_ir_ptr = jit_ir_callback(jit, str);
+    // jitted code has nothing to fall back to, so it always has to wait
+    return jit_require_compiled_function(jit, func_ir_ptr, NULL);
+}
+
+// Objects are never freed, so each thread can simply keep allocating them from its own context
+_Thread_local MemCtx* object_mem = NULL;
+
+OJIT_JIT_ABI void* jit_new_object_callback(JIT* jit) {
+    (void) jit;
+    if (object_mem == NULL) {
+        object_mem = create_tagged_mem_ctx(MEM_TAG_OBJECTS);
+    }
+    return new_hash_table(object_mem);
+}
+
+// Index of the last range starting at or before addr, or -1
+int64_t find_code_range(JIT* jit, uintptr_t addr) {
+    int64_t low = 0;
+    int64_t high = jit->code_ranges.len;
+    while (low < high) {
+        int64_t mid = low + (high - low) / 2;
+        if (VEC_GET(&jit->code_ranges, struct CodeRange, mid).start <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low - 1;
+}
+
+// Versions are never freed, so ranges only ever get added
+void add_code_range(JIT* jit, JITFunc func, struct CompiledCode* version) {
+    pthread_rwlock_wrlock(&jit->code_ranges_lock);
+    uint32_t index = find_code_range(jit, (uintptr_t) version->code) + 1;
+    vec_push(&jit->code_ranges);
+    struct CodeRange* ranges = (struct CodeRange*) jit->code_ranges.items;
+    memmove(ranges + index + 1, ranges + index, (jit->code_ranges.len - 1 - index) * sizeof(struct CodeRange));
+    ranges[index] = (struct CodeRange) {.start = (uintptr_t) version->code, .version = version, .func = func};
+    pthread_rwlock_unlock(&jit->code_ranges_lock);
+}
+
+// Only one thread at a time compiles a function (see CompileStatus), so nobody else replaces its version meanwhile
+void publish_compiled_function(JIT* jit, JITFunc func, struct CompiledCode* version) {
+    if (jit->perf) {
+        perf_writer_add_function(jit->perf, func, version->code, version->size);
+    }
+    if (jit->debug_info) {
+        debug_register_function(func, version->code, version->size);
+    }
+    add_code_range(jit, func, version);
+    version->previous = atomic_load_explicit(&func->compiled_code, memory_order_relaxed);
+    atomic_store_explicit(&func->compiled_code, version, memory_order_release);
+    atomic_store_explicit(&func->compiled, version->code, memory_order_release);
+}
+
+// The version code belongs to, code having been read from func->compiled (or an older version's code)
+struct CompiledCode* find_compiled_code(JITFunc func, void* code) {
+    struct CompiledCode* version = atomic_load_explicit(&func->compiled_code, memory_order_acquire);
+    while (version && version->code != code) {
+        version = version->previous;
+    }
+    return version;
+}
+
+void compile_and_install(JIT* jit, JITFunc func) {
+    struct GetFunctionCallback callback = {
+        .compiled_callback=jit_compiled_callback,
+        .ir_callback=jit_ir_callback,
+        .new_object_callback=jit_new_object_callback,
+        .jit_ptr=jit,
+        .profile=jit->profile && !func->has_profile,
+        .dump_ir=jit->dump_ir,
+        .source_markers=jit->source_markers,
+    };
+    if (callback.profile && func->profile_counters == NULL) {
+        // JIT code bumps these from every thread, so no two functions share a cache line
+        pthread_rwlock_wrlock(&jit->functions_lock);
+        func->profile_counters = ojit_alloc_aligned(jit->ir_mem, func->blocks.len * 2 * sizeof(uint64_t), OJIT_CACHE_LINE_SIZE);
+        pthread_rwlock_unlock(&jit->functions_lock);
+    }
+    // cached code carries neither counters, a profiled layout nor source markers
+    bool use_cache = jit->code_cache && !callback.profile && !func->has_profile && !callback.source_markers;
+
+    struct CompiledCode* version = calloc(1, sizeof(struct CompiledCode));
+    struct CompileStats stats = {0};
+    uint64_t install_start;
+    if (use_cache) {
+        install_start = compile_stats_now();
+        if (code_cache_load(jit->code_cache, func, &jit->strings, jit->code_heap, callback, version)) {
+            stats.phase_ns[PHASE_INSTALL] = compile_stats_now() - install_start;
+            stats.cache_hits = 1;
+            stats.code_bytes = version->size;
+            jit_add_compile_stats(jit, &stats);
+            release_compiled_ir(jit, func, callback);
+            publish_compiled_function(jit, func, version);
+            return;
+        }
+    }
+
+    MemCtx* compiler_mem = create_tagged_mem_ctx(MEM_TAG_COMPILER);
+    struct CompiledFunction compiled_func = ojit_compile_function(func, compiler_mem, callback, &stats);
+    install_start = compile_stats_now();
+    if (use_cache) {
+        code_cache_store(jit->code_cache, func, &compiled_func);
+    }
+    version->code = code_heap_install(jit->code_heap, compiled_func.mem, compiled_func.size);
+    version->size = compiled_func.size;
+    if (compiled_func.num_stack_maps) {
+        // the maps have to outlive the compiler's memory
+        version->stack_maps = malloc(compiled_func.num_stack_maps * sizeof(struct StackMap));
+        memcpy(version->stack_maps, compiled_func.stack_maps, compiled_func.num_stack_maps * sizeof(struct StackMap));
+        version->num_stack_maps = compiled_func.num_stack_maps;
+    }
+    if (compiled_func.num_markers) {
+        version->source_markers = malloc(compiled_func.num_markers * sizeof(struct SourceMarker));
+        memcpy(version->source_markers, compiled_func.markers, compiled_func.num_markers * sizeof(struct SourceMarker));
+        version->num_source_markers = compiled_func.num_markers;
+    }
+    destroy_mem_ctx(compiler_mem);
+    stats.phase_ns[PHASE_INSTALL] = compile_stats_now() - install_start;
+    jit_add_compile_stats(jit, &stats);
+    release_compiled_ir(jit, func, callback);
+
+    publish_compiled_function(jit, func, version);
+}
+
+
+void queue_push(struct CompileQueue* queue, JITFunc func) {
+    func->compile_status = COMPILE_QUEUED;
+    func->next_queued = NULL;
+    if (queue->last) {
+        queue->last->next_queued = func;
+    } else {
+        queue->first = func;
+    }
+    queue->last = func;
+}
+
+JITFunc queue_pop(struct CompileQueue* queue) {
+    JITFunc func = queue->first;
+    if (func) {
+        queue->first = func->next_queued;
+        if (queue->first == NULL) queue->last = NULL;
+        func->next_queued = NULL;
+    }
+    return func;
+}
+
+void queue_remove(struct CompileQueue* queue, JITFunc func) {
+    JITFunc prev = NULL;
+    JITFunc curr = queue->first;
+    while (curr && curr != func) {
+        prev = curr;
+        curr = curr->next_queued;
+    }
+    if (curr == NULL) return;
+    if (prev) {
+        prev->next_queued = func->next_queued;
+    } else {
+        queue->first = func->next_queued;
+    }
+    if (queue->last == func) queue->last = prev;
+    func->next_queued = NULL;
+}
+
+
+void* compile_thread_main(void* arg) {
+    JIT* jit = arg;
+    struct CompileQueue* queue = &jit->compile_queue;
+
+    pthread_mutex_lock(&queue->lock);
+    while (true) {
+        while (queue->running && queue->first == NULL) {
+            pthread_cond_wait(&queue->has_work, &queue->lock);
+        }
+        if (!queue->running) break;
+
+        JITFunc func = queue_pop(queue);
+        func->compile_status = COMPILE_RUNNING;
+        pthread_mutex_unlock(&queue->lock);
+
+        compile_and_install(jit, func);
+
+        pthread_mutex_lock(&queue->lock);
+        func->compile_status = COMPILE_NONE;
+        pthread_cond_broadcast(&queue->finished);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+
+uint32_t count_cores() {
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long cores = info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (cores < 1) return 1;
+    if (cores > OJIT_MAX_COMPILE_THREADS) return OJIT_MAX_COMPILE_THREADS;
+    return cores;
+}
+
+
+bool jit_start_compile_threads(JIT* jit, uint32_t num_threads, bool block_on_compile) {
+    if (num_threads == 0) num_threads = count_cores();
+    if (num_threads > OJIT_MAX_COMPILE_THREADS) num_threads = OJIT_MAX_COMPILE_THREADS;
+
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_lock(&queue->lock);
+    queue->block_on_compile = block_on_compile;
+    queue->running = true;
+    while (queue->num_threads < num_threads) {
+        if (pthread_create(&queue->threads[queue->num_threads], NULL, compile_thread_main, jit) != 0) break;
+        queue->num_threads++;
+    }
+    bool started = queue->num_threads > 0;
+    if (!started) queue->running = false;
+    pthread_mutex_unlock(&queue->lock);
+    return started;
+}
+
+
+void jit_stop_compile_threads(JIT* jit) {
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->running) {
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+    queue->running = false;
+    pthread_cond_broadcast(&queue->has_work);
+    uint32_t num_threads = queue->num_threads;
+    pthread_mutex_unlock(&queue->lock);
+
+    for (uint32_t i = 0; i < num_threads; i++) {
+        pthread_join(queue->threads[i], NULL);
+    }
+
+    // anything still queued gets compiled on demand again, so wake up whoever is waiting for it
+    pthread_mutex_lock(&queue->lock);
+    queue->num_threads = 0;
+    JITFunc func;
+    while ((func = queue_pop(queue)) != NULL) {
+        func->compile_status = COMPILE_NONE;
+    }
+    queue->block_on_compile = true;
+    pthread_cond_broadcast(&queue->finished);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+void* get_compiled_function(JIT* jit, JITFunc func, bool wait) {
+    void* compiled = atomic_load_explicit(&func->compiled, memory_order_acquire);
+    if (compiled) return compiled;
+
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_lock(&queue->lock);
+    while ((compiled = atomic_load_explicit(&func->compiled, memory_order_acquire)) == NULL) {
+        bool compile_here = false;
+        if (func->compile_status == COMPILE_NONE) {
+            if (queue->running && !wait) {
+                queue_push(queue, func);
+                pthread_cond_signal(&queue->has_work);
+            } else {
+                compile_here = true;
+            }
+        } else if (func->compile_status == COMPILE_QUEUED && wait) {
+            // don't wait behind the rest of the queue when we need it now
+            queue_remove(queue, func);
+            compile_here = true;
+        }
+
+        if (compile_here) {
+            func->compile_status = COMPILE_RUNNING;
+            pthread_mutex_unlock(&queue->lock);
+            compile_and_install(jit, func);
+            pthread_mutex_lock(&queue->lock);
+            func->compile_status = COMPILE_NONE;
+            pthread_cond_broadcast(&queue->finished);
+        } else if (wait) {
+            pthread_cond_wait(&queue->finished, &queue->lock);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return compiled;
+}
+
+
+void jit_compile_async(JIT* jit, JITFunc func) {
+    if (atomic_load_explicit(&func->compiled, memory_order_acquire)) return;
+
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_lock(&queue->lock);
+    bool running = queue->running;
+    if (running && func->compile_status == COMPILE_NONE && atomic_load(&func->compiled) == NULL) {
+        queue_push(queue, func);
+        pthread_cond_signal(&queue->has_work);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (!running) get_compiled_function(jit, func, true);
+}
+
+
+void jit_compile_all(JIT* jit, uint32_t num_threads) {
+    uint64_t num_funcs;
+    JITFunc* funcs = jit_snapshot_functions(jit, &num_funcs);
+
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_lock(&queue->lock);
+    bool was_running = queue->running;
+    pthread_mutex_unlock(&queue->lock);
+
+    bool has_workers = was_running || jit_start_compile_threads(jit, num_threads, true);
+    if (has_workers) {
+        pthread_mutex_lock(&queue->lock);
+        for (uint64_t i = 0; i < num_funcs; i++) {
+            JITFunc func = funcs[i];
+            if (func->compile_status == COMPILE_NONE && atomic_load(&func->compiled) == NULL) {
+                queue_push(queue, func);
+            }
+        }
+        pthread_cond_broadcast(&queue->has_work);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    // the calling thread pitches in too: waiting on a queued function compiles it right here
+    for (uint64_t i = 0; i < num_funcs; i++) {
+        get_compiled_function(jit, funcs[i], true);
+    }
+    free(funcs);
+
+    if (has_workers && !was_running) jit_stop_compile_threads(jit);
+}
+
+
+// Waits for any compile of func to finish and marks it as running, so no one else compiles it or rewrites its blocks
+void claim_function_blocks(JIT* jit, JITFunc func) {
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_lock(&queue->lock);
+    while (func->compile_status == COMPILE_RUNNING) {
+        pthread_cond_wait(&queue->finished, &queue->lock);
+    }
+    if (func->compile_status == COMPILE_QUEUED) queue_remove(queue, func);
+    func->compile_status = COMPILE_RUNNING;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void release_function_blocks(JIT* jit, JITFunc func) {
+    struct CompileQueue* queue = &jit->compile_queue;
+    pthread_mutex_lock(&queue->lock);
+    func->compile_status = COMPILE_NONE;
+    pthread_cond_broadcast(&queue->finished);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+bool read_profile_counters(JITFunc func) {
+    if (func->profile_counters == NULL || func->ir_mem == NULL) return false;
+    struct BlockIR* block = func->first_block;
+    while (block) {
+        // the instrumented code may still be running, so this is only a snapshot
+        block->exec_count = func->profile_counters[block->block_index * 2];
+        block->true_count = func->profile_counters[block->block_index * 2 + 1];
+        block = block->next_block;
+    }
+    func->has_profile = true;
+    return true;
+}
+
+
+bool jit_read_profile(JIT* jit, JITFunc func) {
+    claim_function_blocks(jit, func);
+    bool has_profile = read_profile_counters(func);
+    release_function_blocks(jit, func);
+    return has_profile;
+}
+
+
+bool jit_recompile_function(JIT* jit, JITFunc func) {
+    // nobody else may compile the function while its profile is read and its blocks are reordered
+    claim_function_blocks(jit, func);
+    if (!read_profile_counters(func)) {
+        release_function_blocks(jit, func);
+        return false;
+    }
+
+    ojit_layout_blocks(func);
+    compile_and_install(jit, func);
+
+    release_function_blocks(jit, func);
+    return true;
+}
+
+
+bool jit_write_object_file(JIT* jit, char* path) {
+    uint64_t num_funcs;
+    JITFunc* funcs = jit_snapshot_functions(jit, &num_funcs);
+    for (uint64_t i = 0; i < num_funcs; i++) {
+        if (atomic_load(&funcs[i]->compiled) || funcs[i]->compile_status != COMPILE_NONE) {
+            ojit_new_error();
+            ojit_build_error_chars("Can't write an object file for functions which have already been compiled: ");
+            ojit_build_error_String(funcs[i]->name);
+            ojit_error();
+            free(funcs);
+            return false;
+        }
+    }
+    bool ok = aot_write_object(funcs, num_funcs, path, jit->dump_ir);
+    free(funcs);
+    return ok;
+}
+
+
 void* jit_get_compiled_function(JIT* jit, JITFunc func, size_t* len) {
-    if (func->compiled == NULL) {
-        MemCtx* compiler_mem = create_mem_ctx();
-        struct CompiledFunction compiled_func = ojit_compile_function(func, compiler_mem, (struct GetFunctionCallback) {
-            .compiled_callback=jit_compiled_callback,
-            .ir_callback=jit_ir_callback,
-            .jit_ptr=jit
-        });
-        func->compiled = copy_to_executable(compiled_func.mem, compiled_func.size);
-        if (len) {
-            *len = compiled_func.size;
+    void* compiled = get_compiled_function(jit, func, jit->compile_queue.block_on_compile);
+    if (compiled && len) {
+        *len = find_compiled_code(func, compiled)->size;
+    }
+    return compiled;
+}
+
+
+void* jit_require_compiled_function(JIT* jit, JITFunc func, size_t* len) {
+    void* compiled = get_compiled_function(jit, func, true);
+    if (len) {
+        *len = compiled ? find_compiled_code(func, compiled)->size : 0;
+    }
+    return compiled;
+}
+
+
+struct StackMap* version_stack_map(struct CompiledCode* version, uintptr_t offset) {
+    uint32_t low = 0;
+    uint32_t high = version->num_stack_maps;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        struct StackMap* map = &version->stack_maps[mid];
+        if (map->return_offset == offset) {
+            return map;
+        } else if (map->return_offset < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+
+struct StackMap* jit_get_stack_map(JITFunc func, void* return_address) {
+    // the frame may belong to any version which was ever installed
+    struct CompiledCode* version = atomic_load_explicit(&func->compiled_code, memory_order_acquire);
+    uintptr_t offset = 0;
+    while (version) {
+        offset = (uintptr_t) return_address - (uintptr_t) version->code;
+        if (offset <= version->size) break;
+        version = version->previous;
+    }
+    if (version == NULL) return NULL;
+    return version_stack_map(version, offset);
+}
+
+
+// Looks the address up in the code ranges, so a stack walk doesn't go through every function
+struct StackMap* jit_find_stack_map(JIT* jit, void* return_address, JITFunc* func_ptr) {
+    struct StackMap* map = NULL;
+    pthread_rwlock_rdlock(&jit->code_ranges_lock);
+    int64_t index = find_code_range(jit, (uintptr_t) return_address);
+    if (index >= 0) {
+        struct CodeRange* range = &VEC_GET(&jit->code_ranges, struct CodeRange, index);
+        uintptr_t offset = (uintptr_t) return_address - range->start;
+        if (offset <= range->version->size) {
+            map = version_stack_map(range->version, offset);
+            if (map && func_ptr) *func_ptr = range->func;
+        }
+    }
+    pthread_rwlock_unlock(&jit->code_ranges_lock);
+    return map;
+}
+
+
+// A recompile may publish a newer version meanwhile, so callers pass the one their sample offsets refer to
+void dump_function_listing(JIT* jit, JITFunc func, struct CompiledCode* version, FILE* stream, uint64_t* sample_counts) {
+    if (stream == NULL) {
+        stream = stdout;
+    }
+    uint8_t* code = version->code;
+    size_t code_len = version->size;
+
+    struct DisasmAnnotations annotations = {
+        .markers = version->source_markers,
+        .num_markers = version->num_source_markers,
+        .block_counts = NULL,
+        .sample_counts = sample_counts,
+    };
+    // the IR is read below, a profile read or recompile mustn't rewrite the blocks meanwhile
+    claim_function_blocks(jit, func);
+    uint64_t* block_counts = NULL;
+    if ((func->has_profile || func->profile_counters) && func->ir_mem) {
+        block_counts = malloc(func->blocks.len * sizeof(uint64_t));
+        struct BlockIR* block = func->first_block;
+        while (block) {
+            // a recompiled function's code has no counters left, only what jit_read_profile saw
+            block_counts[block->block_index] = func->has_profile ? block->exec_count
+                                                                 : func->profile_counters[block->block_index * 2];
+            block = block->next_block;
         }
-        destroy_mem_ctx(compiler_mem);
+        annotations.block_counts = block_counts;
     }
-    return func->compiled;
+    disasm_function(stream, func, code, code_len, &annotations);
+    release_function_blocks(jit, func);
+    free(block_counts);
 }
 
 
 void jit_dump_function(JIT* jit, JITFunc func, FILE* stream) {
+    uint8_t* code = jit_require_compiled_function(jit, func, NULL);
+    dump_function_listing(jit, func, find_compiled_code(func, code), stream, NULL);
+}
+
+
+void jit_dump_function_samples(JIT* jit, JITFunc func, FILE* stream, void** sample_addrs, uint64_t num_samples) {
+    uint8_t* code = jit_require_compiled_function(jit, func, NULL);
+    struct CompiledCode* version = find_compiled_code(func, code);
+    size_t code_len = version->size;
+    uint64_t* sample_counts = calloc(code_len ? code_len : 1, sizeof(uint64_t));
+    for (uint64_t i = 0; i < num_samples; i++) {
+        uintptr_t offset = (uintptr_t) sample_addrs[i] - (uintptr_t) code;
+        if ((uintptr_t) sample_addrs[i] >= (uintptr_t) code && offset < code_len) sample_counts[offset]++;
+    }
+    dump_function_listing(jit, func, version, stream, sample_counts);
+    free(sample_counts);
+}
+
+void jit_get_compile_stats(JIT* jit, struct CompileStats* stats) {
+    pthread_mutex_lock(&jit->stats_lock);
+    *stats = jit->stats;
+    pthread_mutex_unlock(&jit->stats_lock);
+}
+
+
+void jit_reset_compile_stats(JIT* jit) {
+    pthread_mutex_lock(&jit->stats_lock);
+    memset(&jit->stats, 0, sizeof(struct CompileStats));
+    pthread_mutex_unlock(&jit->stats_lock);
+}
+
+
+char* compile_phase_names[NUM_COMPILE_PHASES] = {
+    [PHASE_PARSE] = "parse",
+    [PHASE_OPTIMIZE] = "optimize",
+    [PHASE_EMIT] = "emit",
+    [PHASE_STITCH] = "stitch",
+    [PHASE_INSTALL] = "install",
+};
+
+void jit_dump_compile_stats(JIT* jit, FILE* stream) {
+    if (stream == NULL) {
+        stream = stdout;
+    }
+    struct CompileStats stats;
+    jit_get_compile_stats(jit, &stats);
+
+    fprintf(stream, "{\n    \"phases\": {\n");
+    for (int i = 0; i < NUM_COMPILE_PHASES; i++) {
+        fprintf(stream, "        \"%s\": {\"ns\": %llu, \"arena_bytes\": %llu}%s\n", compile_phase_names[i],
+                (unsigned long long) stats.phase_ns[i], (unsigned long long) stats.phase_arena_bytes[i],
+                i + 1 < NUM_COMPILE_PHASES ? "," : "");
+    }
+    fprintf(stream, "    },\n");
+    fprintf(stream, "    \"files\": %llu,\n", (unsigned long long) stats.files);
+    fprintf(stream, "    \"functions\": %llu,\n", (unsigned long long) stats.functions);
+    fprintf(stream, "    \"cache_hits\": %llu,\n", (unsigned long long) stats.cache_hits);
+    fprintf(stream, "    \"blocks\": %llu,\n", (unsigned long long) stats.blocks);
+    fprintf(stream, "    \"instructions\": %llu,\n", (unsigned long long) stats.instructions);
+    fprintf(stream, "    \"spills\": %llu,\n", (unsigned long long) stats.spills);
+    fprintf(stream, "    \"moves\": %llu,\n", (unsigned long long) stats.moves);
+    fprintf(stream, "    \"code_bytes\": %llu\n", (unsigned long long) stats.code_bytes);
+    fprintf(stream, "}\n");
+    fflush(stream);
+}
+
+
+void jit_get_memory_stats(JIT* jit, struct MemStats stats[NUM_MEM_TAGS]) {
+    (void) jit;
+    for (int tag = 0; tag < NUM_MEM_TAGS; tag++) {
+        mem_tag_get_stats(tag, &stats[tag]);
+    }
+}
+
+
+void jit_dump_memory_stats(JIT* jit, FILE* stream) {
     if (stream == NULL) {
         stream = stdout;
     }
-    size_t code_len;
-    uint8_t* code = jit_get_compiled_function(jit, func, &code_len);
-    for (int i = 0; i < code_len; i++) {
-        fprintf(stream, "%02x", code[i]);
+    struct MemStats stats[NUM_MEM_TAGS];
+    jit_get_memory_stats(jit, stats);
+
+    fprintf(stream, "{\n");
+    for (int tag = 0; tag < NUM_MEM_TAGS; tag++) {
+        fprintf(stream, "    \"%s\": {\"allocated\": %llu, \"reserved\": %llu, \"arenas\": %u, "
+                        "\"peak_allocated\": %llu, \"peak_reserved\": %llu}%s\n", mem_tag_names[tag],
+                (unsigned long long) stats[tag].allocated, (unsigned long long) stats[tag].reserved, stats[tag].num_arenas,
+                (unsigned long long) stats[tag].peak_allocated, (unsigned long long) stats[tag].peak_reserved,
+                tag + 1 < NUM_MEM_TAGS ? "," : "");
     }
-    fprintf(stream, "\n");
+    fprintf(stream, "}\n");
     fflush(stream);
-}
\ No newline at end of file
+}
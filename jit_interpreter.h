@@ -4,22 +4,121 @@
 #include "ojit_mem.h"
 #include "hash_table.h"
 #include "ojit_string.h"
+#include "compile_stats.h"
 #include <stdio.h>
+#include <pthread.h>
+
+#define OJIT_MAX_COMPILE_THREADS (64)
+
+struct CompileQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t finished;
+
+    struct FunctionIR* first;
+    struct FunctionIR* last;
+
+    bool running;
+    bool block_on_compile;
+    uint32_t num_threads;
+    pthread_t threads[OJIT_MAX_COMPILE_THREADS];
+};
+
+struct CodeRange {
+    uintptr_t start;
+    struct CompiledCode* version;
+    struct FunctionIR* func;
+};
 
 typedef struct s_JITState {
     MemCtx* ir_mem;
     MemCtx* string_mem;
     struct StringTable strings;
     struct HashTable function_records;
+    pthread_rwlock_t functions_lock;  // guards function_records, file_mems and ir_mem
+    LAList* file_mems;
+    struct CompileQueue compile_queue;
+    struct CodeHeap* code_heap;
+    MemCtx* code_index_mem;
+    Vec code_ranges;  // struct CodeRange of every version ever installed, sorted by address
+    pthread_rwlock_t code_ranges_lock;
+    struct CodeCache* code_cache;  // NULL unless jit_set_code_cache was called
+    struct PerfWriter* perf;  // NULL unless jit_enable_perf_output was called
+    bool debug_info;
+    bool profile;
+    bool source_markers;
+    bool release_ir;
+    bool dump_ir;
+    pthread_mutex_t stats_lock;
+    struct CompileStats stats;  // totals over every compile thread
 } JIT;
 
 typedef struct FunctionIR* JITFunc;
 
-#define jit_call_function(jit, func, typ, args...) ((typ) jit_get_compiled_function((jit), (func), NULL))(args)
+#define jit_call_function(jit, func, typ, args...) ((typ) jit_require_compiled_function((jit), (func), NULL))(args)
 JIT* ojit_create_jit();
+// Linux only: writes /tmp/perf-<pid>.map entries and/or jitdump records to jitdump_dir (if not NULL) for all compiled code.
+// Should be called before compile threads are started.
+bool jit_enable_perf_output(JIT* jit, bool perf_map, char* jitdump_dir);
+// Registers every function compiled from now on with GDB's JIT interface and the unwinder, so backtraces work across them
+void jit_enable_debug_info(JIT* jit);
+// Functions compiled from now on count how often each block runs, see jit_read_profile
+void jit_enable_profiling(JIT* jit);
+// Functions compiled from now on remember which block and IR instruction each piece of their code came from,
+// so jit_dump_function can interleave the IR with the disassembly
+void jit_enable_source_markers(JIT* jit);
+// Functions compiled from now on free their IR once their code is installed, unless profiling or source markers
+// still need it. Such functions can't be recompiled or written to an object file, and their dumps show no IR.
+void jit_enable_ir_release(JIT* jit);
+// Functions compiled from now on (and object files written) print their IR first
+void jit_enable_ir_dump(JIT* jit);
+// Sets up ojit_aot_jit, which code from jit_write_object_file runs against
+JIT* ojit_init_aot_jit();
 bool jit_add_file(JIT* jit, char* file_name);
+// Reuses machine code compiled by earlier runs from dir (which is created if needed), and stores new code there.
+// Fails if dir isn't a directory owned by the current user, or if others may write to it.
+// Should be called before any function is compiled.
+bool jit_set_code_cache(JIT* jit, char* dir);
 JITFunc jit_get_function(JIT* jit, char* func_name, size_t name_len);
+// Takes a snapshot of the functions added so far, so other threads can keep adding files. The array is malloc'd.
+JITFunc* jit_snapshot_functions(JIT* jit, uint64_t* num_funcs_ptr);
+
+// Returns NULL while the function is still being compiled in the background, unless the JIT blocks on compiles
 void* jit_get_compiled_function(JIT* jit, JITFunc func, size_t* len);
+// Always returns the compiled function, waiting for (or doing) the compilation if necessary
+void* jit_require_compiled_function(JIT* jit, JITFunc func, size_t* len);
+// Queues the function for the compile thread (or compiles it right away if there is no thread running)
+void jit_compile_async(JIT* jit, JITFunc func);
+// Prints a disassembly of the function, annotated with its blocks, IR and block counts wherever those are known
 void jit_dump_function(JIT* jit, JITFunc func, FILE* stream);
+// Like jit_dump_function, with a column counting how many of the sampled instruction addresses hit each instruction
+void jit_dump_function_samples(JIT* jit, JITFunc func, FILE* stream, void** sample_addrs, uint64_t num_samples);
+
+// Copies the counts gathered by a profiling compile into the function's blocks. Returns false if it wasn't profiled.
+bool jit_read_profile(JIT* jit, JITFunc func);
+// Compiles the function again without counters, laying its blocks out by the profile read so far.
+// Code which is already running keeps using the old version.
+bool jit_recompile_function(JIT* jit, JITFunc func);
+
+// Copies out the time and memory spent in each compile phase so far
+void jit_get_compile_stats(JIT* jit, struct CompileStats* stats);
+void jit_reset_compile_stats(JIT* jit);
+void jit_dump_compile_stats(JIT* jit, FILE* stream);
+// Copies out the memory held by each subsystem (see MemTag), summed over every JIT in the process
+void jit_get_memory_stats(JIT* jit, struct MemStats stats[NUM_MEM_TAGS]);
+void jit_dump_memory_stats(JIT* jit, FILE* stream);
+
+// Compiles every function added so far into an ELF object file (see aot.h), instead of into memory.
+// Their IR is consumed, so they can't be JIT compiled afterwards.
+bool jit_write_object_file(JIT* jit, char* path);
+
+// num_threads = 0 starts one thread per core
+bool jit_start_compile_threads(JIT* jit, uint32_t num_threads, bool block_on_compile);
+void jit_stop_compile_threads(JIT* jit);
+// Eagerly compiles every function which has been added so far, spread over num_threads workers
+void jit_compile_all(JIT* jit, uint32_t num_threads);
+
+struct StackMap* jit_get_stack_map(JITFunc func, void* return_address);
+struct StackMap* jit_find_stack_map(JIT* jit, void* return_address, JITFunc* func_ptr);
 
 #endif //OJIT_JIT_INTERPRETER_H
@@ -0,0 +1,207 @@
+#include "jit_perf.h"
+
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// region Jitdump Records
+// see tools/perf/Documentation/jitdump-specification.txt in the Linux sources
+#define JITDUMP_MAGIC (0x4A695444)
+#define JITDUMP_VERSION (1)
+#define JIT_CODE_LOAD (0)
+#define JIT_CODE_DEBUG_INFO (2)
+
+struct JitdumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct JitdumpRecordHeader {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+// followed by the null-terminated function name and the code
+struct JitdumpCodeLoad {
+    struct JitdumpRecordHeader header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+// followed by nr_entry JitdumpDebugEntry records
+struct JitdumpDebugInfo {
+    struct JitdumpRecordHeader header;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+};
+
+// followed by the null-terminated file name
+struct JitdumpDebugEntry {
+    uint64_t code_addr;
+    uint32_t line;
+    uint32_t discrim;
+};
+// endregion
+
+struct PerfWriter {
+    pthread_mutex_t lock;
+    FILE* map_file;
+    FILE* dump_file;
+    void* dump_marker;
+    size_t dump_marker_size;
+    uint64_t code_index;
+};
+
+
+// perf has to be recorded with `-k mono` for these to line up with its samples
+uint64_t perf_timestamp() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+
+bool open_jitdump(struct PerfWriter* writer, char* dir) {
+    char path[strlen(dir) + 32];
+    sprintf(path, "%s/jit-%d.dump", dir, getpid());
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0) return false;
+
+    // perf finds the dump through this mapping showing up in the recording
+    writer->dump_marker_size = sysconf(_SC_PAGESIZE);
+    writer->dump_marker = mmap(NULL, writer->dump_marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (writer->dump_marker == MAP_FAILED) {
+        close(fd);
+        writer->dump_marker = NULL;
+        return false;
+    }
+    writer->dump_file = fdopen(fd, "wb");
+
+    struct JitdumpHeader header = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof(struct JitdumpHeader),
+        .elf_mach = 62,  // x86-64
+        .pad1 = 0,
+        .pid = getpid(),
+        .timestamp = perf_timestamp(),
+        .flags = 0,
+    };
+    fwrite(&header, sizeof(header), 1, writer->dump_file);
+    fflush(writer->dump_file);
+    return true;
+}
+
+
+struct PerfWriter* create_perf_writer(bool perf_map, char* jitdump_dir) {
+    struct PerfWriter* writer = malloc(sizeof(struct PerfWriter));
+    pthread_mutex_init(&writer->lock, NULL);
+    writer->map_file = NULL;
+    writer->dump_file = NULL;
+    writer->dump_marker = NULL;
+    writer->code_index = 0;
+
+    if (perf_map) {
+        char path[64];
+        sprintf(path, "/tmp/perf-%d.map", getpid());
+        writer->map_file = fopen(path, "w");
+    }
+    if (jitdump_dir) {
+        open_jitdump(writer, jitdump_dir);
+    }
+    if (writer->map_file == NULL && writer->dump_file == NULL) {
+        destroy_perf_writer(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+
+void destroy_perf_writer(struct PerfWriter* writer) {
+    if (writer->map_file) fclose(writer->map_file);
+    if (writer->dump_file) fclose(writer->dump_file);
+    if (writer->dump_marker) munmap(writer->dump_marker, writer->dump_marker_size);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+}
+
+
+void perf_writer_add_function(struct PerfWriter* writer, struct FunctionIR* func, void* code, size_t size) {
+    String name = func->name;
+    pthread_mutex_lock(&writer->lock);
+    if (writer->map_file) {
+        fprintf(writer->map_file, "%lx %lx %.*s\n", (unsigned long) code, (unsigned long) size, name->length, name->start_ptr);
+        fflush(writer->map_file);
+    }
+
+    if (writer->dump_file) {
+        uint64_t timestamp = perf_timestamp();
+        // line info has to come before the code it describes; we only know where each function starts
+        if (func->source_file) {
+            struct JitdumpDebugInfo debug_info = {
+                .header = {
+                    .id = JIT_CODE_DEBUG_INFO,
+                    .total_size = sizeof(struct JitdumpDebugInfo) + sizeof(struct JitdumpDebugEntry) + func->source_file->length + 1,
+                    .timestamp = timestamp,
+                },
+                .code_addr = (uint64_t) code,
+                .nr_entry = 1,
+            };
+            struct JitdumpDebugEntry entry = {.code_addr = (uint64_t) code, .line = func->source_line, .discrim = 0};
+            fwrite(&debug_info, sizeof(debug_info), 1, writer->dump_file);
+            fwrite(&entry, sizeof(entry), 1, writer->dump_file);
+            fwrite(func->source_file->start_ptr, 1, func->source_file->length, writer->dump_file);
+            fputc(0, writer->dump_file);
+        }
+
+        struct JitdumpCodeLoad code_load = {
+            .header = {
+                .id = JIT_CODE_LOAD,
+                .total_size = sizeof(struct JitdumpCodeLoad) + name->length + 1 + size,
+                .timestamp = timestamp,
+            },
+            .pid = getpid(),
+            .tid = syscall(SYS_gettid),
+            .vma = (uint64_t) code,
+            .code_addr = (uint64_t) code,
+            .code_size = size,
+            .code_index = writer->code_index++,
+        };
+        fwrite(&code_load, sizeof(code_load), 1, writer->dump_file);
+        fwrite(name->start_ptr, 1, name->length, writer->dump_file);
+        fputc(0, writer->dump_file);
+        fwrite(code, 1, size, writer->dump_file);
+        fflush(writer->dump_file);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+#else
+struct PerfWriter* create_perf_writer(bool perf_map, char* jitdump_dir) {
+    return NULL;
+}
+
+void destroy_perf_writer(struct PerfWriter* writer) {
+}
+
+void perf_writer_add_function(struct PerfWriter* writer, struct FunctionIR* func, void* code, size_t size) {
+}
+#endif
@@ -0,0 +1,19 @@
+#ifndef OJIT_JIT_PERF_H
+#define OJIT_JIT_PERF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "asm_ir.h"
+
+// Tells Linux `perf` about JIT code, through /tmp/perf-<pid>.map and/or a jitdump file
+// (jit-<pid>.dump, to be merged with `perf inject --jit` from a `perf record -k mono` session)
+struct PerfWriter;
+
+// Returns NULL if nothing could be opened, or on other systems than Linux
+struct PerfWriter* create_perf_writer(bool perf_map, char* jitdump_dir);
+void destroy_perf_writer(struct PerfWriter* writer);
+void perf_writer_add_function(struct PerfWriter* writer, struct FunctionIR* func, void* code, size_t size);
+
+#endif //OJIT_JIT_PERF_H
@@ -1,26 +1,23 @@
 #include <stdio.h>
-#include <sys/time.h>
+#include <string.h>
 
 #include "jit_interpreter.h"
 #include "obj.h"
 #include "ojit_def.h"
 
-typedef OJITValue (*FuncType)(OJITValue);
+typedef OJITValue (OJIT_JIT_ABI *FuncType)(OJITValue);
 
-double time_function(JIT* jit, JITFunc func, int arg) {
-    int iterations = 1000000000;
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    for (int i = 0; i < iterations; i++) {
-        jit_call_function(jit, func, FuncType, arg);
+int main(int argc, char** argv) {
+    // ojit -c <source> -o <object file>
+    if (argc == 5 && strcmp(argv[1], "-c") == 0 && strcmp(argv[3], "-o") == 0) {
+        JIT* jit = ojit_create_jit();
+        jit_enable_ir_dump(jit);
+        if (!jit_add_file(jit, argv[2])) return 1;
+        return jit_write_object_file(jit, argv[4]) ? 0 : 1;
     }
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    double time_in_nsec = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
-    return time_in_nsec / iterations;
-}
 
-int main() {
     JIT* jit = ojit_create_jit();
+    jit_enable_ir_dump(jit);
     bool success = jit_add_file(jit, "test.txt");
     if (success) {
         JITFunc main_func = jit_get_function(jit, "main", 4);
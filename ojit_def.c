@@ -4,8 +4,9 @@
 #include <assert.h>
 #include <string.h>
 
-char err_msg_buf[256] = { [0 ... 255] = 0};
-uint8_t msg_size = 0;
+// each thread builds its own error message
+_Thread_local char err_msg_buf[256] = { [0 ... 255] = 0};
+_Thread_local uint8_t msg_size = 0;
 
 void ojit_new_error() {
     memset(err_msg_buf, 0, 256);
@@ -6,6 +6,14 @@
 
 #include "ojit_string.h"
 
+// Generated code follows the Windows x64 calling convention on every platform,
+// so whatever calls into it or is called from it has to as well
+#ifdef __GNUC__
+#define OJIT_JIT_ABI __attribute__((ms_abi))
+#else
+#define OJIT_JIT_ABI
+#endif
+
 #ifdef OJIT_SKIP_CHECKS
 #define OJIT_ASSERT(cond, err_msg) do {} while (0)
 #else
@@ -1,11 +1,18 @@
 #include "ojit_mem.h"
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include "ojit_def.h"
 
+// Arenas start small, since most contexts only hold a handful of records, and double up to the max size
 #define OJIT_ARENA_SIZE (1024)
+#define OJIT_ARENA_MAX_SIZE (64 * 1024)
+#define OJIT_ARENA_CLASSES (7)  // one for every size from OJIT_ARENA_SIZE to OJIT_ARENA_MAX_SIZE
+// How much memory destroyed contexts may leave in the pool for the next ones
+#define OJIT_ARENA_POOL_MAX_BYTES (4 * 1024 * 1024)
 
 typedef struct s_MemArena {
     uint8_t* curr_ptr;
@@ -17,56 +24,300 @@ typedef struct s_MemArena {
 
 struct s_OJITMemCtx {
     MemArena* curr_arena;
+    MemArena* large_chunks;  // dedicated chunks for big allocations, linked through prev_arena
+    size_t next_arena_size;
+    size_t allocated;
+    size_t reserved;
+    uint32_t num_arenas;
+    size_t peak_allocated;  // only brought up to date when allocated goes down, see mem_ctx_get_stats
+    size_t peak_reserved;
+    enum MemTag tag;
+    struct MemStats counted;  // what the tag totals hold for this context
 };
 
-void mem_ctx_new_arena(MemCtx* ctx) {
-    MemArena* arena = malloc(sizeof(struct s_MemArena) + OJIT_ARENA_SIZE);
+// region Arena Pool
+// Arenas of destroyed contexts (and ones rewound past) are kept here, so compiling many functions
+// keeps reusing warm memory instead of going through malloc and free for every arena
+struct ArenaPool {
+    pthread_mutex_t lock;
+    MemArena* free_arenas[OJIT_ARENA_CLASSES];  // linked through prev_arena
+    size_t pooled_bytes;
+};
+
+struct ArenaPool arena_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+uint32_t arena_size_class(size_t size) {
+    uint32_t size_class = 0;
+    while ((size_t) OJIT_ARENA_SIZE << size_class < size) size_class++;
+    return size_class;
+}
+
+MemArena* arena_pool_take(size_t size) {
+    uint32_t size_class = arena_size_class(size);
+    pthread_mutex_lock(&arena_pool.lock);
+    MemArena* arena = arena_pool.free_arenas[size_class];
+    if (arena) {
+        arena_pool.free_arenas[size_class] = arena->prev_arena;
+        arena_pool.pooled_bytes -= size;
+    }
+    pthread_mutex_unlock(&arena_pool.lock);
+    return arena;
+}
+
+// Takes the chain from arena back to (not including) stop_at
+void arena_pool_give(MemArena* arena, MemArena* stop_at) {
+    pthread_mutex_lock(&arena_pool.lock);
+    while (arena != stop_at) {
+        MemArena* prev_arena = arena->prev_arena;
+        size_t size = arena->end_ptr - arena->mem;
+        if (arena_pool.pooled_bytes + size <= OJIT_ARENA_POOL_MAX_BYTES) {
+            uint32_t size_class = arena_size_class(size);
+            arena->prev_arena = arena_pool.free_arenas[size_class];
+            arena_pool.free_arenas[size_class] = arena;
+            arena_pool.pooled_bytes += size;
+        } else {
+            free(arena);
+        }
+        arena = prev_arena;
+    }
+    pthread_mutex_unlock(&arena_pool.lock);
+}
+
+void mem_pool_trim() {
+    pthread_mutex_lock(&arena_pool.lock);
+    for (int size_class = 0; size_class < OJIT_ARENA_CLASSES; size_class++) {
+        MemArena* arena = arena_pool.free_arenas[size_class];
+        while (arena) {
+            MemArena* prev_arena = arena->prev_arena;
+            free(arena);
+            arena = prev_arena;
+        }
+        arena_pool.free_arenas[size_class] = NULL;
+    }
+    arena_pool.pooled_bytes = 0;
+    pthread_mutex_unlock(&arena_pool.lock);
+}
+// endregion
+
+// region Tag Totals
+char* mem_tag_names[NUM_MEM_TAGS] = {
+    [MEM_TAG_OTHER] = "other",
+    [MEM_TAG_STRINGS] = "strings",
+    [MEM_TAG_PARSER] = "parser",
+    [MEM_TAG_IR] = "ir",
+    [MEM_TAG_COMPILER] = "compiler",
+    [MEM_TAG_OBJECTS] = "objects",
+};
+
+// Live sums over the contexts of each tag. Contexts only report to them when they take or give back arenas,
+// so the allocator's fast path never touches the lock.
+struct MemTagTotals {
+    pthread_mutex_t lock;
+    struct MemStats tags[NUM_MEM_TAGS];
+};
+
+struct MemTagTotals mem_tag_totals = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Has to be called with the lock held
+void mem_tag_count(MemCtx* ctx) {
+    struct MemStats* totals = &mem_tag_totals.tags[ctx->tag];
+    totals->allocated += ctx->allocated - ctx->counted.allocated;
+    totals->reserved += ctx->reserved - ctx->counted.reserved;
+    totals->num_arenas += ctx->num_arenas - ctx->counted.num_arenas;
+    if (totals->allocated > totals->peak_allocated) totals->peak_allocated = totals->allocated;
+    if (totals->reserved > totals->peak_reserved) totals->peak_reserved = totals->reserved;
+    ctx->counted.allocated = ctx->allocated;
+    ctx->counted.reserved = ctx->reserved;
+    ctx->counted.num_arenas = ctx->num_arenas;
+}
+
+void mem_tag_sync(MemCtx* ctx) {
+    pthread_mutex_lock(&mem_tag_totals.lock);
+    mem_tag_count(ctx);
+    pthread_mutex_unlock(&mem_tag_totals.lock);
+}
+
+// For destroyed contexts: counts what they allocated since the last sync towards the peaks, then takes all of it out of the totals
+void mem_tag_forget(MemCtx* ctx) {
+    pthread_mutex_lock(&mem_tag_totals.lock);
+    mem_tag_count(ctx);
+    struct MemStats* totals = &mem_tag_totals.tags[ctx->tag];
+    totals->allocated -= ctx->counted.allocated;
+    totals->reserved -= ctx->counted.reserved;
+    totals->num_arenas -= ctx->counted.num_arenas;
+    pthread_mutex_unlock(&mem_tag_totals.lock);
+}
+
+void mem_tag_get_stats(enum MemTag tag, struct MemStats* stats) {
+    pthread_mutex_lock(&mem_tag_totals.lock);
+    *stats = mem_tag_totals.tags[tag];
+    pthread_mutex_unlock(&mem_tag_totals.lock);
+}
+// endregion
+
+void mem_ctx_reserve(MemCtx* ctx, size_t size) {
+    ctx->reserved += size;
+    ctx->num_arenas++;
+    if (ctx->reserved > ctx->peak_reserved) ctx->peak_reserved = ctx->reserved;
+}
+
+// Takes the bytes and arenas of the chain from arena back to (not including) stop_at off the context's counts
+void mem_ctx_unreserve(MemCtx* ctx, MemArena* arena, MemArena* stop_at) {
+    for (; arena != stop_at; arena = arena->prev_arena) {
+        ctx->reserved -= arena->end_ptr - arena->mem;
+        ctx->num_arenas--;
+    }
+}
+
+void mem_ctx_new_arena(MemCtx* ctx, size_t size) {
+    MemArena* arena = arena_pool_take(size);
+    if (arena == NULL) arena = malloc(sizeof(struct s_MemArena) + size);
+    if (arena == NULL) {
+        ojit_new_error();
+        ojit_build_error_chars("Out of memory while allocating an Arena");
+        ojit_error();
+        exit(-1);
+    }
     arena->next_arena = NULL;
     arena->prev_arena = ctx->curr_arena;
     if (ctx->curr_arena) ctx->curr_arena->next_arena = arena;
     ctx->curr_arena = arena;
 
     arena->curr_ptr = arena->mem;
-    arena->end_ptr = &arena->mem[OJIT_ARENA_SIZE];
+    arena->end_ptr = &arena->mem[size];
+    mem_ctx_reserve(ctx, size);
+    mem_tag_sync(ctx);
+}
+
+uint8_t* mem_align_ptr(uint8_t* ptr, size_t align) {
+    return (uint8_t*) (((uintptr_t) ptr + align - 1) & ~(uintptr_t) (align - 1));
+}
+
+// Allocations that would take up a good part of a fresh arena get a chunk of their own,
+// so the space left in the current arena isn't thrown away
+void* mem_ctx_alloc_large(MemCtx* ctx, size_t size, size_t align) {
+    // malloc already aligns for any basic type
+    size_t padding = align > _Alignof(max_align_t) ? align - 1 : 0;
+    MemArena* chunk = malloc(sizeof(struct s_MemArena) + size + padding);
+    if (chunk == NULL) {
+        ojit_new_error();
+        ojit_build_error_chars("Out of memory while allocating a large chunk");
+        ojit_error();
+        exit(-1);
+    }
+    chunk->next_arena = NULL;
+    chunk->prev_arena = ctx->large_chunks;
+    chunk->curr_ptr = chunk->end_ptr = &chunk->mem[size + padding];
+    ctx->large_chunks = chunk;
+    mem_ctx_reserve(ctx, size + padding);
+    mem_tag_sync(ctx);
+    return mem_align_ptr(chunk->mem, align);
 }
 
 MemCtx* create_mem_ctx() {
+    return create_tagged_mem_ctx(MEM_TAG_OTHER);
+}
+
+MemCtx* create_tagged_mem_ctx(enum MemTag tag) {
     MemCtx* ctx = malloc(sizeof(struct s_OJITMemCtx));
     ctx->curr_arena = NULL;
-    mem_ctx_new_arena(ctx);
+    ctx->large_chunks = NULL;
+    ctx->next_arena_size = OJIT_ARENA_SIZE;
+    ctx->allocated = 0;
+    ctx->reserved = 0;
+    ctx->num_arenas = 0;
+    ctx->peak_allocated = 0;
+    ctx->peak_reserved = 0;
+    ctx->tag = tag;
+    ctx->counted = (struct MemStats) {0};
+    mem_ctx_new_arena(ctx, OJIT_ARENA_SIZE);
 
     return ctx;
 }
 
-void destroy_mem_ctx(MemCtx* ctx) {
-    MemArena* curr_arena = ctx->curr_arena;
-    MemArena* next_arena = NULL;
-
-    while (curr_arena) {
-        next_arena = curr_arena->next_arena;
-        free(curr_arena);
-        curr_arena = next_arena;
+void free_large_chunks(MemArena* chunk, MemArena* stop_at) {
+    while (chunk != stop_at) {
+        MemArena* prev_chunk = chunk->prev_arena;
+        free(chunk);
+        chunk = prev_chunk;
     }
+}
 
+void destroy_mem_ctx(MemCtx* ctx) {
+    mem_tag_forget(ctx);
+    // curr_arena is always the newest one
+    arena_pool_give(ctx->curr_arena, NULL);
+    free_large_chunks(ctx->large_chunks, NULL);
     free(ctx);
 }
 
-void* ojit_alloc(MemCtx* ctx, size_t size) {
-    if (size > OJIT_ARENA_SIZE) {
-        ojit_new_error();
-        ojit_build_error_chars("Attempted to allocate a size larger than the size of an Arena");
-        ojit_error();
-        exit(-1);
-    }
-    if (ctx->curr_arena->curr_ptr + size >= ctx->curr_arena->end_ptr) {
-        mem_ctx_new_arena(ctx);
+MemMark mem_ctx_mark(MemCtx* ctx) {
+    return (MemMark) {
+        .arena = ctx->curr_arena,
+        .curr_ptr = ctx->curr_arena->curr_ptr,
+        .large_chunks = ctx->large_chunks,
+        .allocated = ctx->allocated,
+    };
+}
+
+void mem_ctx_rewind(MemCtx* ctx, MemMark mark) {
+    if (ctx->allocated > ctx->peak_allocated) ctx->peak_allocated = ctx->allocated;
+    mem_ctx_unreserve(ctx, ctx->curr_arena, mark.arena);
+    mem_ctx_unreserve(ctx, ctx->large_chunks, mark.large_chunks);
+    arena_pool_give(ctx->curr_arena, mark.arena);
+    free_large_chunks(ctx->large_chunks, mark.large_chunks);
+    ctx->curr_arena = mark.arena;
+    ctx->curr_arena->next_arena = NULL;
+    ctx->curr_arena->curr_ptr = mark.curr_ptr;
+    ctx->large_chunks = mark.large_chunks;
+    ctx->allocated = mark.allocated;
+    mem_tag_sync(ctx);
+}
+
+void* ojit_alloc_aligned_uninit(MemCtx* ctx, size_t size, size_t align) {
+    MemArena* arena = ctx->curr_arena;
+    uint8_t* ptr = mem_align_ptr(arena->curr_ptr, align);
+    if ((uintptr_t) ptr + size > (uintptr_t) arena->end_ptr) {
+        if (ctx->next_arena_size < OJIT_ARENA_MAX_SIZE) ctx->next_arena_size *= 2;
+        if (size + align > ctx->next_arena_size / 4) {
+            ctx->allocated += size;
+            return mem_ctx_alloc_large(ctx, size, align);
+        }
+        mem_ctx_new_arena(ctx, ctx->next_arena_size);
+        arena = ctx->curr_arena;
+        ptr = mem_align_ptr(arena->curr_ptr, align);
     }
-    void* ptr = ctx->curr_arena->curr_ptr;
-    ctx->curr_arena->curr_ptr += size;
+    arena->curr_ptr = ptr + size;
+    ctx->allocated += size;
+    return ptr;
+}
+
+void* ojit_alloc_aligned(MemCtx* ctx, size_t size, size_t align) {
+    void* ptr = ojit_alloc_aligned_uninit(ctx, size, align);
     ojit_memset(ptr, 0, size);
     return ptr;
 }
 
+void* ojit_alloc_uninit(MemCtx* ctx, size_t size) {
+    return ojit_alloc_aligned_uninit(ctx, size, OJIT_ALLOC_ALIGN);
+}
+
+void* ojit_alloc(MemCtx* ctx, size_t size) {
+    return ojit_alloc_aligned(ctx, size, OJIT_ALLOC_ALIGN);
+}
+
+size_t mem_ctx_allocated(MemCtx* ctx) {
+    return ctx->allocated;
+}
+
+void mem_ctx_get_stats(MemCtx* ctx, struct MemStats* stats) {
+    stats->allocated = ctx->allocated;
+    stats->reserved = ctx->reserved;
+    stats->num_arenas = ctx->num_arenas;
+    stats->peak_allocated = ctx->allocated > ctx->peak_allocated ? ctx->allocated : ctx->peak_allocated;
+    stats->peak_reserved = ctx->peak_reserved;
+}
+
 LAList* lalist_grow(MemCtx* mem, LAList* prev, LAList* next) {
     LAList* node = ojit_alloc(mem, sizeof(LAList));
     node->ctx = mem;
@@ -133,6 +384,60 @@ void* lalist_iter_prev(LAListIter* iter) {
     return item;
 }
 
+// region Vec
+void init_vec(Vec* vec, MemCtx* ctx, uint32_t item_size, uint32_t cap) {
+    vec->items = ojit_alloc_uninit(ctx, (size_t) item_size * cap);
+    vec->len = 0;
+    vec->cap = cap;
+    vec->item_size = item_size;
+    vec->ctx = ctx;
+}
+
+Vec* new_vec(MemCtx* ctx, uint32_t item_size, uint32_t cap) {
+    Vec* vec = ojit_alloc_uninit(ctx, sizeof(Vec));
+    init_vec(vec, ctx, item_size, cap);
+    return vec;
+}
+
+void* vec_push(Vec* vec) {
+    if (vec->len == vec->cap) {
+        // the old items stay in the arena until the context is destroyed
+        uint32_t cap = vec->cap ? vec->cap * 2 : 4;
+        uint8_t* items = ojit_alloc_uninit(vec->ctx, (size_t) vec->item_size * cap);
+        ojit_memcpy(items, vec->items, (size_t) vec->item_size * vec->len);
+        vec->items = items;
+        vec->cap = cap;
+    }
+    return vec->items + (size_t) vec->item_size * vec->len++;
+}
+// endregion
+
+// region StableVec
+void init_stable_vec(StableVec* vec, MemCtx* ctx, uint32_t item_size) {
+    // the chunks are allocated once they are needed
+    for (int i = 0; i < STABLE_VEC_MAX_CHUNKS; i++) vec->chunks[i] = NULL;
+    vec->len = 0;
+    vec->item_size = item_size;
+    vec->ctx = ctx;
+}
+
+void* stable_vec_push(StableVec* vec) {
+    uint32_t index = vec->len;
+    uint32_t chunk = stable_vec_chunk_of(index);
+    if (chunk >= STABLE_VEC_MAX_CHUNKS) {
+        ojit_new_error();
+        ojit_build_error_chars("Too many items in a StableVec");
+        ojit_error();
+        exit(-1);
+    }
+    if (vec->chunks[chunk] == NULL) {
+        vec->chunks[chunk] = ojit_alloc(vec->ctx, (size_t) (STABLE_VEC_FIRST_CHUNK << chunk) * vec->item_size);
+    }
+    vec->len++;
+    return stable_vec_get(vec, index);
+}
+// endregion
+
 void ojit_memcpy(void* dest, void* src, size_t size) {
     memcpy(dest, src, size);
 }
@@ -140,4 +445,7 @@ void ojit_memcpy(void* dest, void* src, size_t size) {
 void ojit_memset(void* dest, uint8_t val, size_t num) {
     memset(dest, val, num);
 }
-#undef OJIT_ARENA_SIZE
\ No newline at end of file
+#undef OJIT_ARENA_SIZE
+#undef OJIT_ARENA_MAX_SIZE
+#undef OJIT_ARENA_CLASSES
+#undef OJIT_ARENA_POOL_MAX_BYTES
\ No newline at end of file
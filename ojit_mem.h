@@ -17,10 +17,66 @@
 #define LALIST_BLOCK_SIZE (500)
 
 typedef struct s_OJITMemCtx MemCtx;
+
+// Which part of the JIT a context belongs to, for adding up what each of them uses
+enum MemTag {
+    MEM_TAG_OTHER,
+    MEM_TAG_STRINGS,
+    MEM_TAG_PARSER,
+    MEM_TAG_IR,
+    MEM_TAG_COMPILER,
+    MEM_TAG_OBJECTS,
+    NUM_MEM_TAGS,
+};
+
+// Tagged MEM_TAG_OTHER
 MemCtx* create_mem_ctx();
+MemCtx* create_tagged_mem_ctx(enum MemTag tag);
 void destroy_mem_ctx(MemCtx* ctx);
 
+// Alignment of everything ojit_alloc hands out
+#define OJIT_ALLOC_ALIGN (8)
+#define OJIT_CACHE_LINE_SIZE (64)
+
+// Zeroed memory of any size, freed together with the context
 void* ojit_alloc(MemCtx* ctx, size_t size);
+// Leaves the memory as it was, for callers which write every byte they read themselves
+void* ojit_alloc_uninit(MemCtx* ctx, size_t size);
+// align has to be a power of two
+void* ojit_alloc_aligned(MemCtx* ctx, size_t size, size_t align);
+void* ojit_alloc_aligned_uninit(MemCtx* ctx, size_t size, size_t align);
+// Bytes handed out by ojit_alloc so far
+size_t mem_ctx_allocated(MemCtx* ctx);
+
+// region Memory Stats
+extern char* mem_tag_names[NUM_MEM_TAGS];
+
+struct MemStats {
+    size_t allocated;       // bytes handed out by ojit_alloc, alignment padding not included
+    size_t reserved;        // bytes of arenas and large chunks held
+    uint32_t num_arenas;    // large chunks included
+    size_t peak_allocated;  // high-water marks, rewinding lowers the others but not these
+    size_t peak_reserved;
+};
+
+void mem_ctx_get_stats(MemCtx* ctx, struct MemStats* stats);
+// Sums over the live contexts with the tag, in the whole process. Contexts report to them whenever they take
+// or give back an arena, so the allocated bytes may lag behind by up to an arena per context.
+void mem_tag_get_stats(enum MemTag tag, struct MemStats* stats);
+// endregion
+
+// A checkpoint in a context; rewinding to it releases everything allocated since in one go
+typedef struct s_MemMark {
+    struct s_MemArena* arena;
+    uint8_t* curr_ptr;
+    struct s_MemArena* large_chunks;
+    size_t allocated;
+} MemMark;
+MemMark mem_ctx_mark(MemCtx* ctx);
+// Marks taken after this one become invalid
+void mem_ctx_rewind(MemCtx* ctx, MemMark mark);
+// Frees the arenas destroyed contexts left for reuse
+void mem_pool_trim();
 
 typedef struct s_LAList {
     uint8_t mem[LALIST_BLOCK_SIZE];
@@ -46,6 +102,88 @@ void lalist_init_iter(LAListIter* iter, LAList* lalist, size_t index, size_t ite
 void* lalist_iter_next(LAListIter* iter);
 void* lalist_iter_prev(LAListIter* iter);
 
+// region Vec
+// Contiguous array which doubles when it is full. Growing moves the items, so only their indices stay valid.
+typedef struct s_Vec {
+    uint8_t* items;
+    uint32_t len;
+    uint32_t cap;
+    uint32_t item_size;
+    MemCtx* ctx;
+} Vec;
+
+#define VEC_GET(vec, type, index) (((type*) (vec)->items)[index])
+#define FOREACH_VEC(iter_var, vec, type) for (type* iter_var = (type*) (vec)->items; \
+                                              iter_var < (type*) (vec)->items + (vec)->len; iter_var++)
+
+void init_vec(Vec* vec, MemCtx* ctx, uint32_t item_size, uint32_t cap);
+Vec* new_vec(MemCtx* ctx, uint32_t item_size, uint32_t cap);
+// The new item is left uninitialized
+void* vec_push(Vec* vec);
+// endregion
+
+// region StableVec
+// Keeps its items in chunks of 8, 16, 32... items which never move, for things other records point to.
+// Indexing finds the chunk with a bit scan, and iterating walks each chunk linearly.
+#define STABLE_VEC_FIRST_CHUNK (8)
+#define STABLE_VEC_MAX_CHUNKS (16)
+
+typedef struct s_StableVec {
+    uint8_t* chunks[STABLE_VEC_MAX_CHUNKS];  // chunk k holds STABLE_VEC_FIRST_CHUNK << k items
+    uint32_t len;
+    uint32_t item_size;
+    MemCtx* ctx;
+} StableVec;
+
+typedef struct s_StableVecIter {
+    StableVec* vec;
+    uint8_t* curr;
+    uint8_t* chunk_end;
+    uint32_t chunk;
+    uint32_t index;
+} StableVecIter;
+
+#define FOREACH_STABLE(iter_var, iter_over, type) StableVecIter iter_##iter_var; \
+                                                  stable_vec_init_iter(&iter_##iter_var, (iter_over)); \
+                                                  type* iter_var; \
+                                                  while (((iter_var) = stable_vec_iter_next(&iter_##iter_var)) != NULL)
+
+void init_stable_vec(StableVec* vec, MemCtx* ctx, uint32_t item_size);
+// The new item is zeroed, like memory from ojit_alloc
+void* stable_vec_push(StableVec* vec);
+
+static inline uint32_t stable_vec_chunk_of(uint32_t index) {
+    return 31 - __builtin_clz(index / STABLE_VEC_FIRST_CHUNK + 1);
+}
+
+static inline void* stable_vec_get(StableVec* vec, uint32_t index) {
+    uint32_t chunk = stable_vec_chunk_of(index);
+    uint32_t chunk_start = STABLE_VEC_FIRST_CHUNK * ((1u << chunk) - 1);
+    return vec->chunks[chunk] + (size_t) (index - chunk_start) * vec->item_size;
+}
+
+static inline void stable_vec_init_iter(StableVecIter* iter, StableVec* vec) {
+    iter->vec = vec;
+    iter->curr = iter->chunk_end = NULL;
+    iter->chunk = (uint32_t) -1;
+    iter->index = 0;
+}
+
+// Items pushed while iterating are visited as well
+static inline void* stable_vec_iter_next(StableVecIter* iter) {
+    if (iter->index >= iter->vec->len) return NULL;
+    if (iter->curr == iter->chunk_end) {
+        iter->chunk++;
+        iter->curr = iter->vec->chunks[iter->chunk];
+        iter->chunk_end = iter->curr + (size_t) (STABLE_VEC_FIRST_CHUNK << iter->chunk) * iter->vec->item_size;
+    }
+    void* item = iter->curr;
+    iter->curr += iter->vec->item_size;
+    iter->index++;
+    return item;
+}
+// endregion
+
 void ojit_memcpy(void* dest, void* src, size_t size);
 void ojit_memset(void* dest, uint8_t val, size_t num);
 
@@ -10,6 +10,7 @@
 bool init_string_table(struct StringTable* table, MemCtx* mem) {
     table->first_block = lalist_grow(mem, NULL, NULL);
     table->mem = mem;
+    pthread_rwlock_init(&table->lock, NULL);
     table->null_string.start_ptr = (char*) &table->null_string;
     table->null_string.length = 0;
     table->null_string.hash = hash_bytes("", 0);
@@ -21,19 +22,48 @@ bool string_equal(String a, String b) {
 }
 
 
-String string_table_add(struct StringTable* table, char* ptr, uint32_t length) {
+String string_table_find(struct StringTable* table, char* ptr, uint32_t length, uint32_t hash) {
+    size_t insert_index = hash % (LALIST_BLOCK_SIZE / sizeof(struct s_StringRecord));
+
+    LAList* curr_block = table->first_block;
+    while (curr_block) {
+        struct s_StringRecord* existing = lalist_get(curr_block, sizeof(struct s_StringRecord), insert_index);
+        if (existing->length == 0) {
+            return NULL;
+        }
+        if (existing->hash == hash && existing->length == length && (strncmp(existing->start_ptr, ptr, existing->length) == 0)) {
+            return existing;
+        }
+        curr_block = curr_block->next;
+    }
+    return NULL;
+}
+
+
+String string_table_intern(struct StringTable* table, char* ptr, uint32_t length, bool copy) {
     if (length == 0) {
         return &table->null_string;
     }
     uint32_t hash = hash_bytes(ptr, length);
+
+    // nearly every lookup is for a string which is already interned, so those only need to share the table
+    pthread_rwlock_rdlock(&table->lock);
+    String found = string_table_find(table, ptr, length, hash);
+    pthread_rwlock_unlock(&table->lock);
+    if (found) {
+        return found;
+    }
+
     size_t insert_index = hash % (LALIST_BLOCK_SIZE / sizeof(struct s_StringRecord));
 
+    pthread_rwlock_wrlock(&table->lock);
     LAList* curr_block = table->first_block;
     while (true) {
         struct s_StringRecord* existing = lalist_get(curr_block, sizeof(struct s_StringRecord), insert_index);
         if (existing->length != 0) {
             if (existing->hash == hash && existing->length == length && (strncmp(existing->start_ptr, ptr, existing->length) == 0)) {
-                return existing;
+                found = existing;
+                break;
             } else {
                 if (curr_block->next) {
                     curr_block = curr_block->next;
@@ -42,15 +72,32 @@ String string_table_add(struct StringTable* table, char* ptr, uint32_t length) {
                 }
             }
         } else {
+            if (copy) {
+                // packed into the table's arena, which lives as long as the strings
+                char* owned = ojit_alloc_uninit(table->mem, length);
+                memcpy(owned, ptr, length);
+                ptr = owned;
+            }
             existing->start_ptr = ptr;
             existing->length = length;
             existing->hash = hash;
-            return existing;
+            found = existing;
+            break;
         }
     }
+    pthread_rwlock_unlock(&table->lock);
+    return found;
+}
+
+String string_table_add(struct StringTable* table, char* ptr, uint32_t length) {
+    return string_table_intern(table, ptr, length, false);
+}
+
+String string_table_add_copy(struct StringTable* table, char* ptr, uint32_t length) {
+    return string_table_intern(table, ptr, length, true);
 }
 
-String read_file(struct StringTable* table, char* path) {
+String read_file(char* path) {
     FILE* file = fopen(path, "r");
     if (file == NULL) {
         printf("Path is not valid.\n");
@@ -60,10 +107,15 @@ String read_file(struct StringTable* table, char* path) {
     size_t file_size = ftell(file);
     rewind(file);
 
-    char* buf = malloc(file_size);
+    // zero-terminated, since the lexer looks one character ahead
+    String s = malloc(sizeof(struct s_StringRecord) + file_size + 1);
+    char* buf = (char*) (s + 1);
 
     size_t amount_read = fread(buf, sizeof(char), file_size, file);
-    String s = string_table_add(table, buf, amount_read);
+    buf[amount_read] = '\0';
+    s->start_ptr = buf;
+    s->length = amount_read;
+    s->hash = hash_bytes(buf, amount_read);
     fclose(file);
     return s;
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "ojit_mem.h"
 
 typedef struct s_StringRecord {
@@ -14,14 +15,18 @@ typedef struct s_StringRecord {
 struct StringTable {
     LAList* first_block;
     MemCtx* mem;
+    pthread_rwlock_t lock;
     struct s_StringRecord null_string;
 };
 
 bool init_string_table(struct StringTable* table, MemCtx* mem);
 String string_table_add(struct StringTable* table, char* ptr, uint32_t length);
+// Like string_table_add, but doesn't keep a reference to ptr, so it can be used with temporary buffers
+String string_table_add_copy(struct StringTable* table, char* ptr, uint32_t length);
 
 bool string_equal(String a, String b);
 
-String read_file(struct StringTable* table, char* path);
+// The contents aren't interned. Returns a single malloc'd block, which the caller frees.
+String read_file(char* path);
 
 #endif //OJIT_OJIT_STRING_H
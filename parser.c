@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 enum TokenType {
     TOKEN_DEF,
@@ -116,6 +117,7 @@ struct Trie construct_trie(char* sequences[], size_t num_sequences) {
 
 struct Trie basic_token_trie;
 struct TrieNode* basic_token_trie_root = NULL;
+pthread_once_t basic_token_trie_once = PTHREAD_ONCE_INIT;
 char* BASIC_TOKENS[28] = {
         "{", "}", "(", ")",
         "=", "==",
@@ -215,7 +217,7 @@ void init_trie() {
 Token lexer_emit_token(struct Lexer* lexer, enum TokenType type) {
     lexer->next_token = (Token) {
             .type = type,
-            .text = string_table_add(lexer->table_ptr, lexer->start, lexer->curr - lexer->start),
+            .text = string_table_add_copy(lexer->table_ptr, lexer->start, lexer->curr - lexer->start),
     };
     lexer->is_next_lexed = true;
     return lexer->next_token;
@@ -223,7 +225,8 @@ Token lexer_emit_token(struct Lexer* lexer, enum TokenType type) {
 
 
 Token lexer_emit_ident(struct Lexer* lexer) {
-    String text = string_table_add(lexer->table_ptr, lexer->start, lexer->curr - lexer->start);
+    // copied, so the source can be freed once it's parsed
+    String text = string_table_add_copy(lexer->table_ptr, lexer->start, lexer->curr - lexer->start);
     enum TokenType type;
     if (string_equal(text, lexer->keywords[TOKEN_DEF])) {
         type = TOKEN_DEF;
@@ -328,12 +331,10 @@ char* get_token_name(enum TokenType type) {
 }
 
 struct Lexer* create_lexer(struct StringTable* table_ptr, String source, MemCtx* parser_mem) {
-    struct Lexer* lexer = ojit_alloc(parser_mem, sizeof(struct Lexer));
+    struct Lexer* lexer = ojit_alloc_uninit(parser_mem, sizeof(struct Lexer));
     lexer->table_ptr = table_ptr;
 
-    if (basic_token_trie_root == NULL) {
-        init_trie();
-    }
+    pthread_once(&basic_token_trie_once, init_trie);
 
     lexer->keywords[TOKEN_DEF] = string_table_add(lexer->table_ptr, "def", 3);
     lexer->keywords[TOKEN_RETURN] = string_table_add(lexer->table_ptr, "return", 6);
@@ -350,6 +351,16 @@ struct Lexer* create_lexer(struct StringTable* table_ptr, String source, MemCtx*
     return lexer;
 }
 
+
+uint64_t lex_source(String source, struct StringTable* string_table, MemCtx* parser_mem) {
+    struct Lexer* lexer = create_lexer(string_table, source, parser_mem);
+    uint64_t num_tokens = 0;
+    while (lexer_next_token(lexer).type != TOKEN_EOF) {
+        num_tokens++;
+    }
+    return num_tokens;
+}
+
 enum LValueType {
     LVALUE_NONE,
     LVALUE_VAR,
@@ -372,6 +383,10 @@ typedef struct s_Parser {
     struct HashTable* func_table;
     MemCtx* ir_mem;
     struct LValueState lvalue_state;
+
+    // functions come in order, so their line numbers are counted incrementally
+    char* line_ptr;
+    uint32_t line;
 } Parser;
 
 
@@ -495,12 +510,22 @@ IRValue parse_terminal(Parser* parser) {
 }
 
 
+// Arguments are passed in RCX, RDX, R8 and R9
+#define OJIT_MAX_CALL_ARGS (4)
+
 IRValue parse_function_call(Parser* parser, IRValue expr) {
-    expr = builder_Call(parser->builder, expr);
+    // the arguments are evaluated first, so their instructions have to come before the call's
+    IRValue args[OJIT_MAX_CALL_ARGS];
+    uint32_t num_args = 0;
     parser_expect(parser, TOKEN_LEFT_PAREN);
     while (!parser_peek_is(parser, TOKEN_RIGHT_PAREN)) {
-        IRValue arg = parse_expression(parser);
-        builder_Call_argument(expr, arg);
+        if (num_args == OJIT_MAX_CALL_ARGS) {
+            ojit_new_error();
+            ojit_build_error_chars("Too many arguments, a call can pass at most 4");
+            ojit_error();
+            exit(-1);
+        }
+        args[num_args++] = parse_expression(parser);
         if (parser_peek_is(parser, TOKEN_COMMA)) {
             parser_expect(parser, TOKEN_COMMA);
             continue;
@@ -509,6 +534,11 @@ IRValue parse_function_call(Parser* parser, IRValue expr) {
         }
     }
     parser_expect(parser, TOKEN_RIGHT_PAREN);
+
+    expr = builder_Call(parser->builder, expr);
+    for (uint32_t i = 0; i < num_args; i++) {
+        builder_Call_argument(parser->builder, expr, args[i]);
+    }
     return expr;
 }
 
@@ -628,7 +658,9 @@ void parse_while(Parser* parser) {
 
     builder_enter_block(parser->builder, do_block);
     parse_statement(parser);
-    builder_Branch(parser->builder, cond_block);
+    if (parser->builder->current_block->terminator.ir_base.id == ID_TERM_NONE) {
+        builder_Branch(parser->builder, cond_block);
+    }
 
     builder_enter_block(parser->builder, after_block);
 }
@@ -689,7 +721,10 @@ void parse_block(Parser* parser) {
     }
     parser_expect(parser, TOKEN_RIGHT_BRACE);
     struct BlockIR* after_block = builder_add_block(parser->builder, parser->builder->current_block);
-    builder_Branch(parser->builder, after_block);
+    // a return inside the braces has to stay the block's terminator
+    if (parser->builder->current_block->terminator.ir_base.id == ID_TERM_NONE) {
+        builder_Branch(parser->builder, after_block);
+    }
     builder_enter_block(parser->builder, after_block);
 }
 
@@ -708,11 +743,18 @@ void parse_statement(Parser* parser) {
 // endregion
 
 void parse_function(Parser* parser) {
+    // "def" has already been peeked, so the lexer's start points at it
+    char* source_start = parser->lexer->start;
+    while (parser->line_ptr < source_start) {
+        if (*parser->line_ptr == '\n') parser->line++;
+        parser->line_ptr++;
+    }
     parser_expect(parser, TOKEN_DEF);
 
     Token name = parser_expect(parser, TOKEN_IDENT);
     struct FunctionIR* func = create_function(name.text, parser->ir_mem);
-    IRBuilder* builder = parser->builder = create_builder(func, parser->ir_mem);
+    func->source_line = parser->line;
+    IRBuilder* builder = parser->builder = create_builder(func, func->ir_mem);
 
     parser_expect(parser, TOKEN_LEFT_PAREN);
     while (!parser_peek_is(parser, TOKEN_RIGHT_PAREN)) {
@@ -733,6 +775,8 @@ void parse_function(Parser* parser) {
         parse_statement(parser);
     }
     parser_expect(parser, TOKEN_RIGHT_BRACE);
+    func->source_length = parser->lexer->curr - source_start;
+    func->source_hash = hash_bytes_64(source_start, func->source_length);
 
     parser->builder = NULL;
     hash_table_insert(parser->func_table, STRING_KEY(func->name), (uint64_t) func);
@@ -761,13 +805,15 @@ void parser_parse_source(Parser* parser) {
 
 Parser* create_parser(String source, struct StringTable* string_table, struct HashTable* function_table, MemCtx* ir_mem, MemCtx* parser_mem) {
     struct Lexer* lexer = create_lexer(string_table, source, parser_mem);
-    Parser* parser = ojit_alloc(parser_mem, sizeof(Parser));
+    Parser* parser = ojit_alloc_uninit(parser_mem, sizeof(Parser));
     parser->lexer = lexer;
     parser->builder = NULL;
     parser->func_table = function_table;
     parser->ir_mem = ir_mem;
 
     parser->lvalue_state.lvalue_type = LVALUE_NONE;
+    parser->line_ptr = source->start_ptr;
+    parser->line = 1;
     return parser;
 }
 
@@ -8,5 +8,7 @@ typedef struct s_Parser Parser;
 
 Parser* create_parser(String source, struct StringTable* string_table, struct HashTable* function_table, MemCtx* ir_mem, MemCtx* parser_mem);
 void parser_parse_source(Parser* parser);
+// Runs only the lexer over the source and returns how many tokens it found
+uint64_t lex_source(String source, struct StringTable* string_table, MemCtx* parser_mem);
 
 #endif //OJIT_PARSER_H
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../parser.h"
+#include "../compiler/compiler.h"
+
+// Compiles functions with objects live across calls and checks each call's stack map reports exactly those,
+// at a location the collector can read after the call clobbered the volatile registers.
+
+#define NUM_OBJECTS (10)
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+uint32_t count_bits(uint64_t bits) {
+    uint32_t count = 0;
+    for (; bits; bits &= bits - 1) count++;
+    return count;
+}
+
+uint32_t map_num_live(struct StackMap* map) {
+    return count_bits(map->live_regs) + count_bits(map->live_slots);
+}
+
+void check_volatile_regs_pushed(struct CompiledFunction* compiled) {
+    uint16_t volatile_regs = (1 << RAX) | (1 << RCX) | (1 << RDX) | (1 << R8) | (1 << R9) | (1 << R10) | (1 << R11);
+    for (uint32_t i = 0; i < compiled->num_stack_maps; i++) {
+        struct StackMap* map = &compiled->stack_maps[i];
+        CHECK((map->live_regs & volatile_regs & ~map->pushed_regs) == 0,
+              "map %u: live_regs %x has volatile registers which weren't pushed (%x)", i, map->live_regs, map->pushed_regs);
+    }
+}
+
+struct CompiledFunction compile_source(char* source, char* name, MemCtx* mem) {
+    struct StringTable* strings = ojit_alloc(mem, sizeof(struct StringTable));
+    init_string_table(strings, mem);
+    String source_str = string_table_add(strings, source, strlen(source));
+
+    struct HashTable* functions = ojit_alloc(mem, sizeof(struct HashTable));
+    init_hash_table(functions, mem);
+    Parser* parser = create_parser(source_str, strings, functions, mem, mem);
+    parser_parse_source(parser);
+
+    String name_str = string_table_add(strings, name, strlen(name));
+    uint64_t func;
+    if (!hash_table_get(functions, STRING_KEY(name_str), &func)) {
+        printf("FAIL: %s wasn't parsed\n", name);
+        exit(1);
+    }
+
+    // linked directly, so globals don't make calls of their own
+    struct GetFunctionCallback callback = {0};
+    callback.aot = true;
+    return ojit_compile_function((struct FunctionIR*) func, mem, callback, NULL);
+}
+
+// An object created before a call and passed on after it
+void test_object_live_across_call() {
+    MemCtx* mem = create_mem_ctx();
+    struct CompiledFunction compiled = compile_source(
+        "def id(x) {\n    return x;\n}\n\n"
+        "def pick(x, y) {\n    return y;\n}\n\n"
+        "def g(a) {\n    let o = {};\n    let r = id(a);\n    return pick(r, o);\n}\n", "g", mem);
+
+    // the allocation, then the calls to id and pick
+    CHECK(compiled.num_stack_maps == 3, "expected 3 stack maps, got %u", compiled.num_stack_maps);
+    if (compiled.num_stack_maps == 3) {
+        CHECK(map_num_live(&compiled.stack_maps[0]) == 1, "only the parameter is live at the allocation of o");
+        CHECK(map_num_live(&compiled.stack_maps[1]) == 1, "o is live at the call to id, got %u values", map_num_live(&compiled.stack_maps[1]));
+        CHECK(map_num_live(&compiled.stack_maps[2]) == 0, "o is dead once it's passed to pick");
+        CHECK(compiled.stack_maps[0].return_offset < compiled.stack_maps[1].return_offset, "maps are sorted by return address");
+    }
+    check_volatile_regs_pushed(&compiled);
+    destroy_mem_ctx(mem);
+}
+
+// More objects live at once than there are registers, so some are in spill slots,
+// and values held across several calls, which were only assigned their location at a later one
+void test_many_objects_live_across_calls() {
+    char source[4096];
+    size_t len = snprintf(source, sizeof(source), "def id(x) {\n    return x;\n}\n\ndef pick(x, y) {\n    return y;\n}\n\ndef g(a) {\n");
+    for (int i = 0; i < NUM_OBJECTS; i++) len += snprintf(source + len, sizeof(source) - len, "    let o%d = {};\n", i);
+    len += snprintf(source + len, sizeof(source) - len, "    let r = id(a);\n");
+    for (int i = 0; i < NUM_OBJECTS; i++) len += snprintf(source + len, sizeof(source) - len, "    r = pick(r, o%d);\n", i);
+    snprintf(source + len, sizeof(source) - len, "    return r;\n}\n");
+
+    MemCtx* mem = create_mem_ctx();
+    struct CompiledFunction compiled = compile_source(source, "g", mem);
+
+    // each allocation sees the parameter and the objects before it, id(a) all objects, then each pick(r, o) one less
+    CHECK(compiled.num_stack_maps == 2 * NUM_OBJECTS + 1, "expected %d stack maps, got %u", 2 * NUM_OBJECTS + 1, compiled.num_stack_maps);
+    if (compiled.num_stack_maps == 2 * NUM_OBJECTS + 1) {
+        for (uint32_t i = 0; i < compiled.num_stack_maps; i++) {
+            uint32_t expected = i < NUM_OBJECTS ? i + 1 : 2 * NUM_OBJECTS - i;
+            CHECK(map_num_live(&compiled.stack_maps[i]) == expected, "map %u: expected %u live values, got %u", i, expected, map_num_live(&compiled.stack_maps[i]));
+        }
+        CHECK(compiled.stack_maps[NUM_OBJECTS].live_slots != 0, "some objects were spilled");
+    }
+    check_volatile_regs_pushed(&compiled);
+    destroy_mem_ctx(mem);
+}
+
+int main() {
+    test_object_live_across_call();
+    test_many_objects_live_across_calls();
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("stack maps ok\n");
+    return 0;
+}